@@ -1,15 +1,32 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstddef>
 #include <cstring>
 #include <functional>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <new>
 #include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
 
 #include "buffer/buffer_manager.h"
 #include "common/defer.h"
 #include "common/macros.h"
-#include "storage/segment.h"
+#include "common/stats.h"
+#include "index/tree_segment.h"
+#include "log/wal.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #define UNUSED(p)  ((void)(p))
 
@@ -17,32 +34,206 @@ using namespace std;
 
 namespace buzzdb {
 
-template<typename KeyT, typename ValueT, typename ComparatorT, size_t PageSize>
-struct BTree : public Segment {
+/// In-node search policies of `BTree`. A policy returns the index of the
+/// first of `count` sorted keys that is not less than `key` and chooses the
+/// alignment of the key arrays in the nodes, the capacities of the nodes are
+/// derived from it.
+
+/// Binary search with the comparator, keys are packed behind the header.
+struct BinarySearch {
+    static constexpr size_t kKeyAlignment = 1;
+
+    template<typename KeyT, typename ComparatorT>
+    static uint32_t lower_bound(const KeyT *keys, uint32_t count, const KeyT &key) {
+        uint32_t low = 0;
+        uint32_t high = count;
+        while (low < high) {
+            uint32_t m = ((high - low) / 2) + low;
+            if (ComparatorT()(keys[m], key)) {
+                low = m + 1;
+            } else {
+                high = m;
+            }
+        }
+        return low;
+    }
+};
+
+/// Linear search, for small nodes. Arithmetic keys compared with `std::less`
+/// count the smaller keys without branches, which the compiler vectorizes.
+/// Keys start at a cache line.
+struct LinearSearch {
+    static constexpr size_t kKeyAlignment = 64;
+
+    template<typename KeyT, typename ComparatorT>
+    static uint32_t lower_bound(const KeyT *keys, uint32_t count, const KeyT &key) {
+        uint32_t low = 0;
+        if constexpr (std::is_arithmetic_v<KeyT> && std::is_same_v<ComparatorT, std::less<KeyT>>) {
+            for (uint32_t i = 0; i < count; i++) {
+                low += keys[i] < key;
+            }
+        } else {
+            while (low < count && ComparatorT()(keys[low], key)) {
+                low++;
+            }
+        }
+        return low;
+    }
+};
+
+/// The default. Arithmetic keys compared with `std::less` narrow the range
+/// with a binary search down to two cache lines and count the smaller keys in
+/// that window without branches, with AVX2 when it is available. All other
+/// keys use a plain binary search with the comparator. Keys start at a cache
+/// line.
+struct SimdSearch {
+    static constexpr size_t kKeyAlignment = 64;
+
+    template<typename KeyT, typename ComparatorT>
+    static uint32_t lower_bound(const KeyT *keys, uint32_t count, const KeyT &key) {
+        uint32_t low = 0;
+        uint32_t high = count;
+        if constexpr (std::is_arithmetic_v<KeyT> && std::is_same_v<ComparatorT, std::less<KeyT>>) {
+            constexpr uint32_t kWindow = 2 * 64 / sizeof(KeyT);
+            while (high - low > kWindow) {
+                uint32_t m = ((high - low) / 2) + low;
+                if (keys[m] < key) {
+                    low = m + 1;
+                } else {
+                    high = m;
+                }
+            }
+
+            // The keys in [low, high) are sorted and the result is within that
+            // range, so it is `low` plus the number of keys that are smaller.
+            uint32_t i = low;
+#ifdef __AVX2__
+            if constexpr (sizeof(KeyT) == 8) {
+                __m256i block_key;
+                __m256i bias = _mm256_setzero_si256();
+                if constexpr (std::is_floating_point_v<KeyT>) {
+                    block_key = _mm256_castpd_si256(_mm256_set1_pd(key));
+                } else {
+                    // signed compares order unsigned keys once the sign bit is flipped
+                    if constexpr (std::is_unsigned_v<KeyT>) bias = _mm256_set1_epi64x(INT64_MIN);
+                    block_key = _mm256_xor_si256(_mm256_set1_epi64x(static_cast<int64_t>(key)), bias);
+                }
+                for (; i + 4 <= high; i += 4) {
+                    auto block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+                    __m256i less;
+                    if constexpr (std::is_floating_point_v<KeyT>) {
+                        less = _mm256_castpd_si256(_mm256_cmp_pd(_mm256_castsi256_pd(block), _mm256_castsi256_pd(block_key), _CMP_LT_OQ));
+                    } else {
+                        less = _mm256_cmpgt_epi64(block_key, _mm256_xor_si256(block, bias));
+                    }
+                    low += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(less)));
+                }
+            } else if constexpr (sizeof(KeyT) == 4) {
+                __m256i block_key;
+                __m256i bias = _mm256_setzero_si256();
+                if constexpr (std::is_floating_point_v<KeyT>) {
+                    block_key = _mm256_castps_si256(_mm256_set1_ps(key));
+                } else {
+                    if constexpr (std::is_unsigned_v<KeyT>) bias = _mm256_set1_epi32(INT32_MIN);
+                    block_key = _mm256_xor_si256(_mm256_set1_epi32(static_cast<int32_t>(key)), bias);
+                }
+                for (; i + 8 <= high; i += 8) {
+                    auto block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+                    __m256i less;
+                    if constexpr (std::is_floating_point_v<KeyT>) {
+                        less = _mm256_castps_si256(_mm256_cmp_ps(_mm256_castsi256_ps(block), _mm256_castsi256_ps(block_key), _CMP_LT_OQ));
+                    } else {
+                        less = _mm256_cmpgt_epi32(block_key, _mm256_xor_si256(block, bias));
+                    }
+                    low += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(less)));
+                }
+            }
+#endif
+            // Branch-free tail, which the compiler vectorizes without AVX2 too.
+            for (; i < high; i++) {
+                low += keys[i] < key;
+            }
+            return low;
+        } else {
+            while (low < high) {
+                uint32_t m = ((high - low) / 2) + low;
+                if (ComparatorT()(keys[m], key)) {
+                    low = m + 1;
+                } else {
+                    high = m;
+                }
+            }
+            return low;
+        }
+    }
+};
+
+template<typename KeyT, typename ValueT, typename ComparatorT, size_t PageSize, typename SearchPolicy = SimdSearch>
+struct BTree : public TreeSegment<PageSize> {
     struct Node {
 
+        /// The LSN of the last logged change of the page. Has to be the first
+        /// member, the write-ahead log stamps it into the page.
+        uint64_t lsn = 0;
+
         /// The level in the tree.
         uint16_t level;
 
         /// The number of children.
         uint16_t count;
 
+        /// Is the node a `PackedLeaf`?
+        bool packed = false;
+
         // Constructor
         Node(uint16_t level, uint16_t count)
             : level(level), count(count) {}
 
         /// Is the node a leaf node?
         bool is_leaf() const { return level == 0; }
-        optional<uint64_t> parent;
     };
 
+    /// Alignment of the key arrays in the nodes.
+    static constexpr size_t kKeyAlignment = std::max(SearchPolicy::kKeyAlignment, alignof(KeyT));
+
+    /// The members of an inner node with `Capacity` keys.
+    template<uint32_t Capacity>
+    struct InnerLayout: public Node {
+        alignas(kKeyAlignment) KeyT keys[Capacity];
+        uint64_t children[Capacity + 1];
+    };
+
+    /// The members of a leaf with `Capacity` entries.
+    template<uint32_t Capacity>
+    struct LeafLayout: public Node {
+        uint64_t next;
+        alignas(kKeyAlignment) KeyT keys[Capacity];
+        ValueT values[Capacity];
+    };
+
+    /// Returns the largest capacity up to `Capacity` with which `Layout` fits
+    /// into a page, including all padding the compiler adds.
+    template<template<uint32_t> class Layout, uint32_t Capacity>
+    static constexpr uint32_t fit_capacity() {
+        if constexpr (Capacity <= 1 || sizeof(Layout<Capacity>) <= PageSize) {
+            return Capacity;
+        } else {
+            return fit_capacity<Layout, Capacity - 1>();
+        }
+    }
+
     struct InnerNode: public Node {
-        /// The capacity of a node.
-        /// TODO think about the capacity that the nodes have.
-        static constexpr uint32_t kCapacity = (PageSize / (sizeof(KeyT) + sizeof(ValueT))) - 2;
+        /// The capacity of a node, the number of keys that fit into a page
+        /// besides the header and one more child.
+        static constexpr uint32_t kCapacity =
+            fit_capacity<InnerLayout, (PageSize - sizeof(Node)) / (sizeof(KeyT) + sizeof(uint64_t))>();
+
+        /// The minimal number of children of a node other than the root.
+        /// Emptier nodes are merged with or borrow from a sibling.
+        static constexpr uint32_t kMinCount = std::max<uint32_t>(2, (kCapacity + 1) / 4);
 
         /// The keys.
-        KeyT keys[kCapacity];
+        alignas(kKeyAlignment) KeyT keys[kCapacity];
 
         /// The children. Increase size by 1 as comapred to keys, as children between the keys, and can have values greater than/less than too.
         uint64_t children[kCapacity+1];
@@ -51,117 +242,67 @@ struct BTree : public Segment {
         InnerNode() : Node(0, 0) {}
 
         /// Get the index of the first key that is not less than than a provided key.
+        /// When all keys are less than the provided key, the index of the last
+        /// child is returned together with `false`.
         /// @param[in] key          The key that should be searched.
         std::pair<uint32_t, bool> lower_bound(const KeyT &key) {
-            pair<uint32_t , bool> ans;
-            int low=0;
-            int high=this->count - 1;
-            optional<uint32_t> pos;
-            if(high==1 && !ComparatorT()(this->keys[0], key)){
-                ans.first = 0;
-                ans.second = true;
-                return ans;
-            }
-            while (low<=high) {
-                int m=((high-low)/2) + low;
-                if(key==this->keys[m]) {
-                    ans.first = static_cast<uint32_t>(m);
-                    ans.second = true;
-                    return ans;
-                } 
-                else if(key <= this->keys[m]) {
-                    pos = m;
-                    high = m-1;
-                } 
-                else{
-                    low=m+1;
-                }
-            }
-            
-            if(pos){
-                ans.first = *pos;
-                ans.second = true;
-                return ans;
-            }
-            ans.first = 0;
-            ans.second=false;
-            return ans;
+            return lower_bound(key, this->count);
+        }
+
+        /// Like `lower_bound(key)`, but only searches the first `count - 1`
+        /// keys. Used by optimistic readers that have checked `count` once and
+        /// must not read it again.
+        /// @param[in] key          The key that should be searched.
+        /// @param[in] count        The number of children, at least 1.
+        std::pair<uint32_t, bool> lower_bound(const KeyT &key, uint32_t count) {
+            uint32_t low = SearchPolicy::template lower_bound<KeyT, ComparatorT>(this->keys, count - 1, key);
+            return {low, low < count - 1};
         }
 
         /// Insert a key.
         /// @param[in] key          The separator that should be inserted.
         /// @param[in] split_page   The id of the split page that should be inserted.
-        void insert(const KeyT &key, uint64_t split_page, const optional<uint64_t> &insertNew) {
- 	    // TODO: remove the below lines of code 
-    	// and add your implementation here
-            vector<KeyT> keysNew;
-            vector<uint64_t> childNew;
-            optional<int> pos;
-            for (int i=0; i<this->count-1; i++) {
-                keysNew.push_back(this->keys[i]);
-                childNew.push_back(this->children[i]);
-                if(!ComparatorT()(this->keys[i], key) && !pos) pos = i;
-                this->keys[i] = 0;
-                this->children[i] = 0;
-            }
-
-
-            childNew.push_back(this->children[this->count - 1]);
-            this->children[this->count - 1] = 0;
-            if(!pos) {
-                keysNew.insert(keysNew.begin() + (this->count - 1), key);
-                childNew.insert(childNew.begin() + this->count, split_page);
-            } 
-            else{
-                keysNew.insert(keysNew.begin() + *pos, key);
-                if(insertNew) pos = *pos + 1;
-                childNew.insert(childNew.begin() + *pos, split_page);
-            }
-
-            for(int i=0;i < static_cast<int>(keysNew.size()); i++) this->keys[i] = keysNew[i];
-            for(int i=0;i < static_cast<int>(childNew.size()); i++) this->children[i] = childNew[i];
-
+        ///                         It is placed right of the child that was split.
+        void insert(const KeyT &key, uint64_t split_page) {
+            // the keys from the insert position and the children right of the
+            // split child move one slot to the right
+            uint32_t pos = lower_bound(key).first;
+            uint32_t moved = this->count - 1 - pos;
+            std::memmove(&this->keys[pos + 1], &this->keys[pos], moved * sizeof(KeyT));
+            std::memmove(&this->children[pos + 2], &this->children[pos + 1], moved * sizeof(uint64_t));
+            this->keys[pos] = key;
+            this->children[pos + 1] = split_page;
             this->count++;
+        }
 
+        /// Erase a key and the child right of it.
+        /// @param[in] pos          The position of the key.
+        void erase(uint32_t pos) {
+            uint32_t moved = this->count - 2 - pos;
+            std::memmove(&this->keys[pos], &this->keys[pos + 1], moved * sizeof(KeyT));
+            std::memmove(&this->children[pos + 1], &this->children[pos + 2], moved * sizeof(uint64_t));
+            this->count--;
         }
 
         /// Split the node.
         /// @param[in] buffer       The buffer for the new page.
+        /// @param[in] middle       The number of children the node keeps,
+        ///                         between 1 and `count - 1`.
         /// @return                 The separator key.
-        KeyT split(std::byte* buffer) {
-        // TODO: remove the below lines of code 
-    	// and add your implementation here
-            auto middle = (this->kCapacity + 1) / 2;
-            auto addInner = reinterpret_cast<InnerNode*>(buffer);
-            int start = 0;
-
-            auto sep = static_cast<int>((this->keys[middle] + this->keys[middle-1])/2);
-            for(int i=middle ;i<static_cast<int>(this->kCapacity)+1; i++){
-                if(start == 0){
-                    addInner->keys[start] = this->keys[i];
-                    addInner->children[start] = this->children[i];
-                    this->keys[i] = 0;
-                    this->children[i] = 0;
-                    this->count--;
-                    start++;
-                    i++;
-                    addInner->children[start] = this->children[i];
-                    this->children[i] = 0;
-                    this->count--;
-                    start++;
-                } 
-                else{
-                    addInner->keys[start - 1] = this->keys[i - 1];
-                    addInner->children[start] = this->children[i];
-                    this->keys[i - 1] = 0;
-                    this->children[i] = 0;
-                    this->count--;
-                    start++;
-                }
+        KeyT split(std::byte* buffer, uint32_t middle) {
+            auto addInner = new (buffer) InnerNode();
+            addInner->level = this->level;
+
+            // The left node keeps the first children, the key between both
+            // parts moves up into the parent.
+            KeyT sep = this->keys[middle - 1];
+            for (uint32_t i = middle; i < this->count; i++) {
+                if (i + 1 < this->count) addInner->keys[i - middle] = this->keys[i];
+                addInner->children[i - middle] = this->children[i];
             }
-            addInner->count = start;
+            addInner->count = this->count - middle;
+            this->count = middle;
             return sep;
-		//UNUSED(buffer);
         }
 
         /// Returns the keys.
@@ -188,12 +329,20 @@ struct BTree : public Segment {
     };
 
     struct LeafNode: public Node {
-        /// The capacity of a node.
-        /// TODO think about the capacity that the nodes have.
-        static constexpr uint32_t kCapacity = (PageSize / (sizeof(KeyT) + sizeof(ValueT))) - 2;;
+        /// The capacity of a node. The header and the sibling link are
+        /// subtracted from the page before it is filled with entries.
+        static constexpr uint32_t kCapacity =
+            fit_capacity<LeafLayout, (PageSize - sizeof(Node)) / (sizeof(KeyT) + sizeof(ValueT))>();
+
+        /// The minimal number of entries of a leaf other than the root.
+        /// Emptier leaves are merged with or borrow from a sibling.
+        static constexpr uint32_t kMinCount = kCapacity / 4;
+
+        /// The page id of the right sibling, `INVALID_PAGE_ID` for the last leaf.
+        uint64_t next = INVALID_PAGE_ID;
 
         /// The keys.
-        KeyT keys[kCapacity];
+        alignas(kKeyAlignment) KeyT keys[kCapacity];
 
         /// The values.
         ValueT values[kCapacity];
@@ -201,83 +350,65 @@ struct BTree : public Segment {
         /// Constructor.
         LeafNode() : Node(0, 0) {}
 
-        /// Insert a key.
+        /// Get the index of the first key that is not less than a provided key.
+        /// @param[in] key          The key that should be searched.
+        /// @param[in] count        The number of entries that are searched.
+        uint32_t lower_bound(const KeyT &key, uint32_t count) const {
+            return SearchPolicy::template lower_bound<KeyT, ComparatorT>(this->keys, count, key);
+        }
+
+        /// Insert a key. Overwrites the value when the key exists already.
         /// @param[in] key          The key that should be inserted.
         /// @param[in] value        The value that should be inserted.
         void insert(const KeyT &key, const ValueT &value) {
-        //TODO
-            if(this->count == 0){
-                this->keys[this->count] = key;
-                this->values[this->count] = value;
-                this->count++;
-            } 
-            else{
-                /// sort keys and shift keys (including values) wrt incoming key
-                vector<KeyT> keysNew;
-                vector<KeyT> tempValues;
-                optional<int> pos;
-                for(int i=0; i<this->count; i++){
-                    keysNew.push_back(this->keys[i]);
-                    tempValues.push_back(this->values[i]);
-                    if(!ComparatorT()(this->keys[i], key) && !pos)  pos = i;
-                    this->keys[i] = 0;
-                    this->values[i] = 0;
-                }
-
-                long unsigned int temp;
-                if(!pos){
-                    pos = this->count;
-                    temp = *pos;
-                    temp--;
-                }
-                else temp=*pos;
-
-                if(keysNew[temp]== key){
-                    tempValues[temp]=value;
-                }
-                else{
-                    keysNew.insert(keysNew.begin()+*pos, key);
-                    tempValues.insert(tempValues.begin() +*pos, value);
-                    this->count++;
-                }
-
-                for(int i=0; i<static_cast<int>(keysNew.size()); i++){
-                    this->values[i] = tempValues[i];
-                    this->keys[i] = keysNew[i];
-                }
+            uint32_t pos = lower_bound(key, this->count);
+            if (pos < this->count && !ComparatorT()(key, this->keys[pos])) {
+                this->values[pos] = value;
+                return;
             }
+            insert_at(pos, key, value);
+        }
+
+        /// Insert a new entry at a position.
+        /// @param[in] pos          The position, the lower bound of the key.
+        /// @param[in] key          The key that should be inserted.
+        /// @param[in] value        The value that should be inserted.
+        void insert_at(uint32_t pos, const KeyT &key, const ValueT &value) {
+            uint32_t moved = this->count - pos;
+            std::memmove(&this->keys[pos + 1], &this->keys[pos], moved * sizeof(KeyT));
+            std::memmove(&this->values[pos + 1], &this->values[pos], moved * sizeof(ValueT));
+            this->keys[pos] = key;
+            this->values[pos] = value;
+            this->count++;
         }
 
 
-        void erase(int &pos) {
-            // delete, we do that by making curr element val = next element val, and like making last element null, deleting it
-            for(int i=pos; i<this->count; i++){
-                this->values[i] = this->values[i + 1];
-                this->keys[i] = this->keys[i + 1];
-            }
-            this->values[this->count]=0;
-            this->keys[this->count]=0;
+        /// Erase an entry.
+        /// @param[in] pos          The position of the entry.
+        void erase(uint32_t pos) {
+            uint32_t moved = this->count - 1 - pos;
+            std::memmove(&this->keys[pos], &this->keys[pos + 1], moved * sizeof(KeyT));
+            std::memmove(&this->values[pos], &this->values[pos + 1], moved * sizeof(ValueT));
             this->count--;
         }
 
-        /// Split the node.
+        /// Split the node. The new node becomes the right sibling.
         /// @param[in] buffer       The buffer for the new page.
+        /// @param[in] buffer_page  The page id of the new page.
+        /// @param[in] middle       The number of entries the node keeps,
+        ///                         between 1 and `count`.
         /// @return                 The separator key.
-        KeyT split(std::byte* buffer) {
-        // TODO
-            auto middle = (this->kCapacity + 1) / 2;
-            auto addLeaf = reinterpret_cast<LeafNode*>(buffer);
-            int start = 0;
-            for(int i=middle; i < static_cast<int>(this->kCapacity);i++){
-                addLeaf->keys[start] = this->keys[i];
-                addLeaf->values[start] = this->values[i];
-                this->keys[i] = 0;
-                this->values[i] = 0;
-                this->count--;
-                start++;
+        KeyT split(std::byte* buffer, uint64_t buffer_page, uint32_t middle) {
+            auto addLeaf = new (buffer) LeafNode();
+            addLeaf->next = this->next;
+            this->next = buffer_page;
+            for (uint32_t i = middle; i < this->count; i++) {
+                addLeaf->keys[i - middle] = this->keys[i];
+                addLeaf->values[i - middle] = this->values[i];
             }
-            addLeaf->count =start;
-            return this->keys[start-1];
+            addLeaf->count = this->count - middle;
+            this->count = middle;
+            return this->keys[middle - 1];
         }
 
         std::vector<KeyT> get_key_vector() {
@@ -300,273 +431,2368 @@ struct BTree : public Segment {
         }
     };
 
-    optional<uint64_t> root;
-    bool Occupied;
-    uint16_t levelTree = 0;
-    unordered_map<KeyT, bool> removed;
+    static_assert(sizeof(InnerNode) <= PageSize, "inner node does not fit into a page");
+    static_assert(sizeof(LeafNode) <= PageSize, "leaf node does not fit into a page");
+    static_assert(sizeof(InnerNode) == sizeof(InnerLayout<InnerNode::kCapacity>) &&
+                  sizeof(InnerLayout<InnerNode::kCapacity + 1>) > PageSize,
+                  "inner nodes have to fill their page");
+    static_assert(sizeof(LeafNode) == sizeof(LeafLayout<LeafNode::kCapacity>) &&
+                  sizeof(LeafLayout<LeafNode::kCapacity + 1>) > PageSize,
+                  "leaves have to fill their page");
+    static_assert(PageSize % kKeyAlignment == 0, "pages have to keep the keys aligned");
+    static_assert(offsetof(Node, lsn) == 0, "the LSN has to start the page");
+
+    /// Swizzled reference to the root page for optimistic lookups, the
+    /// references to the children of inner nodes are kept in their frames.
+    Swip rootSwip;
+
+    static constexpr uint64_t kMetadataMagic = 0x45455254425a42ull;  // "BZBTREE"
 
-    uint64_t nextID;
+    /// How often a lookup restarts optimistically before it falls back to
+    /// latching the pages.
+    static constexpr uint32_t kOptimisticAttempts = 8;
 
-    BTree(uint16_t segment_id, BufferManager &buffer_manager) : Segment(segment_id, buffer_manager) {
-        this->Occupied = false;
+    /// How many descents `lookup_batch()` interleaves.
+    static constexpr uint32_t kBatchCursors = 8;
+
+    /// Where a full node is split. Keys that are larger or smaller than all
+    /// keys of the tree, like timestamps or sequence numbers, never return to
+    /// the pages they passed, so splits at the edge of the tree leave the old
+    /// pages full instead of half full.
+    enum class SplitEdge : uint8_t {
+        /// In the middle, for keys that arrive in random order.
+        None,
+        /// The old node keeps all entries, the key is beyond its right edge.
+        Right,
+        /// The new node keeps all entries, the key is before its left edge.
+        Left,
+    };
+
+    /// Returns how many entries a full leaf, or children a full inner node,
+    /// of `count` keeps when it is split.
+    static uint32_t split_middle(uint32_t count, bool leaf, SplitEdge edge) {
+        switch (edge) {
+            case SplitEdge::Right: return leaf ? count : count - 1;
+            case SplitEdge::Left: return 1;
+            default: return (count + 1) / 2;
+        }
     }
 
-    /// Lookup an entry in the tree.
-    /// @param[in] key      The key that should be searched.
-    optional<ValueT> lookup(const KeyT &key){
-        // if found in deleted keys, or tree doesn exist, just return
-        optional<ValueT> found;
-        if (this->removed.find(key) != this->removed.end() || !this->root){
-            return found;
-        }
-        auto ID = *this->root;
-        int next = 0;
-        uint64_t previousID = ID;
-        while(true){
-            auto& curr = this->buffer_manager.fix_page(ID, false);
-            auto trav = reinterpret_cast<Node*>(curr.get_data());
-            if(trav->is_leaf()){
-                auto leafNow = reinterpret_cast<LeafNode*>(trav);
-                long unsigned int l1=0, h1=leafNow->count-1, m1=0;
-                while(l1 <= h1){
-                    m1 = (h1-l1)/2 + l1;
-                    if(leafNow->keys[m1]==key){
-                        found = leafNow->values[m1];
-                        return found;
-                    }
-                    else if(leafNow->keys[m1]>key){
-                        h1=m1-1;
-                    }
-                    else{
-                        l1=m1+1;
-                    }
+    /// Returns where part `part` of `parts` starts when `total` entries are
+    /// split into nodes of `capacity`. Only the part at the edge the keys
+    /// grow to is not full.
+    static size_t part_begin(size_t total, size_t parts, size_t part, size_t capacity, SplitEdge edge) {
+        switch (edge) {
+            case SplitEdge::Right: return std::min(total, part * capacity);
+            case SplitEdge::Left: return total - std::min(total, (parts - part) * capacity);
+            default: return total * part / parts;
+        }
+    }
+
+    /// How many leaves of entries `insert_batch()` merges into one leaf at
+    /// most. Bounds the pages a split holds at once, further entries of the
+    /// leaf are merged by the next descent.
+    static constexpr uint32_t kBatchSplitLeaves = 32;
+
+    /// The pages that an insert or erase holds on its way from the root to
+    /// a leaf, the parent of every page is the entry below it. Pages do not
+    /// know their parent, so splits and merges walk back up this stack. It
+    /// lives on the stack of the thread: a tree of at most 2^48 pages with at
+    /// least two children per inner node has fewer than `kMaxHeight` levels.
+    struct PathStack {
+        static constexpr size_t kMaxHeight = 64;
+
+        pair<uint64_t, BufferFrame*> entries[kMaxHeight];
+        size_t count = 0;
+
+        bool empty() const { return count == 0; }
+        size_t size() const { return count; }
+        void clear() { count = 0; }
+        void emplace_back(uint64_t pageID, BufferFrame* page) { entries[count++] = {pageID, page}; }
+        void pop_back() { count--; }
+        pair<uint64_t, BufferFrame*>& back() { return entries[count - 1]; }
+        pair<uint64_t, BufferFrame*>& operator[](size_t i) { return entries[i]; }
+        pair<uint64_t, BufferFrame*>* begin() { return entries; }
+        pair<uint64_t, BufferFrame*>* end() { return entries + count; }
+    };
+
+    /// Counters of the tree since its construction.
+    struct Stats {
+        uint64_t lookups = 0;
+        uint64_t inserts = 0;
+        /// Calls of `upsert`, `insert_if_absent` and `update_if_present`.
+        uint64_t updates = 0;
+        uint64_t erases = 0;
+        uint64_t leaf_splits = 0;
+        uint64_t inner_splits = 0;
+        uint64_t leaf_merges = 0;
+        uint64_t inner_merges = 0;
+        /// The number of levels, 1 when the root is a leaf.
+        uint64_t height = 0;
+    };
+
+    /// The pages of one level of the tree.
+    struct LevelStats {
+        uint64_t pages = 0;
+        /// Entries of all leaves or children of all inner nodes.
+        uint64_t entries = 0;
+        /// Leaves in the packed format, see `PackedLeaf`.
+        uint64_t packed_pages = 0;
+        /// Number of pages by fill, bucket `i` counts the pages that are
+        /// filled to at least `i * 10` percent of their capacity. Packed
+        /// leaves are filled by their bits.
+        std::array<uint64_t, 10> fill_histogram{};
+    };
+
+    enum Counter : size_t {
+        kLookups, kInserts, kUpdates, kErases, kLeafSplits, kInnerSplits, kLeafMerges, kInnerMerges, kCounterCount
+    };
+
+    /// Event counters, see `Stats`.
+    StatsCounters<kCounterCount> counters;
+
+    /// Types of the logged changes that are replayed by `redo()`. Splits,
+    /// merges and bulk loading log whole pages instead. The types stay below
+    /// 16, where those of `StringBTree` start, so both trees can share a log.
+    enum LogType : uint8_t {
+        kLogLeafInsert = 1,
+        kLogLeafErase,
+        kLogLeafInsertBatch,
+    };
+
+    /// The payload of `kLogLeafInsert`, `kLogLeafInsertBatch` logs an array
+    /// of them.
+    struct LeafEntry {
+        KeyT key;
+        ValueT value;
+    };
+
+    /// Can leaves be packed? Keys and values have to be integers and keys
+    /// have to be ordered by their numeric value.
+    static constexpr bool kPackable = std::is_integral_v<KeyT> && !std::is_same_v<KeyT, bool> &&
+                                      std::is_integral_v<ValueT> && !std::is_same_v<ValueT, bool> &&
+                                      std::is_same_v<ComparatorT, std::less<KeyT>>;
+
+    /// The unsigned integers that packed keys and values are computed in.
+    using KeyCode = typename std::conditional_t<kPackable, std::make_unsigned<KeyT>, std::common_type<uint64_t>>::type;
+    using ValueCode = typename std::conditional_t<kPackable, std::make_unsigned<ValueT>, std::common_type<uint64_t>>::type;
+
+    /// The difference of a key to a smaller or equal key, as stored in a
+    /// `PackedLeaf`.
+    static uint64_t key_code(const KeyT &key, const KeyT &base) {
+        if constexpr (kPackable) {
+            return static_cast<KeyCode>(static_cast<KeyCode>(key) - static_cast<KeyCode>(base));
+        } else {
+            return 0;
+        }
+    }
+
+    static KeyT key_from_code(const KeyT &base, uint64_t code) {
+        if constexpr (kPackable) {
+            return static_cast<KeyT>(static_cast<KeyCode>(static_cast<KeyCode>(base) + static_cast<KeyCode>(code)));
+        } else {
+            return base;
+        }
+    }
+
+    static uint64_t value_code(const ValueT &value, const ValueT &base) {
+        if constexpr (kPackable) {
+            return static_cast<ValueCode>(static_cast<ValueCode>(value) - static_cast<ValueCode>(base));
+        } else {
+            return 0;
+        }
+    }
+
+    static ValueT value_from_code(const ValueT &base, uint64_t code) {
+        if constexpr (kPackable) {
+            return static_cast<ValueT>(static_cast<ValueCode>(static_cast<ValueCode>(base) + static_cast<ValueCode>(code)));
+        } else {
+            return base;
+        }
+    }
+
+    /// The number of bits that `code` needs.
+    static uint32_t bit_width(uint64_t code) {
+        return code == 0 ? 0 : 64 - __builtin_clzll(code);
+    }
+
+    /// The header of a `PackedLeaf`.
+    struct PackedHeader: public Node {
+        /// The page id of the right sibling, at the place of `LeafNode::next`.
+        uint64_t next = INVALID_PAGE_ID;
+
+        /// The smallest key and value, the entries store their differences
+        /// to them.
+        KeyT keyBase{};
+        ValueT valueBase{};
+
+        /// The bits of the difference of every key and value.
+        uint8_t keyBits = 0;
+        uint8_t valueBits = 0;
+
+        /// Constructor.
+        PackedHeader() : Node(0, 0) { this->packed = true; }
+    };
+
+    /// A leaf with frame-of-reference compression for integer keys and
+    /// values. Entry `i` starts at bit `i * (keyBits + valueBits)` with the
+    /// difference of its key to `keyBase`, followed by the difference of its
+    /// value to `valueBase`. The differences keep the order of the keys, so
+    /// the binary search runs on the packed keys and only decodes the entry
+    /// it returns. Dense or clustered keys need a few bits instead of
+    /// `sizeof(KeyT)` bytes.
+    struct PackedLeaf: public PackedHeader {
+        static constexpr uint32_t kWords = (PageSize - sizeof(PackedHeader)) / sizeof(uint64_t);
+        static constexpr uint64_t kBits = uint64_t{kWords} * 64;
+
+        /// The packed entries.
+        uint64_t words[kWords];
+
+        /// The most entries a packed leaf can hold. Distinct keys need at
+        /// least `log2(count)` bits each, and `count` has 16 bits.
+        static constexpr uint32_t max_count() {
+            uint64_t best = 1;
+            for (uint32_t bits = 1; bits < 64; bits++) {
+                best = std::max(best, std::min(uint64_t{1} << bits, kBits / bits));
+            }
+            return static_cast<uint32_t>(std::min<uint64_t>(best, UINT16_MAX));
+        }
+
+        static constexpr uint32_t kCapacity = max_count();
+
+        /// Do `count` entries with differences of the given widths fit?
+        static bool fits(uint64_t count, uint32_t keyBits, uint32_t valueBits, uint64_t bitLimit = kBits) {
+            return count <= kCapacity && count * (keyBits + valueBits) <= std::min(bitLimit, kBits);
+        }
+
+        /// Is a header consistent with the size of the page? Optimistic
+        /// readers check a copy of the header before they decode with it.
+        static bool valid(const PackedHeader &header) {
+            return header.keyBits <= 64 && header.valueBits <= 64 &&
+                   fits(header.count, header.keyBits, header.valueBits);
+        }
+
+        /// Reads `width` bits at a bit position.
+        static uint64_t read(const uint64_t *words, uint64_t position, uint32_t width) {
+            if (width == 0) return 0;
+            uint64_t word = position / 64;
+            uint32_t shift = position % 64;
+            uint64_t bits = words[word] >> shift;
+            if (shift + width > 64) bits |= words[word + 1] << (64 - shift);
+            return width == 64 ? bits : bits & ((uint64_t{1} << width) - 1);
+        }
+
+        /// Writes the low `width` bits of `bits` at a bit position.
+        void write(uint64_t position, uint32_t width, uint64_t bits) {
+            if (width == 0) return;
+            uint64_t mask = width == 64 ? ~uint64_t{0} : (uint64_t{1} << width) - 1;
+            uint64_t word = position / 64;
+            uint32_t shift = position % 64;
+            bits &= mask;
+            this->words[word] = (this->words[word] & ~(mask << shift)) | (bits << shift);
+            if (shift + width > 64) {
+                this->words[word + 1] = (this->words[word + 1] & ~(mask >> (64 - shift))) | (bits >> (64 - shift));
+            }
+        }
+
+        /// Moves the bits in `[from, end)` by `shift` bits, towards the end
+        /// when it is positive, 64 bits at a time.
+        void move_bits(uint64_t from, uint64_t end, int64_t shift) {
+            if (shift > 0) {
+                for (uint64_t chunkEnd = end; chunkEnd > from;) {
+                    uint32_t width = static_cast<uint32_t>(std::min<uint64_t>(64, chunkEnd - from));
+                    chunkEnd -= width;
+                    write(chunkEnd + shift, width, read(this->words, chunkEnd, width));
                 }
-                ID = previousID;
-                next++;
-            } 
-            else{
-                auto innerNode = reinterpret_cast<InnerNode*>(trav);
-                if (trav->parent){
-                    previousID = *trav->parent;
+            } else {
+                for (uint64_t chunk = from; chunk < end; chunk += 64) {
+                    uint32_t width = static_cast<uint32_t>(std::min<uint64_t>(64, end - chunk));
+                    write(chunk + shift, width, read(this->words, chunk, width));
                 }
-                pair<uint32_t, bool> lower_bound = innerNode->lower_bound(key);
-                if(lower_bound.second == true){
-                    if(innerNode->count <next) return found;
-                    else{
-                        ID = innerNode->children[lower_bound.first+next];
-                        next = 0;
-                    }
-                } 
-                else{
-                    ID = innerNode->children[innerNode->count-1];
+            }
+        }
+
+        /// Decodes the key of an entry with the given header.
+        static KeyT key_at(const uint64_t *words, const PackedHeader &header, uint32_t pos) {
+            uint64_t position = uint64_t{pos} * (header.keyBits + header.valueBits);
+            return key_from_code(header.keyBase, read(words, position, header.keyBits));
+        }
+
+        /// Decodes the value of an entry with the given header.
+        static ValueT value_at(const uint64_t *words, const PackedHeader &header, uint32_t pos) {
+            uint64_t position = uint64_t{pos} * (header.keyBits + header.valueBits) + header.keyBits;
+            return value_from_code(header.valueBase, read(words, position, header.valueBits));
+        }
+
+        /// Get the index of the first key that is not less than a provided
+        /// key, with the given header. Keys outside the range of the
+        /// differences are answered from the header alone.
+        static uint32_t lower_bound(const uint64_t *words, const PackedHeader &header, const KeyT &key) {
+            uint32_t count = header.count;
+            if (count == 0 || ComparatorT()(key, header.keyBase)) return 0;
+            uint64_t code = key_code(key, header.keyBase);
+            if (bit_width(code) > header.keyBits) return count;
+            uint32_t bits = header.keyBits + header.valueBits;
+            uint32_t low = 0;
+            uint32_t high = count;
+            while (low < high) {
+                uint32_t m = ((high - low) / 2) + low;
+                if (read(words, uint64_t{m} * bits, header.keyBits) < code) {
+                    low = m + 1;
+                } else {
+                    high = m;
                 }
             }
-            this->buffer_manager.unfix_page(curr, false);
+            return low;
         }
-        return found;
 
-	//UNUSED(key);
-	//return optional<ValueT>();
-    }
+        KeyT key(uint32_t pos) const { return key_at(this->words, *this, pos); }
+        ValueT value(uint32_t pos) const { return value_at(this->words, *this, pos); }
+        uint32_t lower_bound(const KeyT &key) const { return lower_bound(this->words, *this, key); }
 
-    /// Erase an entry in the tree.
-    /// @param[in] key      The key that should be searched.
-    void erase(const KeyT &key) {
-    // TODO
-        if(this->root) {
-            auto ID=*this->root;
-            int next =0;
-            uint64_t previousID = ID;
-            while (true){
-                auto& curr = this->buffer_manager.fix_page(ID, true);
-                auto trav = reinterpret_cast<Node*>(curr.get_data());
-                if (trav->is_leaf()){
-                    auto leafNow = reinterpret_cast<LeafNode*>(trav);
-                    for (int i=0; i<leafNow->count; i++){
-                        if (leafNow->keys[i]==key){
-                            leafNow->erase(i);
-                            this->removed.insert({key,true});
-                            this->buffer_manager.unfix_page(curr,true);
-                            return;
-                        }
-                    }
-                    ID = previousID;
-                    next++;
-                    this->buffer_manager.unfix_page(curr, true);
-                } 
-                else{
-                    auto innerNode=reinterpret_cast<InnerNode*>(trav);
-                    if(trav->parent) previousID = *trav->parent;
-                    
-
-                    pair<uint32_t, bool> lower_bound = innerNode->lower_bound(key);
-                    if(lower_bound.second == true){
-                        if(innerNode->count<next){
-                            this->buffer_manager.unfix_page(curr, true);
-                            return;
-                        } 
-                        else{
-                            ID = innerNode->children[lower_bound.first+next];
-                            next = 0;
-                            this->buffer_manager.unfix_page(curr, true);
-                        }
-                    } 
-                    else{
-                        ID = innerNode->children[innerNode->count - 1];
-                        this->buffer_manager.unfix_page(curr, true);
-                    }
+        /// Appends all entries to a vector.
+        void unpack(vector<LeafEntry> &entries) const {
+            for (uint32_t i = 0; i < this->count; i++) {
+                entries.push_back({key(i), value(i)});
+            }
+        }
+
+        /// Packs entries that are sorted by key into the leaf with the
+        /// narrowest differences.
+        /// @param[in] bitLimit     The bits that may be used.
+        /// @param[in] lowBase      Puts the value base as far below the
+        ///                         smallest value as the width allows, so
+        ///                         smaller values still fit in place.
+        /// @return                 False when the entries do not fit, the
+        ///                         leaf is unchanged then.
+        bool pack(const LeafEntry *entries, size_t count, uint64_t bitLimit = kBits, bool lowBase = false) {
+            uint32_t keyBits = 0;
+            uint32_t valueBits = 0;
+            ValueT minValue{};
+            if (count > 0) {
+                keyBits = bit_width(key_code(entries[count - 1].key, entries[0].key));
+                minValue = entries[0].value;
+                ValueT maxValue = entries[0].value;
+                for (size_t i = 1; i < count; i++) {
+                    minValue = std::min(minValue, entries[i].value);
+                    maxValue = std::max(maxValue, entries[i].value);
+                }
+                valueBits = bit_width(value_code(maxValue, minValue));
+                if (lowBase) {
+                    uint64_t mask = valueBits == 64 ? ~uint64_t{0} : (uint64_t{1} << valueBits) - 1;
+                    ValueT lowest = std::numeric_limits<ValueT>::lowest();
+                    uint64_t range = value_code(maxValue, lowest);
+                    minValue = range <= mask ? lowest : value_from_code(lowest, range - mask);
+                }
+            }
+            if (!fits(count, keyBits, valueBits, bitLimit)) return false;
+
+            this->count = static_cast<uint16_t>(count);
+            this->keyBits = static_cast<uint8_t>(keyBits);
+            this->valueBits = static_cast<uint8_t>(valueBits);
+            if (count > 0) this->keyBase = entries[0].key;
+            this->valueBase = minValue;
+            uint64_t bits = uint64_t{count} * (keyBits + valueBits);
+            std::memset(this->words, 0, (bits + 63) / 64 * sizeof(uint64_t));
+            for (size_t i = 0; i < count; i++) {
+                write(i * (keyBits + valueBits), keyBits, key_code(entries[i].key, this->keyBase));
+                write(i * (keyBits + valueBits) + keyBits, valueBits, value_code(entries[i].value, minValue));
+            }
+            return true;
+        }
+
+        /// Inserts an entry at a position. When the differences of the entry
+        /// fit the current widths, the entries behind it are shifted and it
+        /// is written in place, otherwise all entries are packed again. A
+        /// value below the base moves the base down as far as the new width
+        /// allows, so descending values, e.g. of a bulk load, only pack the
+        /// leaf again when they need another bit.
+        /// @param[in] bitLimit     The bits that may be used.
+        /// @return                 False when the entries do not fit, the
+        ///                         leaf is unchanged then.
+        bool insert_at(uint32_t pos, const KeyT &key, const ValueT &value, uint64_t bitLimit = kBits) {
+            uint32_t count = this->count;
+            if (count > 0 && !ComparatorT()(key, this->keyBase) && !(value < this->valueBase)) {
+                uint64_t keyDiff = key_code(key, this->keyBase);
+                uint64_t valueDiff = value_code(value, this->valueBase);
+                uint32_t bits = this->keyBits + this->valueBits;
+                if (bit_width(keyDiff) <= this->keyBits && bit_width(valueDiff) <= this->valueBits &&
+                    fits(count + 1, this->keyBits, this->valueBits, bitLimit)) {
+                    move_bits(uint64_t{pos} * bits, uint64_t{count} * bits, bits);
+                    write(uint64_t{pos} * bits, this->keyBits, keyDiff);
+                    write(uint64_t{pos} * bits + this->keyBits, this->valueBits, valueDiff);
+                    this->count++;
+                    return true;
                 }
             }
+            vector<LeafEntry> entries;
+            entries.reserve(count + 1);
+            unpack(entries);
+            entries.insert(entries.begin() + pos, LeafEntry{key, value});
+            return pack(entries.data(), entries.size(), bitLimit, count > 0 && value < this->valueBase);
         }
+
+        /// Changes the value of an entry, in place when its difference fits.
+        /// @return                 False when the entries do not fit, the
+        ///                         leaf is unchanged then.
+        bool set_value(uint32_t pos, const ValueT &value) {
+            uint64_t valueDiff = value_code(value, this->valueBase);
+            if (!(value < this->valueBase) && bit_width(valueDiff) <= this->valueBits) {
+                write(uint64_t{pos} * (this->keyBits + this->valueBits) + this->keyBits, this->valueBits, valueDiff);
+                return true;
+            }
+            vector<LeafEntry> entries;
+            entries.reserve(this->count);
+            unpack(entries);
+            entries[pos].value = value;
+            return pack(entries.data(), entries.size());
+        }
+
+        /// Erase an entry, the entries behind it are shifted in place. The
+        /// widths are kept, the differences of the other entries still fit.
+        void erase(uint32_t pos) {
+            uint32_t bits = this->keyBits + this->valueBits;
+            move_bits(uint64_t{pos + 1} * bits, uint64_t{this->count} * bits, -static_cast<int64_t>(bits));
+            this->count--;
+        }
+    };
+
+    static_assert(sizeof(PackedLeaf) <= PageSize, "packed leaf does not fit into a page");
+
+    /// The most entries of a leaf in either format.
+    static constexpr uint32_t kMaxLeafEntries =
+        kPackable ? std::max(PackedLeaf::kCapacity, LeafNode::kCapacity) : LeafNode::kCapacity;
+
+    /// The most leaves that a leaf is split into when one entry is added,
+    /// see `leaf_parts()`.
+    static constexpr uint32_t kMaxSplitParts = (kMaxLeafEntries + LeafNode::kCapacity) / LeafNode::kCapacity;
+
+    static const PackedLeaf* as_packed(const Node *node) { return reinterpret_cast<const PackedLeaf*>(node); }
+    static PackedLeaf* as_packed(Node *node) { return reinterpret_cast<PackedLeaf*>(node); }
+
+    /// Is a leaf a `PackedLeaf`? Always false when leaves cannot be packed.
+    static bool is_packed(const Node *node) { return kPackable && node->packed; }
+
+    /// The key of an entry of a leaf in either format.
+    static KeyT leaf_key(const LeafNode *leafNow, uint32_t pos) {
+        if (is_packed(leafNow)) return as_packed(leafNow)->key(pos);
+        return leafNow->keys[pos];
     }
 
-    /// Inserts a new entry into the tree.
-    /// @param[in] key      The key that should be inserted.
-    /// @param[in] value    The value that should be inserted.
-    void insert(const KeyT &key, const ValueT &value) {
-        if(!this->Occupied) {
-            this->root = 0;
-            this->nextID = 1;
-            this->Occupied = true;
+    /// The value of an entry of a leaf in either format.
+    static ValueT leaf_value(const LeafNode *leafNow, uint32_t pos) {
+        if (is_packed(leafNow)) return as_packed(leafNow)->value(pos);
+        return leafNow->values[pos];
+    }
+
+    /// The right sibling of a leaf in either format.
+    static uint64_t leaf_next(const LeafNode *leafNow) {
+        if (is_packed(leafNow)) return as_packed(leafNow)->next;
+        return leafNow->next;
+    }
+
+    static void set_leaf_next(LeafNode *leafNow, uint64_t next) {
+        if (is_packed(leafNow)) {
+            as_packed(leafNow)->next = next;
+        } else {
+            leafNow->next = next;
         }
+    }
 
-        auto temp2 = *this->root;
+    /// Appends all entries of a leaf in either format to a vector.
+    static void read_leaf(const LeafNode *leafNow, vector<LeafEntry> &entries) {
+        if (is_packed(leafNow)) {
+            as_packed(leafNow)->unpack(entries);
+            return;
+        }
+        for (uint32_t i = 0; i < leafNow->count; i++) {
+            entries.push_back({leafNow->keys[i], leafNow->values[i]});
+        }
+    }
 
-        while (true) {
-            auto& curr = this->buffer_manager.fix_page(temp2,true);
-            auto trav = reinterpret_cast<Node*>(curr.get_data());
-            
-            /// When just one node - root becomes leaf, do oprations wrt that
-            if(trav->is_leaf() ){
-                auto leafNow = static_cast<LeafNode*>(trav);
-                
-                // Now two scenarios 
-                // 1. space present - just push
-                // 2. Else, we create new node (new leaf), have to create separator, increase level by one 
-                if(leafNow->count < leafNow->kCapacity){
-                    
-                    leafNow->insert(key, value);
-                    this->buffer_manager.unfix_page(curr, true);
-                    break;
-                } 
-                else{
-
-                    /// create new leaf node
-                    auto leafPageID = this->nextID;
-                    this->nextID++;
-                    auto& addLeaf_page = this->buffer_manager.fix_page(leafPageID, true);
-                    KeyT sep = leafNow->split(reinterpret_cast<byte *>(addLeaf_page.get_data()));
-                    auto new_node = reinterpret_cast<Node*>(addLeaf_page.get_data());
-                    auto addLeaf = static_cast<LeafNode*>(new_node);
-
-                    if(!ComparatorT()(sep, key)) leafNow->insert(key, value);
-                    else addLeaf->insert(key, value);
-
-                    /// check if current node has a parent or not
-                    // If no parent
-                    if(leafNow->parent){
-                        auto& parPage = this->buffer_manager.fix_page(*leafNow->parent, true);
-                        auto par = reinterpret_cast<Node *>(parPage.get_data());
-                        auto parInner = static_cast<InnerNode *>(par);
-                        
-                        optional<uint64_t> insertNew;
-                        if(leafNow->values[leafNow->count -1] <addLeaf->values[0]) insertNew = temp2;
-                        parInner->insert(sep, leafPageID, insertNew);
-                        addLeaf->parent = *leafNow->parent;
-                        this->buffer_manager.unfix_page(parPage, true);
-                    } 
-                    else{
-                        this->root = this->nextID;
-                        this->nextID++;
-                        auto& parPageNew = this->buffer_manager.fix_page(*this->root, true);
-                        auto parNodeNew = static_cast<InnerNode *>(reinterpret_cast<Node *>(parPageNew.get_data()));
-
-                        parNodeNew->level = ++levelTree;
-                        parNodeNew->keys[0] = sep;
-                        parNodeNew->children[0] = temp2;
-                        parNodeNew->children[1] = leafPageID;
-                        parNodeNew->count = 2+parNodeNew->count;
-                        leafNow->parent = *this->root;
-                        addLeaf->parent = *this->root;
-                        this->buffer_manager.unfix_page(parPageNew, true);
-                        this->buffer_manager.unfix_page(addLeaf_page, true);
-                    }
-                    this->buffer_manager.unfix_page(curr, true);
-                    break;
+    /// Rewrites a leaf with entries that are sorted by key, in the given
+    /// format. The entries have to fit, the LSN of the page is kept.
+    /// @param[in] next     The right sibling of the leaf.
+    static void write_leaf(Node *node, const LeafEntry *entries, size_t count, bool packed, uint64_t next) {
+        auto lsn = node->lsn;
+        if (packed) {
+            auto packedLeaf = new (node) PackedLeaf();
+            packedLeaf->pack(entries, count);
+            packedLeaf->next = next;
+        } else {
+            auto leafNow = new (node) LeafNode();
+            for (size_t i = 0; i < count; i++) {
+                leafNow->keys[i] = entries[i].key;
+                leafNow->values[i] = entries[i].value;
+            }
+            leafNow->count = static_cast<uint16_t>(count);
+            leafNow->next = next;
+        }
+        node->lsn = lsn;
+    }
+
+    /// Searches a key in a leaf in either format that may be read without a
+    /// latch. The count and the header of a packed leaf are read once and
+    /// checked, so a concurrent change can only make the result wrong, which
+    /// the caller notices when it validates the page.
+    /// @param[in] count    The number of entries, read by the caller.
+    /// @param[out] result  The value of the key, nothing when it is missing.
+    /// @return             False when the leaf is inconsistent and the
+    ///                     search has to be restarted.
+    static bool search_leaf(const LeafNode *leafNow, uint32_t count, const KeyT &key, optional<ValueT> &result) {
+        result.reset();
+        if (is_packed(leafNow)) {
+            auto packedLeaf = as_packed(leafNow);
+            PackedHeader header = *packedLeaf;
+            header.count = static_cast<uint16_t>(count);
+            if (!PackedLeaf::valid(header)) return false;
+            auto pos = PackedLeaf::lower_bound(packedLeaf->words, header, key);
+            if (pos < count && !ComparatorT()(key, PackedLeaf::key_at(packedLeaf->words, header, pos))) {
+                result = PackedLeaf::value_at(packedLeaf->words, header, pos);
+            }
+            return true;
+        }
+        if (count > LeafNode::kCapacity) return false;
+        auto pos = find_in_leaf(leafNow, count, key);
+        if (pos < count) result = leafNow->values[pos];
+        return true;
+    }
+
+    /// Are leaves packed when they are split or bulk loaded? See
+    /// `set_leaf_compression()`.
+    std::atomic<bool> compressLeaves{false};
+
+    /// Get the index of a key in a latched leaf in either format, the count
+    /// of the leaf when the key is missing.
+    static uint32_t find_key(const LeafNode *leafNow, const KeyT &key) {
+        if (is_packed(leafNow)) {
+            auto packedLeaf = as_packed(leafNow);
+            auto pos = packedLeaf->lower_bound(key);
+            bool found = pos < packedLeaf->count && !ComparatorT()(key, packedLeaf->key(pos));
+            return found ? pos : packedLeaf->count;
+        }
+        return find_in_leaf(leafNow, leafNow->count, key);
+    }
+
+    /// Constructor. Opens the tree of the segment when its metadata page is
+    /// initialized, which only reads that page. Otherwise creates an empty
+    /// tree. A logged tree has to be recovered before it is opened.
+    /// @param[in] segment_id       The segment that holds the pages.
+    /// @param[in] buffer_manager   The buffer manager.
+    /// @param[in] log              Logs every change when given. Every
+    ///                             operation returns only when its change is
+    ///                             durable.
+    BTree(uint16_t segment_id, BufferManager &buffer_manager, WriteAheadLog* log = nullptr)
+        : TreeSegment<PageSize>(segment_id, buffer_manager, log, kMetadataMagic) {
+        /// a new tree starts with an empty leaf as root
+        if (!this->is_open()) {
+            this->create_root([](char *data) { new (data) LeafNode(); });
+        }
+    }
+
+    /// Replays a logged change on a page, see `WriteAheadLog::recover()`.
+    /// Changes of other kinds of trees are ignored.
+    static void redo(char* page, uint8_t type, const char* payload, uint32_t size) {
+        auto leaf = reinterpret_cast<LeafNode*>(page);
+        switch (type) {
+            case kLogLeafInsert: {
+                LeafEntry entry;
+                std::memcpy(&entry, payload, sizeof(entry));
+                leaf->insert(entry.key, entry.value);
+                break;
+            }
+            case kLogLeafErase: {
+                KeyT key;
+                std::memcpy(&key, payload, sizeof(key));
+                auto pos = find_in_leaf(leaf, leaf->count, key);
+                if (pos < leaf->count) leaf->erase(pos);
+                break;
+            }
+            case kLogLeafInsertBatch: {
+                for (uint32_t offset = 0; offset + sizeof(LeafEntry) <= size; offset += sizeof(LeafEntry)) {
+                    LeafEntry entry;
+                    std::memcpy(&entry, payload + offset, sizeof(entry));
+                    leaf->insert(entry.key, entry.value);
                 }
-            } 
+                break;
+            }
+        }
+    }
 
-            // when current node is not leaf - we are at some inner node
-            else{
-                auto innerNode = static_cast<InnerNode*>(trav);
-                /// creating new node if capacity overflows
-                if(innerNode->count ==innerNode->kCapacity + 1){
-                    auto innerPageID = this->nextID;
-                    this->nextID++;
-                    auto& addInner_page = this->buffer_manager.fix_page(innerPageID, true);
-                    KeyT sep = innerNode->split(reinterpret_cast<std::byte *>(addInner_page.get_data()));
-                    auto new_node = reinterpret_cast<Node*>(addInner_page.get_data());
-                    auto addInner = static_cast<InnerNode*>(new_node);
-                    addInner->level = innerNode->level;
-
-                    for (int i=0; i<addInner->count; i++){
-                        auto& child = this->buffer_manager.fix_page(addInner->children[i], true);
-                        auto child_node = reinterpret_cast<Node*>(child.get_data());
-                        auto child_innerNode = static_cast<InnerNode*>(child_node);
-                        child_innerNode->parent = innerPageID;
-                    }
+    /// Returns the counters of the tree. The counters are updated without
+    /// synchronization, so a snapshot taken during concurrent operations is
+    /// not exact.
+    Stats get_stats() {
+        Stats stats;
+        stats.lookups = this->counters.get(kLookups);
+        stats.inserts = this->counters.get(kInserts);
+        stats.updates = this->counters.get(kUpdates);
+        stats.erases = this->counters.get(kErases);
+        stats.leaf_splits = this->counters.get(kLeafSplits);
+        stats.inner_splits = this->counters.get(kInnerSplits);
+        stats.leaf_merges = this->counters.get(kLeafMerges);
+        stats.inner_merges = this->counters.get(kInnerMerges);
+        std::shared_lock root_guard(this->root_latch);
+        stats.height = this->levelTree + 1;
+        return stats;
+    }
 
-                    /// same as root-leaf, check if parent present or not, create or pass separator accordingly.
-                    // 1. if parent not present, new node -> increases level, 
-                    if(innerNode->parent){
-                        auto& parPage = this->buffer_manager.fix_page(*innerNode->parent, true);
-                        auto par = reinterpret_cast<Node *>(parPage.get_data());
-                        auto parInner = static_cast<InnerNode *>(par);
-                        optional<uint64_t> insertNew;
-                        parInner->insert(sep, innerPageID, insertNew);
-                        addInner->parent = *innerNode->parent;
-                        pair<uint32_t, bool> lower_bound = parInner->lower_bound(key);
-                        if(lower_bound.second == true) temp2 = parInner->children[lower_bound.first];
-                        else temp2 = parInner->children[parInner->count - 1];
-                        this->buffer_manager.unfix_page(parPage, true);
-                        
-                    } 
-                    else{
-                        this->root = this->nextID;
-                        this->nextID++;
-                        auto& parPageNew = this->buffer_manager.fix_page(*this->root, true);
-                        auto parNodeNew = reinterpret_cast<Node *>(parPageNew.get_data());
-                        auto parInnerNew = static_cast<InnerNode *>(parNodeNew);
-                        parInnerNew->level = ++levelTree;
-                        parInnerNew->keys[0] = sep;
-                        parInnerNew->children[0] = temp2;
-                        parInnerNew->children[1] = innerPageID;
-                        parInnerNew->count += 2;
-                        innerNode->parent = *this->root;
-                        addInner->parent = *this->root;
-
-                        this->buffer_manager.unfix_page(parPageNew, true);
-
-                        pair<uint32_t, bool> lower_bound = parInnerNew->lower_bound(key);
-                        if(lower_bound.second == true) temp2 = parInnerNew->children[lower_bound.first];
-                        else temp2 = parInnerNew->children[parInnerNew->count - 1];
-                    }
-                    this->buffer_manager.unfix_page(addInner_page, true);
-                } 
-                else{
-
-                    /// if we are not at correct node, use previously defined lower bound function - in order to find correct node
-                    // lower bound - fi returns true, then we find a plausible value, move to that value.
-                    // else if we didnt find any particular value, means no value present in greater than curr value
-                    // so we beyond the last value - going to last node present.
-                    pair<uint32_t, bool> lower_bound = innerNode->lower_bound(key);
-                    if(lower_bound.second ==true) temp2 = innerNode->children[lower_bound.first];
-                    else temp2 = innerNode->children[innerNode->count - 1];
+    /// Enables or disables leaf compression for trees of integer keys and
+    /// values. Enabled, every leaf that is split or bulk loaded becomes a
+    /// `PackedLeaf` when its keys are dense or clustered enough that it holds
+    /// more entries than a plain leaf, e.g. a full leaf of consecutive keys
+    /// is packed instead of split. Existing leaves keep their format until
+    /// they are split, so it can be changed at any time.
+    void set_leaf_compression(bool enabled) {
+        static_assert(kPackable, "only leaves of integer keys and values can be packed");
+        this->compressLeaves = enabled;
+    }
+
+    /// Visits every page of the tree and returns the pages and their fill per
+    /// level, the leaves are at index 0. The pages of a level are latched one
+    /// after another, so the result is only exact when no writer runs
+    /// concurrently.
+    vector<LevelStats> get_structure() {
+        std::shared_lock root_guard(this->root_latch);
+        vector<LevelStats> levels(this->levelTree + 1);
+        vector<uint64_t> pages{this->root.load()};
+        root_guard.unlock();
+
+        for (auto level = levels.size(); level-- > 0 && !pages.empty();) {
+            vector<uint64_t> children;
+            for (auto pageID : pages) {
+                auto& page = this->buffer_manager.fix_page(pageID, false);
+                auto node = reinterpret_cast<Node*>(page.get_data());
+                auto& stats = levels[level];
+                uint64_t used = node->count;
+                uint64_t capacity = LeafNode::kCapacity;
+                if (!node->is_leaf()) {
+                    auto innerNode = static_cast<InnerNode*>(node);
+                    children.insert(children.end(), innerNode->children, innerNode->children + innerNode->count);
+                    capacity = InnerNode::kCapacity + 1;
+                } else if (is_packed(node)) {
+                    // packed leaves are filled by their bits
+                    auto packedLeaf = as_packed(node);
+                    used = uint64_t{node->count} * (packedLeaf->keyBits + packedLeaf->valueBits);
+                    capacity = PackedLeaf::kBits;
+                    stats.packed_pages++;
                 }
-                this->buffer_manager.unfix_page(curr, true);
+                stats.pages++;
+                stats.entries += node->count;
+                stats.fill_histogram[std::min<uint64_t>(9, used * 10 / capacity)]++;
+                this->buffer_manager.unfix_page(page, false);
+            }
+            pages = std::move(children);
+        }
+        return levels;
+    }
+
+    /// Lookup an entry in the tree.
+    /// The lookup first runs optimistically without latching any page and
+    /// only latches the pages when it had to restart too often.
+    /// @param[in] key      The key that should be searched.
+    optional<ValueT> lookup(const KeyT &key){
+        this->counters.add(kLookups);
+        optional<ValueT> found;
+        for (uint32_t attempt = 0; attempt < kOptimisticAttempts; attempt++) {
+            if (lookup_optimistic(key, found)) {
+                return found;
             }
         }
+        return lookup_latched(key);
+    }
+
+    /// Searches the position of a key in a leaf.
+    /// @param[in] leafNow  The leaf that should be searched.
+    /// @param[in] count    The number of entries in the leaf.
+    /// @param[in] key      The key that should be searched.
+    /// @return             The index of the key, or `count` if it is missing.
+    static uint32_t find_in_leaf(const LeafNode *leafNow, uint32_t count, const KeyT &key) {
+        uint32_t low = leafNow->lower_bound(key, count);
+        if (low < count && !ComparatorT()(key, leafNow->keys[low])) {
+            return low;
+        }
+        return count;
+    }
+
+    /// Optimistic lock coupling: pages are only pinned, every value that is
+    /// read from a page is validated against the page version before it is
+    /// used. A child's version is read before the parent is validated the
+    /// last time, so a concurrent split of the child is always noticed.
+    /// Children are followed through swizzled references, so pages that
+    /// stay in memory are neither looked up in the page table nor pinned.
+    /// @param[in] key      The key that should be searched.
+    /// @param[out] found   The value of the key, if the lookup succeeded.
+    /// @return             False when the lookup has to be restarted.
+    bool lookup_optimistic(const KeyT &key, optional<ValueT> &found) {
+        uint64_t rootID = this->root.load();
+        uint64_t version;
+        bool pinned;
+        auto* curr = &this->buffer_manager.fix_page_optimistic(rootID, this->rootSwip, version, pinned);
+        if ((version & 1) || this->root.load() != rootID) {
+            if (pinned) this->buffer_manager.unfix_page_optimistic(*curr);
+            return false;
+        }
+
+        while (true) {
+            auto trav = reinterpret_cast<Node*>(curr->get_data());
+            uint32_t count = trav->count;
+            if (trav->is_leaf()) {
+                optional<ValueT> result;
+                if (!search_leaf(static_cast<LeafNode*>(trav), count, key, result)) break;
+                if (!curr->validate(version)) break;
+                if (pinned) this->buffer_manager.unfix_page_optimistic(*curr);
+                found = result;
+                return true;
+            }
+
+            if (count == 0 || count > InnerNode::kCapacity + 1) break;
+            auto innerNode = static_cast<InnerNode*>(trav);
+            auto pos = innerNode->lower_bound(key, count).first;
+            auto childID = innerNode->children[pos];
+            if (!curr->validate(version)) break;
+
+            auto& swip = this->buffer_manager.get_child_swip(*curr, pos);
+            uint64_t childVersion;
+            bool childPinned;
+            auto& child = this->buffer_manager.fix_page_optimistic(childID, swip, childVersion, childPinned);
+            if ((childVersion & 1) || !curr->validate(version)) {
+                if (childPinned) this->buffer_manager.unfix_page_optimistic(child);
+                break;
+            }
+            if (pinned) this->buffer_manager.unfix_page_optimistic(*curr);
+            curr = &child;
+            version = childVersion;
+            pinned = childPinned;
+        }
+        if (pinned) this->buffer_manager.unfix_page_optimistic(*curr);
+        return false;
+    }
+
+    /// Latches the leaf that contains a key shared. Pages are latched from
+    /// the root to the leaf with lock coupling: a child is latched before the
+    /// latch of its parent is released.
+    /// @param[in] key          The key that should be searched.
+    /// @param[out] leafID      The page id of the leaf.
+    /// @param[out] leftFence   The closest separator left of the path. All keys
+    ///                         in leaves left of the leaf are not greater.
+    BufferFrame& fix_leaf_shared(const KeyT &key, uint64_t &leafID, optional<KeyT> &leftFence) {
+        std::shared_lock root_guard(this->root_latch);
+        leafID = this->root.load();
+        auto* curr = &this->buffer_manager.fix_page(leafID, false);
+        root_guard.unlock();
+
+        auto trav = reinterpret_cast<Node*>(curr->get_data());
+        while (!trav->is_leaf()) {
+            auto innerNode = static_cast<InnerNode*>(trav);
+            auto pos = innerNode->lower_bound(key).first;
+            if (pos > 0) leftFence = innerNode->keys[pos - 1];
+            leafID = innerNode->children[pos];
+            auto& child = this->buffer_manager.fix_page(leafID, false);
+            this->buffer_manager.unfix_page(*curr, false);
+            curr = &child;
+            trav = reinterpret_cast<Node*>(curr->get_data());
+        }
+        return *curr;
+    }
+
+    /// Lookup with shared lock coupling.
+    /// @param[in] key      The key that should be searched.
+    optional<ValueT> lookup_latched(const KeyT &key) {
+        optional<ValueT> found;
+        uint64_t leafID;
+        optional<KeyT> leftFence;
+        auto& curr = fix_leaf_shared(key, leafID, leftFence);
+        auto leafNow = reinterpret_cast<LeafNode*>(curr.get_data());
+        search_leaf(leafNow, leafNow->count, key, found);
+        this->buffer_manager.unfix_page(curr, false);
+        return found;
+    }
+
+    /// Lookup of many keys at once. The keys are sorted, so all keys of a
+    /// leaf are found with a single descent, and split into `kBatchCursors`
+    /// slices whose descents advance in turns, one page per turn. Every turn
+    /// prefetches the next page of its descent, which is then searched while
+    /// the other descents take their turns. Descents are optimistic like
+    /// `lookup()` and fall back to latching for a key that had to restart
+    /// too often.
+    /// @param[in] keys     The keys that should be searched.
+    /// @param[in] count    The number of keys.
+    /// @param[out] found   The values of the keys, in the order of `keys`.
+    void lookup_batch(const KeyT *keys, size_t count, optional<ValueT> *found) {
+        this->counters.add(kLookups, count);
+        vector<uint32_t> order(count);
+        for (size_t i = 0; i < count; i++) order[i] = static_cast<uint32_t>(i);
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return ComparatorT()(keys[a], keys[b]);
+        });
+
+        std::array<BatchCursor, kBatchCursors> cursors;
+        for (size_t c = 0; c < kBatchCursors; c++) {
+            cursors[c].next = count * c / kBatchCursors;
+            cursors[c].end = count * (c + 1) / kBatchCursors;
+        }
+        bool active = true;
+        while (active) {
+            active = false;
+            for (auto& cursor : cursors) {
+                if (batch_step(cursor, keys, order.data(), found)) active = true;
+            }
+        }
+    }
+
+    /// A descent of `lookup_batch()` for a slice of the sorted keys.
+    struct BatchCursor {
+        /// Positions of the next and behind the last key of the slice in the
+        /// sorted order.
+        size_t next = 0;
+        size_t end = 0;
+
+        /// The page the descent reached, nullptr before it started.
+        BufferFrame* curr = nullptr;
+        uint64_t version = 0;
+        bool pinned = false;
+
+        /// The closest separator right of the path, all keys up to it are in
+        /// the leaf of the path.
+        optional<KeyT> upper;
+
+        /// The child of `curr` that is fixed in the next turn, nullptr when
+        /// `curr` is searched in the next turn.
+        Swip* swip = nullptr;
+        uint64_t childID = 0;
+        optional<KeyT> childUpper;
+
+        /// Restarts of the descent for the next key.
+        uint32_t attempts = 0;
+    };
+
+    /// Prefetches the header of a node and the key its search probes first.
+    static void prefetch_node(const char *data) {
+        __builtin_prefetch(data);
+        __builtin_prefetch(data + PageSize / 4);
+    }
+
+    /// Advances a descent of `lookup_batch()` by one step. A step either
+    /// searches a page or fixes the child that the search chose, so the frame
+    /// of the child is prefetched as well as its data.
+    /// @return             False when all keys of the slice were found.
+    bool batch_step(BatchCursor &cursor, const KeyT *keys, const uint32_t *order, optional<ValueT> *found) {
+        auto restart = [&]() {
+            if (cursor.pinned) this->buffer_manager.unfix_page_optimistic(*cursor.curr);
+            cursor.curr = nullptr;
+            cursor.swip = nullptr;
+            cursor.attempts++;
+            return true;
+        };
+
+        if (!cursor.curr) {
+            if (cursor.next == cursor.end) return false;
+            if (cursor.attempts == kOptimisticAttempts) {
+                auto i = order[cursor.next++];
+                found[i] = lookup_latched(keys[i]);
+                cursor.attempts = 0;
+                return true;
+            }
+            uint64_t rootID = this->root.load();
+            cursor.curr = &this->buffer_manager.fix_page_optimistic(rootID, this->rootSwip, cursor.version, cursor.pinned);
+            cursor.upper.reset();
+            if ((cursor.version & 1) || this->root.load() != rootID) return restart();
+            prefetch_node(cursor.curr->get_data());
+            return true;
+        }
+
+        if (cursor.swip) {
+            uint64_t childVersion;
+            bool childPinned;
+            auto& child = this->buffer_manager.fix_page_optimistic(cursor.childID, *cursor.swip, childVersion, childPinned);
+            if ((childVersion & 1) || !cursor.curr->validate(cursor.version)) {
+                if (childPinned) this->buffer_manager.unfix_page_optimistic(child);
+                return restart();
+            }
+            prefetch_node(child.get_data());
+            if (cursor.pinned) this->buffer_manager.unfix_page_optimistic(*cursor.curr);
+            cursor.curr = &child;
+            cursor.version = childVersion;
+            cursor.pinned = childPinned;
+            cursor.upper = cursor.childUpper;
+            cursor.swip = nullptr;
+            return true;
+        }
+
+        const KeyT &key = keys[order[cursor.next]];
+        auto trav = reinterpret_cast<Node*>(cursor.curr->get_data());
+        uint32_t count = trav->count;
+        if (trav->is_leaf()) {
+            // values of keys that are repeated after a restart are overwritten
+            auto leafNow = static_cast<LeafNode*>(trav);
+            size_t next = cursor.next;
+            do {
+                auto i = order[next];
+                if (!search_leaf(leafNow, count, keys[i], found[i])) return restart();
+                next++;
+            } while (next < cursor.end && (!cursor.upper || !ComparatorT()(*cursor.upper, keys[order[next]])));
+            if (!cursor.curr->validate(cursor.version)) return restart();
+            if (cursor.pinned) this->buffer_manager.unfix_page_optimistic(*cursor.curr);
+            cursor.curr = nullptr;
+            cursor.next = next;
+            cursor.attempts = 0;
+            return true;
+        }
+
+        if (count == 0 || count > InnerNode::kCapacity + 1) return restart();
+        auto innerNode = static_cast<InnerNode*>(trav);
+        auto pos = innerNode->lower_bound(key, count).first;
+        cursor.childID = innerNode->children[pos];
+        cursor.childUpper = cursor.upper;
+        if (pos + 1 < count) cursor.childUpper = innerNode->keys[pos];
+        if (!cursor.curr->validate(cursor.version)) return restart();
+        cursor.swip = &this->buffer_manager.get_child_swip(*cursor.curr, pos);
+        this->buffer_manager.prefetch(*cursor.swip);
+        return true;
+    }
+
+    /// Iterator over the entries of a key range in key order.
+    /// The qualifying entries of one leaf are copied at once, so no latch is
+    /// held between calls and the tree may be modified while iterating.
+    /// Forward iterators follow the sibling links of the leaves. They only
+    /// descend from the root again when the leaf they came from was modified
+    /// in the meantime, because then its link may be outdated. Backward
+    /// iterators descend once per leaf, bounded by the separator left of the
+    /// previous leaf.
+    class Iterator {
+        friend struct BTree;
+
+        BTree &tree;
+
+        /// The inclusive bounds of the range.
+        KeyT lower;
+        KeyT upper;
+
+        /// Are the entries returned in ascending order?
+        bool forward;
+
+        /// Entries of the current leaf, in the order they are returned.
+        vector<pair<KeyT, ValueT>> entries;
+        size_t position = 0;
+
+        /// The last key that was copied from a leaf.
+        optional<KeyT> last;
+
+        /// Forward: the current leaf and the leaf it was copied from.
+        typename TreeSegment<PageSize>::LeafCursor cursor;
+
+        /// Backward: the separator left of the current leaf.
+        optional<KeyT> leftFence;
+
+        /// Is there nothing left to copy?
+        bool done = false;
+
+        Iterator(BTree &tree, const KeyT &lower, const KeyT &upper, bool forward)
+            : tree(tree), lower(lower), upper(upper), forward(forward) {
+            if (ComparatorT()(upper, lower)) {
+                done = true;
+            } else if (forward) {
+                descend_forward(lower);
+            } else {
+                descend_backward(upper);
+            }
+        }
+
+        /// Copies the entries of a leaf that follow `last` in ascending order.
+        void copy_forward(LeafNode *leafNow) {
+            uint32_t pos = 0;
+            if (last) {
+                while (pos < leafNow->count && !ComparatorT()(*last, leaf_key(leafNow, pos))) pos++;
+            } else {
+                while (pos < leafNow->count && ComparatorT()(leaf_key(leafNow, pos), lower)) pos++;
+            }
+            for (; pos < leafNow->count; pos++) {
+                KeyT key = leaf_key(leafNow, pos);
+                if (ComparatorT()(upper, key)) {
+                    done = true;
+                    break;
+                }
+                entries.emplace_back(key, leaf_value(leafNow, pos));
+                last = key;
+            }
+        }
+
+        /// Copies the entries of a leaf that precede `last` and are not
+        /// greater than `bound` in descending order.
+        void copy_backward(LeafNode *leafNow, const KeyT &bound) {
+            int pos = static_cast<int>(leafNow->count) - 1;
+            while (pos >= 0 && (ComparatorT()(bound, leaf_key(leafNow, pos)) ||
+                                (last && !ComparatorT()(leaf_key(leafNow, pos), *last)))) {
+                pos--;
+            }
+            optional<KeyT> copied;
+            for (; pos >= 0; pos--) {
+                KeyT key = leaf_key(leafNow, pos);
+                if (ComparatorT()(key, lower)) {
+                    done = true;
+                    break;
+                }
+                entries.emplace_back(key, leaf_value(leafNow, pos));
+                copied = key;
+            }
+            if (copied) last = copied;
+        }
+
+        /// Descends to the leaf that contains `key` and copies its entries.
+        void descend_forward(const KeyT &key) {
+            optional<KeyT> fence;
+            auto& curr = tree.fix_leaf_shared(key, cursor.leafID, fence);
+            read_forward(curr);
+        }
+
+        /// Copies the entries of a leaf that is latched shared and unfixes it.
+        void read_forward(BufferFrame &curr) {
+            auto leafNow = reinterpret_cast<LeafNode*>(curr.get_data());
+            copy_forward(leafNow);
+            if (leaf_next(leafNow) == INVALID_PAGE_ID) done = true;
+            cursor.leave(tree.buffer_manager, curr);
+        }
+
+        /// Moves to the right sibling of the current leaf.
+        void next_leaf() {
+            auto next = [](const char *data) { return leaf_next(reinterpret_cast<const LeafNode*>(data)); };
+            if (auto* sibling = cursor.fix_next(tree.buffer_manager, next)) {
+                read_forward(*sibling);
+            } else {
+                descend_forward(last ? *last : lower);
+            }
+        }
+
+        /// Descends to the leaf that contains `bound` and copies its entries
+        /// that are not greater than `bound`.
+        void descend_backward(const KeyT &bound) {
+            optional<KeyT> fence;
+            auto& curr = tree.fix_leaf_shared(bound, cursor.leafID, fence);
+            copy_backward(reinterpret_cast<LeafNode*>(curr.get_data()), bound);
+            tree.buffer_manager.unfix_page(curr, false);
+            leftFence = fence;
+            if (!leftFence || ComparatorT()(*leftFence, lower)) done = true;
+        }
+
+    public:
+        /// Returns the next entry of the range, or nothing at its end.
+        optional<pair<KeyT, ValueT>> next() {
+            while (position == entries.size()) {
+                if (done) return nullopt;
+                entries.clear();
+                position = 0;
+                if (forward) {
+                    next_leaf();
+                } else {
+                    descend_backward(*leftFence);
+                }
+            }
+            return entries[position++];
+        }
+    };
+
+    /// Returns an iterator over all entries with `lower <= key <= upper` in
+    /// ascending key order.
+    /// @param[in] lower    The smallest key of the range.
+    /// @param[in] upper    The largest key of the range.
+    Iterator scan(const KeyT &lower, const KeyT &upper) {
+        return Iterator(*this, lower, upper, true);
+    }
+
+    /// Returns an iterator over all entries with `lower <= key <= upper` in
+    /// descending key order.
+    /// @param[in] lower    The smallest key of the range.
+    /// @param[in] upper    The largest key of the range.
+    Iterator scan_reverse(const KeyT &lower, const KeyT &upper) {
+        return Iterator(*this, lower, upper, false);
+    }
+
+    /// Erase an entry in the tree.
+    /// Most erases leave the leaf at least at its minimal fill, they latch
+    /// the inner pages shared and only the leaf exclusively. Only when the
+    /// leaf would underflow the erase is repeated with exclusive lock
+    /// coupling, so the leaf can be merged with or borrow from a sibling.
+    /// @param[in] key      The key that should be searched.
+    void erase(const KeyT &key) {
+        this->counters.add(kErases);
+        if (!erase_in_leaf(key)) {
+            erase_rebalance(key);
+        }
+    }
+
+    /// Erases an entry when this does not make its leaf underflow.
+    /// @param[in] key      The key that should be erased.
+    /// @return             False when the leaf would underflow.
+    bool erase_in_leaf(const KeyT &key) {
+        std::shared_lock root_guard(this->root_latch);
+        bool rootIsLeaf = this->levelTree == 0;
+        uint64_t leafID = this->root.load();
+        auto* curr = &this->buffer_manager.fix_page(leafID, rootIsLeaf);
+        root_guard.unlock();
+
+        auto trav = reinterpret_cast<Node*>(curr->get_data());
+        while (!trav->is_leaf()) {
+            auto innerNode = static_cast<InnerNode*>(trav);
+            leafID = innerNode->children[innerNode->lower_bound(key).first];
+            auto& child = this->buffer_manager.fix_page(leafID, innerNode->level == 1);
+            this->buffer_manager.unfix_page(*curr, false);
+            curr = &child;
+            trav = reinterpret_cast<Node*>(curr->get_data());
+        }
+
+        auto leafNow = static_cast<LeafNode*>(trav);
+        auto pos = find_key(leafNow, key);
+        if (pos == leafNow->count) {
+            this->buffer_manager.unfix_page(*curr, false);
+            return true;
+        }
+        if (!rootIsLeaf && leafNow->count <= LeafNode::kMinCount) {
+            this->buffer_manager.unfix_page(*curr, false);
+            return false;
+        }
+        uint64_t lsn;
+        if (is_packed(leafNow)) {
+            // packed leaves are logged as pages, `redo()` only knows the plain format
+            as_packed(leafNow)->erase(pos);
+            lsn = this->log_pages({{leafID, curr}});
+        } else {
+            leafNow->erase(pos);
+            lsn = this->log_change(leafID, *curr, kLogLeafErase, &key, sizeof(KeyT));
+        }
+        this->buffer_manager.unfix_page(*curr, true);
+        this->commit(lsn);
+        return true;
+    }
+
+    /// Erases an entry and rebalances the tree bottom-up.
+    /// Pages are latched exclusively from the root to the leaf. The latches
+    /// of all ancestors are released as soon as a page is reached that stays
+    /// at its minimal fill when it loses an entry, so an underflow only
+    /// propagates through pages that are still latched.
+    /// @param[in] key      The key that should be erased.
+    void erase_rebalance(const KeyT &key) {
+        std::unique_lock root_guard(this->root_latch);
+        PathStack path;
+
+        auto pageID = this->root.load();
+        while (true) {
+            auto& curr = this->buffer_manager.fix_page(pageID, true);
+            auto trav = reinterpret_cast<Node*>(curr.get_data());
+            bool safe;
+            if (path.empty() && root_guard.owns_lock()) {
+                // the root may shrink to a single child, but not below
+                safe = trav->is_leaf() || trav->count > 2;
+            } else {
+                safe = trav->count > (trav->is_leaf() ? LeafNode::kMinCount : InnerNode::kMinCount);
+            }
+            if (safe) {
+                for (auto& [ancestorID, ancestor] : path) {
+                    this->buffer_manager.unfix_page(*ancestor, false);
+                }
+                path.clear();
+                if (root_guard.owns_lock()) root_guard.unlock();
+            }
+            path.emplace_back(pageID, &curr);
+            if (trav->is_leaf()) break;
+
+            auto innerNode = static_cast<InnerNode*>(trav);
+            pageID = innerNode->children[innerNode->lower_bound(key).first];
+        }
+
+        auto leafNow = reinterpret_cast<LeafNode*>(path.back().second->get_data());
+        auto pos = find_key(leafNow, key);
+        if (pos == leafNow->count) {
+            for (auto& [pathID, pathPage] : path) {
+                this->buffer_manager.unfix_page(*pathPage, false);
+            }
+            return;
+        }
+        if (is_packed(leafNow)) {
+            as_packed(leafNow)->erase(pos);
+        } else {
+            leafNow->erase(pos);
+        }
+
+        /// all pages that change are logged together once the tree is
+        /// balanced again, freed pages are only reused after that
+        vector<pair<uint64_t, BufferFrame*>> modified;
+        vector<pair<uint64_t, BufferFrame*>> freed;
+        optional<pair<uint64_t, uint16_t>> newRoot;
+
+        /// merge underflowing nodes with a sibling or borrow from it
+        while (path.size() > 1) {
+            auto [nodeID, nodePage] = path.back();
+            auto node = reinterpret_cast<Node*>(nodePage->get_data());
+            if (node->count >= (node->is_leaf() ? LeafNode::kMinCount : InnerNode::kMinCount)) break;
+
+            auto parInner = reinterpret_cast<InnerNode*>(path[path.size() - 2].second->get_data());
+            uint32_t idx = parInner->lower_bound(key).first;
+            bool nodeIsLeft = idx + 1 < parInner->count;
+            uint32_t leftIdx = nodeIsLeft ? idx : idx - 1;
+            uint64_t siblingID = parInner->children[nodeIsLeft ? idx + 1 : idx - 1];
+            auto& siblingPage = this->buffer_manager.fix_page(siblingID, true);
+            uint64_t leftID = nodeIsLeft ? nodeID : siblingID;
+            uint64_t rightID = nodeIsLeft ? siblingID : nodeID;
+            BufferFrame* leftPage = nodeIsLeft ? nodePage : &siblingPage;
+            BufferFrame* rightPage = nodeIsLeft ? &siblingPage : nodePage;
+            auto left = reinterpret_cast<Node*>(leftPage->get_data());
+            auto right = reinterpret_cast<Node*>(rightPage->get_data());
+            bool merged = false;
+
+            if (node->is_leaf()) {
+                auto leftLeaf = static_cast<LeafNode*>(left);
+                auto rightLeaf = static_cast<LeafNode*>(right);
+                if (is_packed(leftLeaf) || is_packed(rightLeaf)) {
+                    // a packed sibling holds many entries, the leaves are
+                    // only merged into a plain leaf and never balanced
+                    if (leftLeaf->count + rightLeaf->count <= LeafNode::kCapacity) {
+                        vector<LeafEntry> entries;
+                        read_leaf(leftLeaf, entries);
+                        read_leaf(rightLeaf, entries);
+                        write_leaf(leftLeaf, entries.data(), entries.size(), false, leaf_next(rightLeaf));
+                        this->counters.add(kLeafMerges);
+                        parInner->erase(leftIdx);
+                        merged = true;
+                    }
+                } else if (leftLeaf->count + rightLeaf->count <= LeafNode::kCapacity) {
+                    merge_leaves(leftLeaf, rightLeaf);
+                    this->counters.add(kLeafMerges);
+                    parInner->erase(leftIdx);
+                    merged = true;
+                } else {
+                    parInner->keys[leftIdx] = balance_leaves(leftLeaf, rightLeaf);
+                }
+            } else {
+                auto leftInner = static_cast<InnerNode*>(left);
+                auto rightInner = static_cast<InnerNode*>(right);
+                if (leftInner->count + rightInner->count <= InnerNode::kCapacity + 1) {
+                    merge_inner(leftInner, rightInner, parInner->keys[leftIdx]);
+                    this->counters.add(kInnerMerges);
+                    parInner->erase(leftIdx);
+                    merged = true;
+                } else {
+                    parInner->keys[leftIdx] = balance_inner(leftInner, rightInner, parInner->keys[leftIdx]);
+                }
+            }
+            modified.emplace_back(leftID, leftPage);
+            if (merged) {
+                freed.emplace_back(rightID, rightPage);
+            } else {
+                modified.emplace_back(rightID, rightPage);
+            }
+            path.pop_back();
+        }
+
+        /// the tree loses a level when the root is left with a single child
+        auto [topID, topPage] = path.back();
+        auto top = reinterpret_cast<Node*>(topPage->get_data());
+        if (path.size() == 1 && root_guard.owns_lock() && !top->is_leaf() && top->count == 1) {
+            newRoot.emplace(static_cast<InnerNode*>(top)->children[0], this->levelTree - 1);
+            freed.emplace_back(topID, topPage);
+        } else {
+            modified.emplace_back(topID, topPage);
+        }
+        path.pop_back();
+
+        auto lsn = freed.empty() ? this->log_pages(modified) : this->log_structure(modified, freed, newRoot);
+        for (auto& [pageID, page] : modified) {
+            this->buffer_manager.unfix_page(*page, true);
+        }
+        for (auto& [pathID, pathPage] : path) {
+            this->buffer_manager.unfix_page(*pathPage, false);
+        }
+        if (root_guard.owns_lock()) root_guard.unlock();
+        this->commit(lsn);
+    }
+
+    /// Appends all entries of the right leaf to the left leaf, which takes
+    /// over the sibling link of the right leaf.
+    static void merge_leaves(LeafNode *left, LeafNode *right) {
+        std::memcpy(&left->keys[left->count], &right->keys[0], right->count * sizeof(KeyT));
+        std::memcpy(&left->values[left->count], &right->values[0], right->count * sizeof(ValueT));
+        left->count += right->count;
+        left->next = right->next;
+    }
+
+    /// Distributes the entries of two neighboring leaves evenly.
+    /// @return             The new separator between both leaves.
+    static KeyT balance_leaves(LeafNode *left, LeafNode *right) {
+        uint32_t total = left->count + right->count;
+        uint32_t leftCount = total / 2;
+        if (left->count > leftCount) {
+            uint32_t moved = left->count - leftCount;
+            std::memmove(&right->keys[moved], &right->keys[0], right->count * sizeof(KeyT));
+            std::memmove(&right->values[moved], &right->values[0], right->count * sizeof(ValueT));
+            std::memcpy(&right->keys[0], &left->keys[leftCount], moved * sizeof(KeyT));
+            std::memcpy(&right->values[0], &left->values[leftCount], moved * sizeof(ValueT));
+        } else if (left->count < leftCount) {
+            uint32_t moved = leftCount - left->count;
+            std::memcpy(&left->keys[left->count], &right->keys[0], moved * sizeof(KeyT));
+            std::memcpy(&left->values[left->count], &right->values[0], moved * sizeof(ValueT));
+            std::memmove(&right->keys[0], &right->keys[moved], (right->count - moved) * sizeof(KeyT));
+            std::memmove(&right->values[0], &right->values[moved], (right->count - moved) * sizeof(ValueT));
+        }
+        left->count = leftCount;
+        right->count = total - leftCount;
+        return left->keys[leftCount - 1];
+    }
+
+    /// Appends the separator and all keys and children of the right node to
+    /// the left node.
+    static void merge_inner(InnerNode *left, InnerNode *right, const KeyT &sep) {
+        left->keys[left->count - 1] = sep;
+        std::memcpy(&left->keys[left->count], &right->keys[0], (right->count - 1) * sizeof(KeyT));
+        std::memcpy(&left->children[left->count], &right->children[0], right->count * sizeof(uint64_t));
+        left->count += right->count;
+    }
+
+    /// Distributes the children of two neighboring inner nodes evenly. The
+    /// separator between both nodes rotates through the moved keys.
+    /// @param[in] sep      The separator between both nodes.
+    /// @return             The new separator.
+    static KeyT balance_inner(InnerNode *left, InnerNode *right, const KeyT &sep) {
+        uint32_t total = left->count + right->count;
+        uint32_t leftCount = total / 2;
+        KeyT newSep = sep;
+        if (left->count > leftCount) {
+            uint32_t moved = left->count - leftCount;
+            std::memmove(&right->keys[moved], &right->keys[0], (right->count - 1) * sizeof(KeyT));
+            std::memmove(&right->children[moved], &right->children[0], right->count * sizeof(uint64_t));
+            std::memcpy(&right->keys[0], &left->keys[leftCount], (moved - 1) * sizeof(KeyT));
+            std::memcpy(&right->children[0], &left->children[leftCount], moved * sizeof(uint64_t));
+            right->keys[moved - 1] = sep;
+            newSep = left->keys[leftCount - 1];
+        } else if (left->count < leftCount) {
+            uint32_t moved = leftCount - left->count;
+            left->keys[left->count - 1] = sep;
+            std::memcpy(&left->keys[left->count], &right->keys[0], (moved - 1) * sizeof(KeyT));
+            std::memcpy(&left->children[left->count], &right->children[0], moved * sizeof(uint64_t));
+            newSep = right->keys[moved - 1];
+            std::memmove(&right->keys[0], &right->keys[moved], (right->count - 1 - moved) * sizeof(KeyT));
+            std::memmove(&right->children[0], &right->children[moved], (right->count - moved) * sizeof(uint64_t));
+        }
+        left->count = leftCount;
+        right->count = total - leftCount;
+        return newSep;
+    }
+
+    /// Inserts a new entry into the tree. Overwrites the value when the key
+    /// exists already.
+    /// @param[in] key      The key that should be inserted.
+    /// @param[in] value    The value that should be inserted.
+    void insert(const KeyT &key, const ValueT &value) {
+        this->counters.add(kInserts);
+        auto store = [&](ValueT &stored, bool) {
+            stored = value;
+            return true;
+        };
+        if (!modify_in_leaf(key, true, store)) {
+            modify_split(key, store);
+        }
+    }
+
+    /// Changes the value of a key in place or inserts the key, with a single
+    /// descent to its leaf.
+    /// @param[in] key      The key that should be changed.
+    /// @param[in] fn       Called once with a reference to the value of the
+    ///                     key, or to a value-initialized `ValueT` that is
+    ///                     inserted when the key is missing, and changes it,
+    ///                     e.g. `[](uint64_t &count) { count++; }`.
+    template<typename Fn>
+    void upsert(const KeyT &key, Fn &&fn) {
+        this->counters.add(kUpdates);
+        auto apply = [&](ValueT &stored, bool) {
+            fn(stored);
+            return true;
+        };
+        if (!modify_in_leaf(key, true, apply)) {
+            modify_split(key, apply);
+        }
+    }
+
+    /// Inserts an entry unless its key exists already.
+    /// @param[in] key      The key that should be inserted.
+    /// @param[in] value    The value that should be inserted.
+    /// @return             False when the key existed, its value is unchanged.
+    bool insert_if_absent(const KeyT &key, const ValueT &value) {
+        this->counters.add(kUpdates);
+        bool inserted = false;
+        auto apply = [&](ValueT &stored, bool found) {
+            if (found) return false;
+            stored = value;
+            inserted = true;
+            return true;
+        };
+        if (!modify_in_leaf(key, true, apply)) {
+            modify_split(key, apply);
+        }
+        return inserted;
+    }
+
+    /// Changes the value of a key in place when the key exists.
+    /// @param[in] key      The key that should be changed.
+    /// @param[in] fn       Called once with a reference to the value of the
+    ///                     key when it exists, and changes it.
+    /// @return             False when the key is missing.
+    template<typename Fn>
+    bool update_if_present(const KeyT &key, Fn &&fn) {
+        this->counters.add(kUpdates);
+        bool found = false;
+        auto apply = [&](ValueT &stored, bool exists) {
+            if (!exists) return false;
+            fn(stored);
+            found = true;
+            return true;
+        };
+        if (!modify_in_leaf(key, false, apply)) {
+            modify_split(key, apply);
+        }
+        return found;
+    }
+
+    /// Applies a change to the entry of a key in its exclusively latched
+    /// leaf, logs it and unfixes the leaf.
+    /// @param[in] leafID   The page id of the leaf.
+    /// @param[in] page     The page of the leaf.
+    /// @param[in] pos      The lower bound of the key in the leaf.
+    /// @param[in] key      The key of the entry.
+    /// @param[in] fn       Called with the value of the key and true, or with
+    ///                     a value-initialized value and false when the key is
+    ///                     missing. Returns whether the value is stored.
+    template<typename Fn>
+    void apply_in_leaf(uint64_t leafID, BufferFrame &page, uint32_t pos, const KeyT &key, Fn &fn) {
+        auto leafNow = reinterpret_cast<LeafNode*>(page.get_data());
+        bool found = pos < leafNow->count && !ComparatorT()(key, leafNow->keys[pos]);
+        LeafEntry entry{key, found ? leafNow->values[pos] : ValueT()};
+        if (!fn(entry.value, found)) {
+            this->buffer_manager.unfix_page(page, false);
+            return;
+        }
+        if (found) {
+            leafNow->values[pos] = entry.value;
+        } else {
+            leafNow->insert_at(pos, key, entry.value);
+        }
+        auto lsn = this->log_change(leafID, page, kLogLeafInsert, &entry, sizeof(entry));
+        this->buffer_manager.unfix_page(page, true);
+        this->commit(lsn);
+    }
+
+    /// Changes the entry of a key when this does not split its leaf. Like
+    /// `erase_in_leaf()` it latches the inner pages shared and only the leaf
+    /// exclusively.
+    /// @param[in] key              The key of the entry.
+    /// @param[in] insertMissing    Whether `fn` may insert a missing key.
+    /// @param[in] fn               See `apply_in_leaf()`, only called for a
+    ///                             missing key when `insertMissing` is set.
+    /// @return                     False when a missing key would have to be
+    ///                             inserted into a full leaf, or the leaf is
+    ///                             packed. Nothing was changed and `fn` was
+    ///                             not called then.
+    template<typename Fn>
+    bool modify_in_leaf(const KeyT &key, bool insertMissing, Fn &fn) {
+        std::shared_lock root_guard(this->root_latch);
+        bool rootIsLeaf = this->levelTree == 0;
+        uint64_t leafID = this->root.load();
+        auto* curr = &this->buffer_manager.fix_page(leafID, rootIsLeaf);
+        root_guard.unlock();
+
+        auto trav = reinterpret_cast<Node*>(curr->get_data());
+        while (!trav->is_leaf()) {
+            auto innerNode = static_cast<InnerNode*>(trav);
+            leafID = innerNode->children[innerNode->lower_bound(key).first];
+            auto& child = this->buffer_manager.fix_page(leafID, innerNode->level == 1);
+            this->buffer_manager.unfix_page(*curr, false);
+            curr = &child;
+            trav = reinterpret_cast<Node*>(curr->get_data());
+        }
+
+        auto leafNow = static_cast<LeafNode*>(trav);
+        if (is_packed(leafNow)) {
+            this->buffer_manager.unfix_page(*curr, false);
+            return false;
+        }
+        uint32_t pos = leafNow->lower_bound(key, leafNow->count);
+        bool found = pos < leafNow->count && !ComparatorT()(key, leafNow->keys[pos]);
+        if (!found && (!insertMissing || leafNow->count == LeafNode::kCapacity)) {
+            this->buffer_manager.unfix_page(*curr, false);
+            return !insertMissing;
+        }
+        apply_in_leaf(leafID, *curr, pos, key, fn);
+        return true;
+    }
+
+    /// Changes the entry of a key and splits its leaf when a missing key does
+    /// not fit. Also changes the entries of packed leaves, which are
+    /// rewritten in place or split when the change does not fit.
+    /// Pages are latched exclusively from the root to the leaf. The latches
+    /// of all ancestors are released as soon as a page is reached that can
+    /// absorb a split of its child, so only the pages a split can reach stay
+    /// latched. A split walks back up the latched path, it only changes the
+    /// split node, its new sibling and the parent. Splits on the rightmost or
+    /// leftmost path for a key beyond the edge of the tree happen at that
+    /// edge, see `SplitEdge`.
+    /// @param[in] key      The key of the entry.
+    /// @param[in] fn       See `apply_in_leaf()`.
+    template<typename Fn>
+    void modify_split(const KeyT &key, Fn &fn) {
+        std::unique_lock root_guard(this->root_latch, std::defer_lock);
+        PathStack path;
+
+        // A plain leaf splits in two, only a packed leaf can split into up
+        // to `kMaxSplitParts` leaves. Ancestors are kept for that many new
+        // children when packed leaves are expected, and the descent is
+        // repeated that way when a packed leaf is reached unexpectedly.
+        bool manyParts = kPackable && this->compressLeaves;
+        // is the path the rightmost or leftmost one of the tree?
+        bool rightmost;
+        bool leftmost;
+        while (true) {
+            root_guard.lock();
+            rightmost = true;
+            leftmost = true;
+            auto temp2 = this->root.load();
+            while (true) {
+                auto& curr = this->buffer_manager.fix_page(temp2, true);
+                auto trav = reinterpret_cast<Node*>(curr.get_data());
+                bool safe = trav->is_leaf() ? !is_packed(trav) && trav->count < LeafNode::kCapacity
+                    : manyParts ? trav->count + kMaxSplitParts - 1 <= InnerNode::kCapacity + 1
+                    : trav->count < InnerNode::kCapacity + 1;
+                if (safe) {
+                    for (auto& [ancestorID, ancestor] : path) {
+                        this->buffer_manager.unfix_page(*ancestor, false);
+                    }
+                    path.clear();
+                    if (root_guard.owns_lock()) root_guard.unlock();
+                }
+                path.emplace_back(temp2, &curr);
+                if (trav->is_leaf()) break;
+
+                auto innerNode = static_cast<InnerNode*>(trav);
+                auto pos = innerNode->lower_bound(key).first;
+                rightmost &= pos + 1 == innerNode->count;
+                leftmost &= pos == 0;
+                temp2 = innerNode->children[pos];
+            }
+            if (manyParts || !is_packed(reinterpret_cast<Node*>(path.back().second->get_data()))) break;
+            for (auto& [pageID, page] : path) {
+                this->buffer_manager.unfix_page(*page, false);
+            }
+            path.clear();
+            if (root_guard.owns_lock()) root_guard.unlock();
+            manyParts = true;
+        }
+
+        auto [leafPageID, leafPage] = path.back();
+        path.pop_back();
+        auto leafNow = reinterpret_cast<LeafNode*>(leafPage->get_data());
+        if (is_packed(leafNow)) {
+            modify_packed(key, fn, leafPageID, leafPage, path, root_guard, rightmost, leftmost);
+            return;
+        }
+        uint32_t pos = leafNow->lower_bound(key, leafNow->count);
+        bool found = pos < leafNow->count && !ComparatorT()(key, leafNow->keys[pos]);
+        ValueT value{};
+        if (found || leafNow->count < LeafNode::kCapacity || !fn(value, false)) {
+            // no split, the key exists or the leaf has space meanwhile, or
+            // the missing key is not inserted after all
+            for (auto& [ancestorID, ancestor] : path) {
+                this->buffer_manager.unfix_page(*ancestor, false);
+            }
+            if (root_guard.owns_lock()) root_guard.unlock();
+            if (found || leafNow->count < LeafNode::kCapacity) {
+                apply_in_leaf(leafPageID, *leafPage, pos, key, fn);
+            } else {
+                this->buffer_manager.unfix_page(*leafPage, false);
+            }
+            return;
+        }
+
+        auto edge = rightmost && pos == leafNow->count ? SplitEdge::Right
+            : leftmost && pos == 0 ? SplitEdge::Left
+            : SplitEdge::None;
+        if (kPackable && this->compressLeaves) {
+            // the full leaf may become a packed leaf instead of splitting
+            vector<LeafEntry> merged;
+            merged.reserve(leafNow->count + 1);
+            read_leaf(leafNow, merged);
+            merged.insert(merged.begin() + pos, LeafEntry{key, value});
+            relayout_leaf(merged, leafPageID, leafPage, path, root_guard, edge);
+            return;
+        }
+
+        /// all pages of the split are logged together when it is complete
+        vector<pair<uint64_t, BufferFrame*>> modified;
+        optional<pair<uint64_t, uint16_t>> newRoot;
+        auto finish_split = [&]() {
+            auto lsn = this->log_structure(modified, {}, newRoot);
+            for (auto& [pageID, page] : modified) {
+                this->buffer_manager.unfix_page(*page, true);
+            }
+            // ancestors stay latched when they could not absorb a split of
+            // a packed leaf into many leaves
+            for (auto& [ancestorID, ancestor] : path) {
+                this->buffer_manager.unfix_page(*ancestor, false);
+            }
+            if (root_guard.owns_lock()) root_guard.unlock();
+            this->commit(lsn);
+        };
+
+        /// the leaf is full, split it and insert into the matching half
+        uint64_t addLeafID = this->allocate_page();
+        auto& addLeafPage = this->buffer_manager.fix_page(addLeafID, true);
+        KeyT sep = leafNow->split(reinterpret_cast<std::byte*>(addLeafPage.get_data()), addLeafID,
+                                  split_middle(leafNow->count, true, edge));
+        this->counters.add(kLeafSplits);
+        auto addLeaf = reinterpret_cast<LeafNode*>(addLeafPage.get_data());
+        if (!ComparatorT()(sep, key)) leafNow->insert(key, value);
+        else addLeaf->insert(key, value);
+
+        /// propagate the split upwards through the latched ancestors
+        uint64_t leftID = leafPageID;
+        uint64_t rightID = addLeafID;
+        BufferFrame* leftPage = leafPage;
+        BufferFrame* rightPage = &addLeafPage;
+        while (true) {
+            // 1. the root was split, the tree grows by one level
+            if (path.empty()) {
+                auto left = reinterpret_cast<Node*>(leftPage->get_data());
+                auto newRootID = this->allocate_page();
+                auto& parPageNew = this->buffer_manager.fix_page(newRootID, true);
+                auto parNodeNew = new (parPageNew.get_data()) InnerNode();
+                parNodeNew->level = left->level + 1;
+                parNodeNew->keys[0] = sep;
+                parNodeNew->children[0] = leftID;
+                parNodeNew->children[1] = rightID;
+                parNodeNew->count = 2;
+                newRoot.emplace(newRootID, parNodeNew->level);
+                modified.emplace_back(newRootID, &parPageNew);
+                modified.emplace_back(leftID, leftPage);
+                modified.emplace_back(rightID, rightPage);
+                finish_split();
+                return;
+            }
+
+            auto [parentID, parPage] = path.back();
+            path.pop_back();
+            auto parInner = reinterpret_cast<InnerNode*>(parPage->get_data());
+
+            // 2. the parent has space for the separator
+            if (parInner->count < InnerNode::kCapacity + 1) {
+                parInner->insert(sep, rightID);
+                modified.emplace_back(parentID, parPage);
+                modified.emplace_back(leftID, leftPage);
+                modified.emplace_back(rightID, rightPage);
+                finish_split();
+                return;
+            }
+
+            // 3. the parent is full as well and is split in turn
+            auto addInnerID = this->allocate_page();
+            auto& addInnerPage = this->buffer_manager.fix_page(addInnerID, true);
+            KeyT parentSep = parInner->split(reinterpret_cast<std::byte*>(addInnerPage.get_data()),
+                                             split_middle(parInner->count, false, edge));
+            this->counters.add(kInnerSplits);
+            auto addInner = reinterpret_cast<InnerNode*>(addInnerPage.get_data());
+            if (!ComparatorT()(parentSep, sep)) parInner->insert(sep, rightID);
+            else addInner->insert(sep, rightID);
+            modified.emplace_back(leftID, leftPage);
+            modified.emplace_back(rightID, rightPage);
+
+            leftID = parentID;
+            leftPage = parPage;
+            rightID = addInnerID;
+            rightPage = &addInnerPage;
+            sep = parentSep;
+        }
+    }
+
+    /// Changes the entry of a key in an exclusively latched packed leaf for
+    /// `modify_split()`. The leaf is rewritten in place when the change fits,
+    /// otherwise it is split. Unfixes all pages of the path.
+    /// @param[in] path         The latched ancestors of the leaf.
+    /// @param[in] root_guard   Held when the root may split.
+    /// @param[in] rightmost    Is the leaf the rightmost one of the tree?
+    /// @param[in] leftmost     Is the leaf the leftmost one of the tree?
+    template<typename Fn>
+    void modify_packed(const KeyT &key, Fn &fn, uint64_t leafID, BufferFrame *leafPage, PathStack &path,
+                       std::unique_lock<std::shared_mutex> &root_guard, bool rightmost, bool leftmost) {
+        auto packedLeaf = reinterpret_cast<PackedLeaf*>(leafPage->get_data());
+        uint32_t count = packedLeaf->count;
+        uint32_t pos = packedLeaf->lower_bound(key);
+        bool found = pos < count && !ComparatorT()(key, packedLeaf->key(pos));
+        ValueT value = found ? packedLeaf->value(pos) : ValueT();
+        bool stored = fn(value, found);
+        if (!stored || (found ? packedLeaf->set_value(pos, value) : packedLeaf->insert_at(pos, key, value))) {
+            for (auto& [ancestorID, ancestor] : path) {
+                this->buffer_manager.unfix_page(*ancestor, false);
+            }
+            if (root_guard.owns_lock()) root_guard.unlock();
+            // packed leaves are logged as pages, `redo()` only knows the plain format
+            auto lsn = stored ? this->log_pages({{leafID, leafPage}}) : 0;
+            this->buffer_manager.unfix_page(*leafPage, stored);
+            this->commit(lsn);
+            return;
+        }
+
+        vector<LeafEntry> merged;
+        merged.reserve(count + 1);
+        packedLeaf->unpack(merged);
+        if (found) {
+            merged[pos].value = value;
+        } else {
+            merged.insert(merged.begin() + pos, LeafEntry{key, value});
+        }
+        auto edge = !found && rightmost && pos == count ? SplitEdge::Right
+            : !found && leftmost && pos == 0 ? SplitEdge::Left
+            : SplitEdge::None;
+        relayout_leaf(merged, leafID, leafPage, path, root_guard, edge);
+    }
+
+    /// Inserts many entries at once and overwrites the values of keys that
+    /// exist already, the last entry of a key that occurs repeatedly wins.
+    /// The entries are sorted and every leaf is reached with one descent that
+    /// merges all entries up to the closest separator right of its path in a
+    /// single pass. Like `insert()` the descent latches only the leaf
+    /// exclusively unless the entries do not fit. Then the leaf is split into
+    /// as many leaves as needed at once and the separators of all of them are
+    /// added to the parent together.
+    /// @param[in] keys     The keys that should be inserted.
+    /// @param[in] values   The values, in the order of `keys`.
+    /// @param[in] count    The number of entries.
+    void insert_batch(const KeyT *keys, const ValueT *values, size_t count) {
+        this->counters.add(kInserts, count);
+        vector<uint32_t> order(count);
+        for (size_t i = 0; i < count; i++) order[i] = static_cast<uint32_t>(i);
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return ComparatorT()(keys[a], keys[b]);
+        });
+        vector<LeafEntry> entries;
+        entries.reserve(count);
+        for (auto i : order) {
+            if (!entries.empty() && !ComparatorT()(entries.back().key, keys[i])) {
+                entries.back().value = values[i];
+            } else {
+                entries.push_back({keys[i], values[i]});
+            }
+        }
+
+        size_t next = 0;
+        while (next < entries.size()) {
+            size_t end = merge_in_leaf(entries, next);
+            if (end == next) end = merge_split(entries, next);
+            next = end;
+        }
+    }
+
+    /// Returns the end of the entries from `begin` on that belong to the leaf
+    /// left of the separator `upper`.
+    static size_t batch_end(const vector<LeafEntry> &entries, size_t begin, const optional<KeyT> &upper) {
+        if (!upper) return entries.size();
+        return std::upper_bound(entries.begin() + begin, entries.end(), *upper,
+                                [](const KeyT &key, const LeafEntry &entry) {
+                                    return ComparatorT()(key, entry.key);
+                                }) - entries.begin();
+    }
+
+    /// Returns how many of the sorted entries are not in a leaf yet.
+    static uint32_t count_new_keys(const LeafNode *leafNow, const LeafEntry *first, const LeafEntry *last) {
+        uint32_t newKeys = 0;
+        uint32_t pos = 0;
+        for (auto* entry = first; entry != last; entry++) {
+            while (pos < leafNow->count && ComparatorT()(leafNow->keys[pos], entry->key)) pos++;
+            if (pos == leafNow->count || ComparatorT()(entry->key, leafNow->keys[pos])) newKeys++;
+        }
+        return newKeys;
+    }
+
+    /// Merges sorted entries into a leaf that has space for them, from the
+    /// back, so every entry of the leaf moves at most once.
+    /// @param[in] newKeys  The number of entries whose key is not in the leaf.
+    static void merge_entries(LeafNode *leafNow, const LeafEntry *first, const LeafEntry *last, uint32_t newKeys) {
+        int64_t pos = static_cast<int64_t>(leafNow->count) - 1;
+        int64_t write = pos + newKeys;
+        for (auto* entry = last; entry != first; write--) {
+            if (pos >= 0 && ComparatorT()(entry[-1].key, leafNow->keys[pos])) {
+                leafNow->keys[write] = leafNow->keys[pos];
+                leafNow->values[write] = leafNow->values[pos];
+                pos--;
+                continue;
+            }
+            entry--;
+            if (pos >= 0 && !ComparatorT()(leafNow->keys[pos], entry->key)) pos--;
+            leafNow->keys[write] = entry->key;
+            leafNow->values[write] = entry->value;
+        }
+        leafNow->count += newKeys;
+    }
+
+    /// Merges the entries from `begin` on that belong to one leaf into it
+    /// when they fit. Latches the inner pages shared and only the leaf
+    /// exclusively.
+    /// @return             The end of the merged entries, `begin` when the
+    ///                     leaf has to be split or is packed.
+    size_t merge_in_leaf(const vector<LeafEntry> &entries, size_t begin) {
+        std::shared_lock root_guard(this->root_latch);
+        bool rootIsLeaf = this->levelTree == 0;
+        uint64_t leafID = this->root.load();
+        auto* curr = &this->buffer_manager.fix_page(leafID, rootIsLeaf);
+        root_guard.unlock();
+
+        const KeyT &key = entries[begin].key;
+        optional<KeyT> upper;
+        auto trav = reinterpret_cast<Node*>(curr->get_data());
+        while (!trav->is_leaf()) {
+            auto innerNode = static_cast<InnerNode*>(trav);
+            auto [pos, bounded] = innerNode->lower_bound(key);
+            if (bounded) upper = innerNode->keys[pos];
+            leafID = innerNode->children[pos];
+            auto& child = this->buffer_manager.fix_page(leafID, innerNode->level == 1);
+            this->buffer_manager.unfix_page(*curr, false);
+            curr = &child;
+            trav = reinterpret_cast<Node*>(curr->get_data());
+        }
+
+        auto leafNow = static_cast<LeafNode*>(trav);
+        size_t end = batch_end(entries, begin, upper);
+        if (is_packed(leafNow) || end - begin > LeafNode::kCapacity) {
+            this->buffer_manager.unfix_page(*curr, false);
+            return begin;
+        }
+        uint32_t newKeys = count_new_keys(leafNow, &entries[begin], &entries[end]);
+        if (leafNow->count + newKeys > LeafNode::kCapacity) {
+            this->buffer_manager.unfix_page(*curr, false);
+            return begin;
+        }
+        merge_entries(leafNow, &entries[begin], &entries[end], newKeys);
+        auto lsn = this->log_change(leafID, *curr, kLogLeafInsertBatch, &entries[begin], (end - begin) * sizeof(LeafEntry));
+        this->buffer_manager.unfix_page(*curr, true);
+        this->commit(lsn);
+        return end;
+    }
+
+    /// Merges the entries from `begin` on that belong to one leaf into it, at
+    /// most `kBatchSplitLeaves` leaves of them, and splits the leaf into as
+    /// many leaves as needed. Pages are latched
+    /// exclusively from the root, the latches of all ancestors are released
+    /// at a page that can absorb all pages the entries can add below it.
+    /// @return             The end of the merged entries.
+    size_t merge_split(const vector<LeafEntry> &entries, size_t begin) {
+        std::unique_lock root_guard(this->root_latch, std::defer_lock);
+        PathStack path;
+
+        const KeyT &key = entries[begin].key;
+        optional<KeyT> upper;
+        size_t limit = std::min(entries.size(), begin + size_t{kBatchSplitLeaves} * LeafNode::kCapacity);
+        size_t end;
+        bool rightmost;
+        bool leftmost;
+        // the entries of the leaf count like in `modify_split()`, a plain
+        // leaf holds at most a full leaf of them
+        bool manyParts = kPackable && this->compressLeaves;
+        while (true) {
+            root_guard.lock();
+            upper.reset();
+            end = limit;
+            rightmost = true;
+            leftmost = true;
+            auto pageID = this->root.load();
+            while (true) {
+                auto& curr = this->buffer_manager.fix_page(pageID, true);
+                auto trav = reinterpret_cast<Node*>(curr.get_data());
+                // every leaf the entries add takes at least a full leaf of them
+                uint64_t leafEntries = manyParts ? kMaxLeafEntries : LeafNode::kCapacity;
+                uint64_t added = (leafEntries + (end - begin) + LeafNode::kCapacity - 1) / LeafNode::kCapacity - 1;
+                bool safe = trav->is_leaf()
+                    ? trav->count + (end - begin) <= LeafNode::kCapacity
+                    : trav->count + added <= InnerNode::kCapacity + 1;
+                if (safe) {
+                    for (auto& [ancestorID, ancestor] : path) {
+                        this->buffer_manager.unfix_page(*ancestor, false);
+                    }
+                    path.clear();
+                    if (root_guard.owns_lock()) root_guard.unlock();
+                }
+                path.emplace_back(pageID, &curr);
+                if (trav->is_leaf()) break;
+
+                auto innerNode = static_cast<InnerNode*>(trav);
+                auto [pos, bounded] = innerNode->lower_bound(key);
+                if (bounded) upper = innerNode->keys[pos];
+                rightmost &= !bounded;
+                leftmost &= pos == 0;
+                end = std::min(batch_end(entries, begin, upper), limit);
+                pageID = innerNode->children[pos];
+            }
+            if (manyParts || !is_packed(reinterpret_cast<Node*>(path.back().second->get_data()))) break;
+            for (auto& [ancestorID, ancestor] : path) {
+                this->buffer_manager.unfix_page(*ancestor, false);
+            }
+            path.clear();
+            if (root_guard.owns_lock()) root_guard.unlock();
+            manyParts = true;
+        }
+
+        auto [leafID, leafPage] = path.back();
+        path.pop_back();
+        auto leafNow = reinterpret_cast<LeafNode*>(leafPage->get_data());
+
+        auto edge = SplitEdge::None;
+        if (rightmost && (leafNow->count == 0 || ComparatorT()(leaf_key(leafNow, leafNow->count - 1), key))) {
+            edge = SplitEdge::Right;
+        } else if (leftmost && leafNow->count > 0 && ComparatorT()(entries[end - 1].key, leaf_key(leafNow, 0))) {
+            edge = SplitEdge::Left;
+        }
+
+        vector<LeafEntry> current;
+        current.reserve(leafNow->count);
+        read_leaf(leafNow, current);
+        vector<LeafEntry> merged;
+        merged.reserve(current.size() + (end - begin));
+        size_t pos = 0;
+        for (size_t i = begin; i < end; i++) {
+            while (pos < current.size() && ComparatorT()(current[pos].key, entries[i].key)) {
+                merged.push_back(current[pos]);
+                pos++;
+            }
+            if (pos < current.size() && !ComparatorT()(entries[i].key, current[pos].key)) pos++;
+            merged.push_back(entries[i]);
+        }
+        merged.insert(merged.end(), current.begin() + pos, current.end());
+        relayout_leaf(merged, leafID, leafPage, path, root_guard, edge);
+        return end;
+    }
+
+
+    /// Writes sorted entries into an exclusively latched leaf and as many new
+    /// leaves as they need, see `leaf_parts()`, and adds the separators of
+    /// the new leaves level by level to the latched ancestors, which are
+    /// split into as many nodes as needed as well. All changed pages are
+    /// logged together and all pages of the path are unfixed.
+    /// @param[in] merged       The entries of the leaf with the changes.
+    /// @param[in] path         The latched ancestors of the leaf, the root or
+    ///                         a page that absorbs all new children first.
+    /// @param[in] root_guard   Held when the root may split.
+    void relayout_leaf(const vector<LeafEntry> &merged, uint64_t leafID, BufferFrame *leafPage, PathStack &path,
+                       std::unique_lock<std::shared_mutex> &root_guard, SplitEdge edge) {
+        vector<pair<uint64_t, BufferFrame*>> modified;
+        modified.emplace_back(leafID, leafPage);
+
+        // the leaf keeps the first part, the others go to new leaves
+        auto leafNow = reinterpret_cast<LeafNode*>(leafPage->get_data());
+        auto parts = leaf_parts(merged, edge);
+        vector<pair<KeyT, uint64_t>> separators;
+        uint64_t lastNext = leaf_next(leafNow);
+        LeafNode* prev = nullptr;
+        for (size_t part = 0; part < parts.size(); part++) {
+            auto [from, packed] = parts[part];
+            size_t to = part + 1 < parts.size() ? parts[part + 1].first : merged.size();
+            LeafNode* leaf = leafNow;
+            if (part > 0) {
+                auto newID = this->allocate_page();
+                auto& newPage = this->buffer_manager.fix_page(newID, true);
+                leaf = new (newPage.get_data()) LeafNode();
+                modified.emplace_back(newID, &newPage);
+                set_leaf_next(prev, newID);
+                separators.emplace_back(merged[from - 1].key, newID);
+            }
+            write_leaf(leaf, &merged[from], to - from, packed, lastNext);
+            prev = leaf;
+        }
+        this->counters.add(kLeafSplits, parts.size() - 1);
+
+        // add the separators level by level, a parent that overflows is
+        // split into as many nodes as needed as well
+        optional<pair<uint64_t, uint16_t>> newRoot;
+        uint64_t topID = leafID;
+        BufferFrame* topPage = leafPage;
+        while (!separators.empty()) {
+            pair<uint64_t, BufferFrame*> parent;
+            if (path.empty()) {
+                // the root was split, the tree grows by one level
+                auto newRootID = this->allocate_page();
+                auto& parPageNew = this->buffer_manager.fix_page(newRootID, true);
+                auto parNodeNew = new (parPageNew.get_data()) InnerNode();
+                parNodeNew->level = reinterpret_cast<Node*>(topPage->get_data())->level + 1;
+                parNodeNew->children[0] = topID;
+                parNodeNew->count = 1;
+                newRoot.emplace(newRootID, parNodeNew->level);
+                parent = {newRootID, &parPageNew};
+            } else {
+                parent = path.back();
+                path.pop_back();
+            }
+            auto [parentID, parPage] = parent;
+            modified.emplace_back(parentID, parPage);
+            auto parInner = reinterpret_cast<InnerNode*>(parPage->get_data());
+            topID = parentID;
+            topPage = parPage;
+
+            if (parInner->count + separators.size() <= InnerNode::kCapacity + 1) {
+                for (auto& [sep, childID] : separators) parInner->insert(sep, childID);
+                separators.clear();
+                break;
+            }
+
+            vector<KeyT> innerKeys(parInner->keys, parInner->keys + parInner->count - 1);
+            vector<uint64_t> children(parInner->children, parInner->children + parInner->count);
+            for (auto& [sep, childID] : separators) {
+                auto at = std::lower_bound(innerKeys.begin(), innerKeys.end(), sep, ComparatorT()) - innerKeys.begin();
+                innerKeys.insert(innerKeys.begin() + at, sep);
+                children.insert(children.begin() + at + 1, childID);
+            }
+            separators.clear();
+
+            // the key between two parts moves up into the parent
+            size_t childCount = children.size();
+            size_t innerParts = (childCount + InnerNode::kCapacity) / (InnerNode::kCapacity + 1);
+            InnerNode* node = parInner;
+            for (size_t part = 0; part < innerParts; part++) {
+                size_t from = part_begin(childCount, innerParts, part, InnerNode::kCapacity + 1, edge);
+                size_t to = part_begin(childCount, innerParts, part + 1, InnerNode::kCapacity + 1, edge);
+                if (part > 0) {
+                    auto newID = this->allocate_page();
+                    auto& newPage = this->buffer_manager.fix_page(newID, true);
+                    node = new (newPage.get_data()) InnerNode();
+                    node->level = parInner->level;
+                    modified.emplace_back(newID, &newPage);
+                    separators.emplace_back(innerKeys[from - 1], newID);
+                }
+                for (size_t i = from; i < to; i++) {
+                    if (i + 1 < to) node->keys[i - from] = innerKeys[i];
+                    node->children[i - from] = children[i];
+                }
+                node->count = static_cast<uint32_t>(to - from);
+            }
+            this->counters.add(kInnerSplits, innerParts - 1);
+        }
+
+        auto lsn = this->log_structure(modified, {}, newRoot);
+        for (auto& [modifiedID, page] : modified) {
+            this->buffer_manager.unfix_page(*page, true);
+        }
+        for (auto& [ancestorID, ancestor] : path) {
+            this->buffer_manager.unfix_page(*ancestor, false);
+        }
+        if (root_guard.owns_lock()) root_guard.unlock();
+        this->commit(lsn);
+    }
+
+    /// The most of the sorted entries from `first` on, or up to `first` when
+    /// going backwards, that fit into a `PackedLeaf`.
+    /// @param[in] available    The number of entries in that direction.
+    static size_t packable_run(const LeafEntry *first, size_t available, bool forward) {
+        ValueT minValue{};
+        ValueT maxValue{};
+        size_t n = 0;
+        for (; n < available; n++) {
+            const LeafEntry &entry = forward ? first[n] : first[-1 - static_cast<ptrdiff_t>(n)];
+            minValue = n == 0 ? entry.value : std::min(minValue, entry.value);
+            maxValue = n == 0 ? entry.value : std::max(maxValue, entry.value);
+            uint64_t keyRange = forward ? key_code(entry.key, first[0].key) : key_code(first[-1].key, entry.key);
+            if (!PackedLeaf::fits(n + 1, bit_width(keyRange), bit_width(value_code(maxValue, minValue)))) break;
+        }
+        return n;
+    }
+
+    /// Splits sorted entries into the parts of leaves. A part is a plain leaf
+    /// when its entries fit, otherwise a `PackedLeaf` when leaf compression
+    /// is enabled. At an edge of the tree leaves are filled from that edge on
+    /// like in `part_begin()`, otherwise the fewest parts of equal size are
+    /// chosen. There are never more parts than plain leaves need.
+    /// @return     The first entry and whether it is packed for every part.
+    vector<pair<size_t, bool>> leaf_parts(const vector<LeafEntry> &entries, SplitEdge edge) const {
+        constexpr size_t capacity = LeafNode::kCapacity;
+        size_t total = entries.size();
+        size_t plainParts = std::max<size_t>(1, (total + capacity - 1) / capacity);
+        vector<pair<size_t, bool>> parts;
+        if (kPackable && this->compressLeaves && edge == SplitEdge::Right) {
+            for (size_t from = 0; from < total;) {
+                size_t packed = packable_run(&entries[from], total - from, true);
+                parts.emplace_back(from, packed > capacity);
+                from += packed > capacity ? packed : std::min(capacity, total - from);
+            }
+            return parts;
+        }
+        if (kPackable && this->compressLeaves && edge == SplitEdge::Left) {
+            for (size_t to = total; to > 0;) {
+                size_t packed = packable_run(entries.data() + to, to, false);
+                to -= packed > capacity ? packed : std::min(capacity, to);
+                parts.emplace_back(to, packed > capacity);
+            }
+            std::reverse(parts.begin(), parts.end());
+            return parts;
+        }
+        if (kPackable && this->compressLeaves) {
+            for (size_t count = 1; count < plainParts; count++) {
+                parts.clear();
+                for (size_t part = 0; part < count; part++) {
+                    size_t from = total * part / count;
+                    size_t size = total * (part + 1) / count - from;
+                    bool packed = size > capacity;
+                    if (packed && packable_run(&entries[from], size, true) < size) break;
+                    parts.emplace_back(from, packed);
+                }
+                if (parts.size() == count) return parts;
+            }
+            parts.clear();
+        }
+        for (size_t part = 0; part < plainParts; part++) {
+            parts.emplace_back(part_begin(total, plainParts, part, capacity, edge), false);
+        }
+        return parts;
+    }
+
+    /// State of one level while the tree is built bottom-up. A completed node
+    /// is only passed to the next level when the node after it is started,
+    /// so the last two nodes of a level can still be balanced at the end.
+    struct BulkLevel {
+        /// The completed node that was not passed to the next level yet.
+        uint64_t pendingID = INVALID_PAGE_ID;
+        BufferFrame* pendingPage = nullptr;
+        optional<KeyT> pendingMax;
+
+        /// The node that is currently filled.
+        uint64_t currentID = INVALID_PAGE_ID;
+        BufferFrame* currentPage = nullptr;
+        optional<KeyT> currentMax;
+
+        /// All pages of the level, freed again when the bulk load fails.
+        vector<uint64_t> pages;
+    };
+
+    /// Builds the tree bottom-up from entries that are sorted by key. Leaves
+    /// are filled one after another and every level of inner nodes is
+    /// built from the nodes below, so every page is written exactly once.
+    /// The new tree is only published when it is complete, a load that
+    /// throws, e.g. on unsorted input, leaves the tree empty and returns its
+    /// pages to the free list. The tree has to be empty. With leaf compression the leaves are packed as long as that
+    /// fits more entries into them, see `set_leaf_compression()`.
+    /// @param[in] begin        The first entry, a pair of key and value.
+    /// @param[in] end          The end of the entries.
+    /// @param[in] fill_factor  The share of the capacity of every node that
+    ///                         is used, leaves room for later inserts.
+    template<typename InputIt>
+    void bulk_load(InputIt begin, InputIt end, double fill_factor = 1.0) {
+        if (!(fill_factor > 0.0 && fill_factor <= 1.0)) {
+            throw std::invalid_argument("fill factor must be in (0, 1]");
+        }
+        uint32_t leafFill = std::max<uint32_t>(1, LeafNode::kCapacity * fill_factor);
+        uint32_t innerFill = std::max<uint32_t>(2, (InnerNode::kCapacity + 1) * fill_factor);
+        uint64_t packedFill = PackedLeaf::kBits * fill_factor;
+
+        std::unique_lock root_guard(this->root_latch);
+        {
+            auto& rootPage = this->buffer_manager.fix_page(this->root.load(), false);
+            bool empty = this->levelTree == 0 && reinterpret_cast<Node*>(rootPage.get_data())->count == 0;
+            this->buffer_manager.unfix_page(rootPage, false);
+            if (!empty) {
+                throw std::logic_error("bulk load requires an empty tree");
+            }
+        }
+
+        vector<BulkLevel> levels;
+        Defer unfix_levels([&]() {
+            for (auto& level : levels) {
+                if (level.pendingPage) this->buffer_manager.unfix_page(*level.pendingPage, true);
+                if (level.currentPage) this->buffer_manager.unfix_page(*level.currentPage, true);
+            }
+        });
+
+        bool published = false;
+        try {
+            for (auto it = begin; it != end; ++it) {
+                const auto& entry = *it;
+                bulk_add_entry(levels, entry.first, entry.second, leafFill, packedFill, innerFill);
+            }
+            if (levels.empty()) {
+                return;
+            }
+
+            /// balance the last two nodes of every level and pass them upwards
+            for (size_t level = 0; level < levels.size(); level++) {
+                if (!levels[level].pendingPage) {
+                    // a single node without a parent is the new root, the
+                    // empty root leaf of the tree is freed
+                    auto oldRootID = this->root.load();
+                    auto& oldRootPage = this->buffer_manager.fix_page(oldRootID, true);
+                    vector<pair<uint64_t, BufferFrame*>> modified{{levels[level].currentID, levels[level].currentPage}};
+                    this->log_structure(modified, {{oldRootID, &oldRootPage}},
+                                  pair<uint64_t, uint16_t>(levels[level].currentID, static_cast<uint16_t>(level)));
+                    published = true;
+                    // the new root itself is unfixed with the other levels
+                    for (size_t i = 1; i < modified.size(); i++) {
+                        this->buffer_manager.unfix_page(*modified[i].second, true);
+                    }
+                    break;
+                }
+                if (level == 0) {
+                    bulk_balance_leaves(levels[level], leafFill);
+                } else {
+                    bulk_balance_inner(levels[level], innerFill);
+                }
+                bulk_pass_up(levels, level, true, innerFill);
+                bulk_pass_up(levels, level, false, innerFill);
+            }
+        } catch (...) {
+            unfix_levels.run();
+            if (!published) {
+                // the tree stays empty, its pages are not lost
+                vector<uint64_t> pages;
+                for (auto& level : levels) {
+                    pages.insert(pages.end(), level.pages.begin(), level.pages.end());
+                }
+                this->free_pages(pages);
+            }
+            throw;
+        }
+
+        unfix_levels.run();
+        root_guard.unlock();
+        if (this->log) this->log->flush();
+    }
+
+    /// Starts a new node on a level. The previous node becomes pending and
+    /// the node that was pending before is passed to the next level.
+    void bulk_start_node(vector<BulkLevel> &levels, size_t level, uint32_t innerFill) {
+        // Every node is logged on its own when it is complete, so a page
+        // from the free list may only be logged after the metadata without
+        // it. Otherwise recovery could find the page in the free list with
+        // a node in it.
+        bool reused;
+        auto newID = this->allocate_page(&reused);
+        levels[level].pages.push_back(newID);
+        if (reused) this->log_metadata();
+        auto& newPage = this->buffer_manager.fix_page(newID, true);
+        if (level == 0 && kPackable && this->compressLeaves) {
+            new (newPage.get_data()) PackedLeaf();
+        } else if (level == 0) {
+            new (newPage.get_data()) LeafNode();
+        } else {
+            auto innerNode = new (newPage.get_data()) InnerNode();
+            innerNode->level = static_cast<uint16_t>(level);
+        }
+
+        auto& current = levels[level];
+        if (current.currentPage && level == 0) {
+            set_leaf_next(reinterpret_cast<LeafNode*>(current.currentPage->get_data()), newID);
+        }
+        if (current.pendingPage) {
+            bulk_pass_up(levels, level, true, innerFill);
+        }
+        auto& state = levels[level];
+        state.pendingID = state.currentID;
+        state.pendingPage = state.currentPage;
+        state.pendingMax = state.currentMax;
+        state.currentID = newID;
+        state.currentPage = &newPage;
+        state.currentMax.reset();
+    }
+
+    /// Passes the pending or the current node of a level to the next level
+    /// and unfixes it.
+    void bulk_pass_up(vector<BulkLevel> &levels, size_t level, bool pending, uint32_t innerFill) {
+        uint64_t childID = pending ? levels[level].pendingID : levels[level].currentID;
+        BufferFrame* childPage = pending ? levels[level].pendingPage : levels[level].currentPage;
+        KeyT childMax = pending ? *levels[level].pendingMax : *levels[level].currentMax;
+        if (pending) {
+            levels[level].pendingPage = nullptr;
+        } else {
+            levels[level].currentPage = nullptr;
+        }
+
+        if (levels.size() == level + 1) {
+            levels.emplace_back();
+        }
+        if (!levels[level + 1].currentPage ||
+            reinterpret_cast<Node*>(levels[level + 1].currentPage->get_data())->count == innerFill) {
+            bulk_start_node(levels, level + 1, innerFill);
+        }
+        auto& parent = levels[level + 1];
+        auto parentNode = reinterpret_cast<InnerNode*>(parent.currentPage->get_data());
+        if (parentNode->count > 0) {
+            parentNode->keys[parentNode->count - 1] = *parent.currentMax;
+        }
+        parentNode->children[parentNode->count] = childID;
+        parentNode->count++;
+        parent.currentMax = childMax;
+
+        this->log_pages({{childID, childPage}});
+        this->buffer_manager.unfix_page(*childPage, true);
+    }
+
+    /// Appends an entry to the current leaf.
+    /// @param[in] packedFill   The bits of a packed leaf that are used.
+    void bulk_add_entry(vector<BulkLevel> &levels, const KeyT &key, const ValueT &value, uint32_t leafFill,
+                        uint64_t packedFill, uint32_t innerFill) {
+        if (levels.empty()) {
+            levels.emplace_back();
+            bulk_start_node(levels, 0, innerFill);
+        }
+        auto leafNow = reinterpret_cast<LeafNode*>(levels[0].currentPage->get_data());
+        if (levels[0].currentMax && !ComparatorT()(*levels[0].currentMax, key)) {
+            if (ComparatorT()(key, *levels[0].currentMax)) {
+                throw std::invalid_argument("bulk load input is not sorted");
+            }
+            // the last value of a duplicate key wins, as with insert
+            if (!is_packed(leafNow)) {
+                leafNow->values[leafNow->count - 1] = value;
+                return;
+            }
+            auto packedLeaf = as_packed(leafNow);
+            if (packedLeaf->set_value(packedLeaf->count - 1, value)) return;
+            // the value does not fit, the entry is appended again below
+            packedLeaf->count--;
+            levels[0].currentMax = packedLeaf->key(packedLeaf->count - 1);
+        }
+        if (!bulk_append(leafNow, key, value, leafFill, packedFill)) {
+            bulk_start_node(levels, 0, innerFill);
+            leafNow = reinterpret_cast<LeafNode*>(levels[0].currentPage->get_data());
+            bulk_append(leafNow, key, value, leafFill, packedFill);
+        }
+        levels[0].currentMax = key;
+    }
+
+    /// Appends an entry to a leaf that is bulk loaded. A packed leaf that is
+    /// full before it holds more than `leafFill` entries continues as a plain
+    /// leaf, its keys are too sparse to pack.
+    /// @return             False when the leaf is full.
+    static bool bulk_append(LeafNode *leafNow, const KeyT &key, const ValueT &value, uint32_t leafFill,
+                            uint64_t packedFill) {
+        if (is_packed(leafNow)) {
+            auto packedLeaf = as_packed(leafNow);
+            if (packedLeaf->insert_at(packedLeaf->count, key, value, packedFill)) return true;
+            if (packedLeaf->count > leafFill) return false;
+            vector<LeafEntry> entries;
+            entries.reserve(packedLeaf->count);
+            packedLeaf->unpack(entries);
+            write_leaf(leafNow, entries.data(), entries.size(), false, packedLeaf->next);
+        }
+        if (leafNow->count == leafFill) return false;
+        leafNow->keys[leafNow->count] = key;
+        leafNow->values[leafNow->count] = value;
+        leafNow->count++;
+        return true;
+    }
+
+    /// Moves entries from the pending leaf to the last leaf when the last
+    /// leaf is less than half full. Packed leaves are not balanced.
+    void bulk_balance_leaves(BulkLevel &state, uint32_t leafFill) {
+        auto left = reinterpret_cast<LeafNode*>(state.pendingPage->get_data());
+        auto right = reinterpret_cast<LeafNode*>(state.currentPage->get_data());
+        if (is_packed(left) || is_packed(right) || right->count >= leafFill / 2) return;
+        state.pendingMax = balance_leaves(left, right);
+    }
+
+    /// Moves children from the pending inner node to the last inner node when
+    /// the last node is less than half full.
+    void bulk_balance_inner(BulkLevel &state, uint32_t innerFill) {
+        auto left = reinterpret_cast<InnerNode*>(state.pendingPage->get_data());
+        auto right = reinterpret_cast<InnerNode*>(state.currentPage->get_data());
+        if (right->count >= innerFill / 2) return;
+        state.pendingMax = balance_inner(left, right, *state.pendingMax);
     }
 };
 
-}  
+}
@@ -0,0 +1,424 @@
+#include "index/btree.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+/*
+Benchmark for the B-Tree and the buffer manager. Every workload runs on a new
+tree in segment `kSegment` of the working directory. All workloads except the
+insert workloads start from a tree that is bulk loaded with the keys
+`0, ..., keys - 1`. Every operation is timed on its own, the report contains
+the throughput, the 50th, 99th and 99.9th latency percentile and the share of
+page fixes during the measured phase that found their page in memory.
+
+Workloads:
+    seq_insert      insert `0, ..., ops - 1` in ascending order
+    rand_insert     insert `ops` distinct keys in random order
+    batch_insert    like `rand_insert`, `insert_batch` of `batch_size` keys
+    lookup_uniform  lookups of uniformly distributed keys
+    lookup_zipf     lookups of Zipfian distributed keys
+    lookup_batch    `lookup_batch` of `batch_size` uniformly distributed keys
+    ycsb_a          50% lookups, 50% updates, Zipfian
+    ycsb_b          95% lookups, 5% updates, Zipfian
+    ycsb_c          100% lookups, Zipfian
+    ycsb_d          95% lookups of the latest keys, 5% inserts of new keys
+    ycsb_e          95% short range scans, 5% inserts of new keys
+    ycsb_f          50% lookups, 50% read-modify-writes, Zipfian
+    erase_churn     erase a random key and insert a random key
+    scan            range scans of `scan_length` entries at uniform positions
+
+Usage:
+    btree_bench [--workload NAME|all] [--page-size 1024|4096|16384|65536]
+                [--keys N] [--ops N] [--threads N] [--pool-mb N]
+                [--zipf THETA] [--scan-length N] [--seed N] [--log PATH]
+                [--huge-pages 0|1] [--direct-io 0|1] [--background-writer 0|1]
+                [--search simd|linear|binary] [--batch-size N]
+                [--leaf-compression 0|1]
+
+With `--log` every change is written to a write-ahead log at PATH and every
+operation waits until its change is durable. `--huge-pages`, `--direct-io` and
+`--background-writer` set the `BufferManager::Options` of the buffer pool.
+`--search` selects the in-node search policy of the tree. `--leaf-compression`
+packs the leaves of the tree, see `BTree::set_leaf_compression()`. Every key of
+`lookup_batch` and `batch_insert` counts as one operation, its latency is
+the latency of the batch divided by its size.
+
+All runs with the same arguments and the same seed execute the same
+operations, so the numbers of two builds can be compared directly.
+*/
+
+
+namespace {
+
+using namespace buzzdb;
+
+constexpr uint16_t kSegment = 7;
+
+struct Config {
+    std::string workload = "all";
+    size_t page_size = 4096;
+    uint64_t keys = 1000000;
+    uint64_t ops = 1000000;
+    uint32_t threads = 1;
+    size_t pool_mb = 64;
+    double zipf = 0.99;
+    uint64_t scan_length = 100;
+    uint64_t seed = 42;
+    std::string log;
+    bool huge_pages = false;
+    bool direct_io = false;
+    bool background_writer = false;
+    std::string search = "simd";
+    uint64_t batch_size = 256;
+    bool leaf_compression = false;
+};
+
+const char* kWorkloads[] = {
+    "seq_insert", "rand_insert", "batch_insert", "lookup_uniform", "lookup_zipf", "lookup_batch",
+    "ycsb_a", "ycsb_b", "ycsb_c", "ycsb_d", "ycsb_e", "ycsb_f",
+    "erase_churn", "scan",
+};
+
+
+/// Zipfian distributed integers in `[0, n)` as generated by YCSB (Gray et al.,
+/// "Quickly generating billion-record synthetic databases"). Item 0 is the
+/// most popular one.
+class ZipfianGenerator {
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+
+    static double zeta(uint64_t n, double theta) {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; i++) {
+            sum += 1.0 / std::pow(static_cast<double>(i), theta);
+        }
+        return sum;
+    }
+
+public:
+    ZipfianGenerator(uint64_t n, double theta)
+        : n(n), theta(theta), alpha(1.0 / (1.0 - theta)), zetan(zeta(n, theta)) {
+        eta = (1.0 - std::pow(2.0 / static_cast<double>(n), 1.0 - theta)) /
+              (1.0 - zeta(2, theta) / zetan);
+    }
+
+    template <typename RNG>
+    uint64_t operator()(RNG& rng) {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        double uz = u * zetan;
+        if (uz < 1.0) return 0;
+        if (uz < 1.0 + std::pow(0.5, theta)) return 1;
+        auto value = static_cast<uint64_t>(
+            static_cast<double>(n) * std::pow(eta * u - eta + 1.0, alpha));
+        return std::min(value, n - 1);
+    }
+};
+
+
+/// Spreads the popular Zipfian items over the whole key range, so the hot
+/// keys do not all share the first leaf.
+uint64_t scramble(uint64_t rank, uint64_t n) {
+    uint64_t x = rank * 0x9E3779B97F4A7C15ull;
+    x ^= x >> 29;
+    return x % n;
+}
+
+
+/// Returns the value of `p` percent of all latencies, `latencies` is sorted.
+uint64_t percentile(const std::vector<uint64_t>& latencies, double p) {
+    if (latencies.empty()) return 0;
+    auto rank = static_cast<size_t>(p / 100.0 * static_cast<double>(latencies.size() - 1));
+    return latencies[rank];
+}
+
+
+template <size_t PageSize, typename SearchPolicy>
+class Runner {
+    using Tree = BTree<uint64_t, uint64_t, std::less<uint64_t>, PageSize, SearchPolicy>;
+    using Clock = std::chrono::steady_clock;
+
+    const Config& config;
+
+public:
+    explicit Runner(const Config& config) : config(config) {}
+
+    void run(const std::string& workload) {
+        std::remove(std::to_string(kSegment).c_str());
+        size_t frames = std::max<size_t>(16, config.pool_mb * 1024 * 1024 / PageSize);
+        std::unique_ptr<WriteAheadLog> log;
+        if (!config.log.empty()) {
+            std::remove(config.log.c_str());
+            log = std::make_unique<WriteAheadLog>(config.log);
+        }
+        BufferManager::Options options;
+        options.huge_pages = config.huge_pages;
+        options.direct_io = config.direct_io;
+        options.background_writer = config.background_writer;
+        BufferManager buffer_manager(PageSize, frames, BufferManager::Mode::ReadWrite, options);
+        buffer_manager.set_log(log.get());
+        Tree tree(kSegment, buffer_manager, log.get());
+        tree.set_leaf_compression(config.leaf_compression);
+
+        bool inserts = workload == "seq_insert" || workload == "rand_insert" || workload == "batch_insert";
+        if (!inserts) {
+            vector<pair<uint64_t, uint64_t>> entries;
+            entries.reserve(config.keys);
+            for (uint64_t key = 0; key < config.keys; key++) {
+                entries.emplace_back(key, key);
+            }
+            tree.bulk_load(entries.begin(), entries.end(), 0.7);
+        }
+
+        vector<uint64_t> insert_keys;
+        if (workload == "rand_insert" || workload == "batch_insert") {
+            insert_keys.resize(config.ops);
+            for (uint64_t i = 0; i < config.ops; i++) insert_keys[i] = i;
+            std::shuffle(insert_keys.begin(), insert_keys.end(), std::mt19937_64(config.seed));
+        }
+
+        // keys above `keys` are handed out in ascending order to inserts of
+        // new keys, `latest` is the highest key that was inserted so far
+        std::atomic<uint64_t> next_key{config.keys};
+        ZipfianGenerator zipf(std::max<uint64_t>(config.keys, 2), config.zipf);
+
+        vector<vector<uint64_t>> latencies(config.threads);
+        auto before = buffer_manager.get_stats();
+        auto start = Clock::now();
+
+        vector<std::thread> threads;
+        for (uint32_t t = 0; t < config.threads; t++) {
+            threads.emplace_back([&, t] {
+                std::mt19937_64 rng(config.seed * 1000003 + t);
+                auto zipf_key = [&] { return scramble(zipf(rng), config.keys); };
+                auto uniform_key = [&] { return rng() % config.keys; };
+                auto percent = [&] { return rng() % 100; };
+                auto insert_new = [&] {
+                    auto key = next_key++;
+                    tree.insert(key, key);
+                };
+                auto read_latest = [&] {
+                    uint64_t latest = next_key.load(std::memory_order_relaxed) - 1;
+                    tree.lookup(latest - std::min(latest, zipf(rng)));
+                };
+                auto short_scan = [&](uint64_t lower) {
+                    auto iterator = tree.scan(lower, lower + config.scan_length - 1);
+                    while (iterator.next()) {
+                    }
+                };
+
+                auto& samples = latencies[t];
+                uint64_t begin = config.ops * t / config.threads;
+                uint64_t end = config.ops * (t + 1) / config.threads;
+                samples.reserve(end - begin);
+                vector<uint64_t> batch_keys(config.batch_size);
+                vector<optional<uint64_t>> batch_found(config.batch_size);
+
+                for (uint64_t i = begin; i < end; i++) {
+                    auto op_start = Clock::now();
+                    if (workload == "seq_insert") {
+                        tree.insert(i, i);
+                    } else if (workload == "rand_insert") {
+                        tree.insert(insert_keys[i], i);
+                    } else if (workload == "lookup_uniform") {
+                        tree.lookup(uniform_key());
+                    } else if (workload == "batch_insert") {
+                        uint64_t size = std::min(config.batch_size, end - i);
+                        tree.insert_batch(insert_keys.data() + i, insert_keys.data() + i, size);
+                        auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            Clock::now() - op_start).count();
+                        samples.insert(samples.end(), size, latency / size);
+                        i += size - 1;
+                        continue;
+                    } else if (workload == "lookup_batch") {
+                        uint64_t size = std::min(config.batch_size, end - i);
+                        for (uint64_t k = 0; k < size; k++) batch_keys[k] = uniform_key();
+                        tree.lookup_batch(batch_keys.data(), size, batch_found.data());
+                        auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            Clock::now() - op_start).count();
+                        samples.insert(samples.end(), size, latency / size);
+                        i += size - 1;
+                        continue;
+                    } else if (workload == "lookup_zipf" || workload == "ycsb_c") {
+                        tree.lookup(zipf_key());
+                    } else if (workload == "ycsb_a" || workload == "ycsb_b") {
+                        uint64_t reads = workload == "ycsb_a" ? 50 : 95;
+                        auto key = zipf_key();
+                        if (percent() < reads) {
+                            tree.lookup(key);
+                        } else {
+                            tree.insert(key, i);
+                        }
+                    } else if (workload == "ycsb_d") {
+                        if (percent() < 95) {
+                            read_latest();
+                        } else {
+                            insert_new();
+                        }
+                    } else if (workload == "ycsb_e") {
+                        if (percent() < 95) {
+                            short_scan(zipf_key());
+                        } else {
+                            insert_new();
+                        }
+                    } else if (workload == "ycsb_f") {
+                        auto key = zipf_key();
+                        if (percent() < 50) {
+                            tree.lookup(key);
+                        } else {
+                            tree.upsert(key, [](uint64_t &value) { value++; });
+                        }
+                    } else if (workload == "erase_churn") {
+                        tree.erase(uniform_key());
+                        auto key = uniform_key();
+                        tree.insert(key, key);
+                    } else if (workload == "scan") {
+                        short_scan(uniform_key());
+                    }
+                    samples.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        Clock::now() - op_start).count());
+                }
+            });
+        }
+        for (auto& thread : threads) thread.join();
+
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        auto after = buffer_manager.get_stats();
+        uint64_t hits = after.hits - before.hits;
+        uint64_t misses = after.misses - before.misses;
+
+        vector<uint64_t> all;
+        all.reserve(config.ops);
+        for (auto& samples : latencies) all.insert(all.end(), samples.begin(), samples.end());
+        std::sort(all.begin(), all.end());
+
+        double hit_rate = hits + misses == 0 ? 1.0 : static_cast<double>(hits) / static_cast<double>(hits + misses);
+        std::printf("%-15s %6zu %8u %12.0f %9lu %9lu %9lu %8.4f\n",
+                    workload.c_str(), PageSize, config.threads,
+                    static_cast<double>(config.ops) / seconds,
+                    static_cast<unsigned long>(percentile(all, 50)),
+                    static_cast<unsigned long>(percentile(all, 99)),
+                    static_cast<unsigned long>(percentile(all, 99.9)),
+                    hit_rate);
+        std::fflush(stdout);
+    }
+};
+
+
+template <size_t PageSize, typename SearchPolicy>
+void run_workloads(const Config& config) {
+    Runner<PageSize, SearchPolicy> runner(config);
+    if (config.workload == "all") {
+        for (auto* workload : kWorkloads) runner.run(workload);
+    } else {
+        runner.run(config.workload);
+    }
+}
+
+
+template <size_t PageSize>
+void run_all(const Config& config) {
+    if (config.search == "linear") {
+        run_workloads<PageSize, LinearSearch>(config);
+    } else if (config.search == "binary") {
+        run_workloads<PageSize, BinarySearch>(config);
+    } else {
+        run_workloads<PageSize, SimdSearch>(config);
+    }
+}
+
+
+[[noreturn]] void usage(const char* program) {
+    std::fprintf(stderr,
+                 "usage: %s [--workload NAME|all] [--page-size 1024|4096|16384|65536]\n"
+                 "          [--keys N] [--ops N] [--threads N] [--pool-mb N]\n"
+                 "          [--zipf THETA] [--scan-length N] [--seed N] [--log PATH]\n"
+                 "          [--huge-pages 0|1] [--direct-io 0|1] [--background-writer 0|1]\n"
+                 "          [--search simd|linear|binary] [--batch-size N]\n"
+                 "          [--leaf-compression 0|1]\n",
+                 program);
+    std::exit(1);
+}
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+    Config config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 == argc) usage(argv[0]);
+        const char* value = argv[++i];
+        if (arg == "--workload") {
+            config.workload = value;
+        } else if (arg == "--page-size") {
+            config.page_size = std::strtoull(value, nullptr, 10);
+        } else if (arg == "--keys") {
+            config.keys = std::strtoull(value, nullptr, 10);
+        } else if (arg == "--ops") {
+            config.ops = std::strtoull(value, nullptr, 10);
+        } else if (arg == "--threads") {
+            config.threads = static_cast<uint32_t>(std::strtoul(value, nullptr, 10));
+        } else if (arg == "--pool-mb") {
+            config.pool_mb = std::strtoull(value, nullptr, 10);
+        } else if (arg == "--zipf") {
+            config.zipf = std::strtod(value, nullptr);
+        } else if (arg == "--scan-length") {
+            config.scan_length = std::strtoull(value, nullptr, 10);
+        } else if (arg == "--seed") {
+            config.seed = std::strtoull(value, nullptr, 10);
+        } else if (arg == "--log") {
+            config.log = value;
+        } else if (arg == "--huge-pages") {
+            config.huge_pages = std::strtoul(value, nullptr, 10) != 0;
+        } else if (arg == "--direct-io") {
+            config.direct_io = std::strtoul(value, nullptr, 10) != 0;
+        } else if (arg == "--background-writer") {
+            config.background_writer = std::strtoul(value, nullptr, 10) != 0;
+        } else if (arg == "--search") {
+            config.search = value;
+        } else if (arg == "--batch-size") {
+            config.batch_size = std::strtoull(value, nullptr, 10);
+        } else if (arg == "--leaf-compression") {
+            config.leaf_compression = std::strtoul(value, nullptr, 10) != 0;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (config.keys == 0 || config.threads == 0 || config.scan_length == 0 || config.batch_size == 0) {
+        usage(argv[0]);
+    }
+    if (config.search != "simd" && config.search != "linear" && config.search != "binary") usage(argv[0]);
+    if (config.workload != "all" &&
+        std::find_if(std::begin(kWorkloads), std::end(kWorkloads), [&](const char* workload) {
+            return config.workload == workload;
+        }) == std::end(kWorkloads)) {
+        usage(argv[0]);
+    }
+
+    std::printf("%-15s %6s %8s %12s %9s %9s %9s %8s\n",
+                "workload", "page", "threads", "ops/s", "p50[ns]", "p99[ns]", "p999[ns]", "hit");
+    switch (config.page_size) {
+        case 1024: run_all<1024>(config); break;
+        case 4096: run_all<4096>(config); break;
+        case 16384: run_all<16384>(config); break;
+        case 65536: run_all<65536>(config); break;
+        default: usage(argv[0]);
+    }
+    return 0;
+}
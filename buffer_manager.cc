@@ -1,50 +1,816 @@
 #include "buffer/buffer_manager.h"
+#include "common/defer.h"
+#include "log/wal.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
 /*
-This is only a dummy implementation of a buffer manager. It does not do any
-disk I/O or locking. It also does not respect the page_count and creates a new
-buffer for every fixed page and does so without using any latches so it is not
-thread-safe.
+The buffer manager keeps at most `page_count` pages in memory and uses 2Q
+replacement. A page that is loaded is appended to the FIFO queue, a page that
+is fixed again while it is in memory moves to the end of the LRU queue. When
+a frame is needed, the first unfixed page of the FIFO queue is evicted, or the
+first unfixed page of the LRU queue if all FIFO pages are fixed. Every segment
+is stored in its own file that is named after the segment id.
+
+The pages of all frames are carved from one arena that is mapped when the
+buffer manager is constructed, so loading a page never allocates and the
+pages are aligned for direct I/O. With huge pages, a traversal touches far
+fewer TLB entries.
+
+With a background writer, a thread wakes up periodically and whenever an
+eviction finds no clean victim. It writes back the dirty pages among the
+frames that are evicted next, so that foreground threads rarely have to
+write a victim themselves. The pages are copied under a shared latch, sorted
+by page id, and adjacent pages of a segment are written with one call.
+
+Large pools are split into shards by the hash of the page id. Every shard
+replaces pages among its own frames with its own queues and page table, so
+the pool behaves like several small pools of the same total size. The page
+table of a shard is an array with room for twice its frames: a fix that finds
+its page probes a few adjacent slots and allocates nothing.
+
+The latch of a shard protects its bookkeeping, every frame additionally has a
+reader/writer latch that is held while the page is fixed. A page is read from
+disk while only its frame latch is held, so other threads can work on
+resident pages in the meantime. Every exclusive fix makes the version of the
+frame odd, unfixing makes it even again: a dirty unfix moves it to the next
+version, a clean unfix restores the previous one. Optimistic readers only pin
+the frame and compare versions before and after reading. Dirty victims are
+written back while the latch of their shard is held, so no thread can read a
+stale version of the page from disk before the write has finished.
+
+Inner nodes refer to their children through swizzled references (`Swip`)
+that are kept in the frame beside the page, so the page itself always holds
+page ids and can be written and logged as it is. Following a reference only
+checks that the frame still holds the page. Frames are never freed and their
+page id only changes while their version is odd, so an optimistic reader
+that validates its version never acts on a page that was evicted meanwhile.
+
+In the read-only mapped mode, every segment file is mapped once as a whole.
+A frame is created for a page when it is fixed first and points into the
+mapping. Without writers, frames need no latches, no replacement and no
+versions, so fixing a page only looks up its frame.
 */
 
 
 namespace buzzdb {
 
 char* BufferFrame::get_data() {
-    return data.data();
+    return data;
+}
+
+
+BufferManager::BufferManager(size_t page_size, size_t page_count, Mode mode)
+    : BufferManager(page_size, page_count, mode, Options()) {}
+
+
+BufferManager::BufferManager(size_t page_size, size_t page_count, Mode mode, Options options)
+    : page_size(page_size), page_count(page_count), mode(mode), options(options),
+      frames(mode == Mode::ReadWrite ? page_count : 0) {
+    if (mode == Mode::ReadOnlyMapped) {
+        this->page_count = 0;
+        mappings = std::make_unique<std::atomic<Mapping*>[]>(1 << 16);
+        return;
+    }
+    if (options.direct_io && page_size % kDirectIOAlignment != 0) {
+        throw std::invalid_argument("direct I/O needs pages that are a multiple of " +
+                                    std::to_string(kDirectIOAlignment) + " bytes");
+    }
+
+    // mmap returns memory that is aligned to the page size of the system and
+    // only backed by physical memory when it is touched
+    arena_size = std::max<size_t>(page_count * page_size, 1);
+    if (options.huge_pages) {
+        arena_size = (arena_size + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+        void* memory = ::mmap(nullptr, arena_size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED) arena = static_cast<char*>(memory);
+    }
+    if (!arena) {
+        void* memory = ::mmap(nullptr, arena_size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "cannot allocate buffer pool");
+        }
+        arena = static_cast<char*>(memory);
+        if (options.huge_pages) {
+            // only a hint, transparent huge pages may be disabled
+            ::madvise(arena, arena_size, MADV_HUGEPAGE);
+        }
+    }
+    for (size_t i = 0; i < page_count; i++) {
+        frames[i].data = arena + i * page_size;
+    }
+
+    shard_count = 1;
+    while (shard_count < kMaxShards && page_count / (2 * shard_count) >= kMinShardFrames) {
+        shard_count *= 2;
+    }
+    shards = std::make_unique<Shard[]>(shard_count);
+    size_t first_frame = 0;
+    for (size_t i = 0; i < shard_count; i++) {
+        auto& shard = shards[i];
+        size_t shard_frames = page_count / shard_count + (i < page_count % shard_count);
+        shard.frame_count = shard_frames;
+        shard.page_table = PageTable(shard_frames);
+        shard.free_frames.reserve(shard_frames);
+        for (size_t j = first_frame + shard_frames; j > first_frame; --j) {
+            shard.free_frames.push_back(j - 1);
+            frames[j - 1].shard_id = i;
+        }
+        first_frame += shard_frames;
+    }
+    if (options.background_writer) {
+        writer = std::thread([this] { run_writer(); });
+    }
+}
+
+
+BufferManager::PageTable::PageTable(size_t capacity) {
+    size_t slot_count = 1;
+    while (slot_count < 2 * capacity) {
+        slot_count *= 2;
+    }
+    slots.resize(slot_count);
+    mask = slot_count - 1;
+}
+
+
+size_t BufferManager::PageTable::find(uint64_t page_id, uint64_t hash) const {
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        if (slots[i].page_id == page_id) return slots[i].frame_id;
+        if (slots[i].page_id == INVALID_PAGE_ID) return INVALID_FRAME_ID;
+    }
+}
+
+
+void BufferManager::PageTable::insert(uint64_t page_id, uint64_t hash, size_t frame_id) {
+    size_t i = hash & mask;
+    while (slots[i].page_id != INVALID_PAGE_ID) {
+        i = (i + 1) & mask;
+    }
+    slots[i] = {page_id, frame_id};
+}
+
+
+void BufferManager::PageTable::erase(uint64_t page_id, uint64_t hash) {
+    size_t i = hash & mask;
+    while (slots[i].page_id != page_id) {
+        i = (i + 1) & mask;
+    }
+    // Moves following entries of the probe sequence into the gap, so that
+    // lookups can stop at the first empty slot without tombstones.
+    for (size_t j = (i + 1) & mask; slots[j].page_id != INVALID_PAGE_ID; j = (j + 1) & mask) {
+        size_t home = hash_page(slots[j].page_id) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+    slots[i] = Slot{};
+}
+
+
+uint64_t BufferManager::hash_page(uint64_t page_id) {
+    // finalizer of MurmurHash3, page ids of a segment are consecutive
+    page_id ^= page_id >> 33;
+    page_id *= 0xff51afd7ed558ccdull;
+    page_id ^= page_id >> 33;
+    page_id *= 0xc4ceb9fe1a85ec53ull;
+    page_id ^= page_id >> 33;
+    return page_id;
+}
+
+
+BufferManager::~BufferManager() {
+    if (writer.joinable()) {
+        {
+            std::unique_lock writer_guard(writer_latch);
+            writer_stop = true;
+        }
+        writer_cv.notify_one();
+        writer.join();
+    }
+    for (auto& frame : frames) {
+        if (frame.page_id != INVALID_PAGE_ID && frame.is_dirty) {
+            write_page(frame);
+        }
+    }
+    for (auto& [segment_id, fd] : segment_files) {
+        ::close(fd);
+    }
+    if (arena) ::munmap(arena, arena_size);
+    if (mappings) {
+        for (size_t segment_id = 0; segment_id < (1 << 16); segment_id++) {
+            auto* mapping = mappings[segment_id].load();
+            if (!mapping) continue;
+            for (size_t i = 0; i < mapping->size / page_size; i++) {
+                delete mapping->frames[i].load();
+            }
+            if (mapping->data) ::munmap(mapping->data, mapping->size);
+            delete mapping;
+        }
+    }
+}
+
+
+BufferFrame& BufferManager::fix_page(uint64_t page_id, bool exclusive) {
+    if (mode == Mode::ReadOnlyMapped) {
+        if (exclusive) {
+            throw std::logic_error("pages of a read-only buffer manager cannot be fixed exclusively");
+        }
+        return fix_mapped_page(page_id);
+    }
+    // The frame cannot be evicted while it is pinned, so it is safe to wait
+    // for its latch without holding the latch of its shard.
+    for (;;) {
+        auto& frame = pin_page(page_id);
+        if (exclusive) {
+            frame.latch.lock();
+        } else {
+            frame.latch.lock_shared();
+        }
+        // the page id is reset when loading the page failed, fixing it again
+        // retries the read
+        if (frame.page_id.load(std::memory_order_acquire) != page_id) {
+            if (exclusive) {
+                frame.latch.unlock();
+            } else {
+                frame.latch.unlock_shared();
+            }
+            unpin_page(frame, false);
+            continue;
+        }
+        if (exclusive) {
+            frame.exclusive = true;
+            frame.version.fetch_add(1, std::memory_order_acq_rel);
+        }
+        return frame;
+    }
+}
+
+
+BufferFrame& BufferManager::fix_page_optimistic(uint64_t page_id) {
+    if (mode == Mode::ReadOnlyMapped) {
+        return fix_mapped_page(page_id);
+    }
+    for (;;) {
+        auto& frame = pin_page(page_id);
+        if (frame.page_id.load(std::memory_order_acquire) == page_id) {
+            return frame;
+        }
+        unpin_page(frame, false);
+    }
+}
+
+
+void BufferManager::unfix_page(BufferFrame& page, bool is_dirty) {
+    if (mode == Mode::ReadOnlyMapped) {
+        if (is_dirty) {
+            throw std::logic_error("pages of a read-only buffer manager cannot be modified");
+        }
+        return;
+    }
+    if (page.exclusive) {
+        page.exclusive = false;
+        if (is_dirty) {
+            page.version.fetch_add(1, std::memory_order_release);
+        } else {
+            page.version.fetch_sub(1, std::memory_order_release);
+        }
+        page.latch.unlock();
+    } else {
+        page.latch.unlock_shared();
+    }
+    unpin_page(page, is_dirty);
+}
+
+
+BufferFrame& BufferManager::fix_page_optimistic(uint64_t page_id, Swip& swip, uint64_t& version, bool& pinned) {
+    if (auto* frame = swip.frame.load(std::memory_order_acquire)) {
+        version = frame->get_version();
+        if (frame->page_id.load(std::memory_order_acquire) == page_id) {
+            counters.add(kFixes);
+            counters.add(kHits);
+            // only written when not set, hot pages keep their cache line
+            // shared between the readers
+            if (!frame->referenced.load(std::memory_order_relaxed)) {
+                frame->referenced.store(true, std::memory_order_relaxed);
+            }
+            pinned = false;
+            return *frame;
+        }
+    }
+    for (;;) {
+        auto& frame = fix_page_optimistic(page_id);
+        version = frame.get_version();
+        // a failed load resets the page id before the version becomes even
+        if (frame.page_id.load(std::memory_order_acquire) != page_id) {
+            unpin_page(frame, false);
+            continue;
+        }
+        swip.frame.store(&frame, std::memory_order_release);
+        pinned = true;
+        return frame;
+    }
+}
+
+
+void BufferManager::unfix_page_optimistic(BufferFrame& page) {
+    if (mode == Mode::ReadOnlyMapped) return;
+    unpin_page(page, false);
+}
+
+
+Swip& BufferManager::get_child_swip(BufferFrame& page, size_t slot) {
+    auto* swips = page.child_swips.load(std::memory_order_acquire);
+    if (!swips) {
+        // threads that race here keep the array that was installed first
+        auto fresh = std::make_unique<Swip[]>(page_size / sizeof(uint64_t));
+        if (page.child_swips.compare_exchange_strong(swips, fresh.get(), std::memory_order_acq_rel)) {
+            swips = fresh.release();
+        }
+    }
+    return swips[slot];
+}
+
+
+BufferFrame& BufferManager::fix_mapped_page(uint64_t page_id) {
+    auto& mapping = get_mapping(get_segment_id(page_id));
+    auto segment_page_id = get_segment_page_id(page_id);
+    if (segment_page_id >= mapping.size / page_size) {
+        throw std::out_of_range("page is behind the end of the mapped segment file");
+    }
+    counters.add(kFixes);
+    auto& slot = mapping.frames[segment_page_id];
+    if (auto* frame = slot.load(std::memory_order_acquire)) {
+        counters.add(kHits);
+        return *frame;
+    }
+
+    // Threads that fix the page for the first time at once race to install
+    // their frame, the losers use the frame of the winner.
+    auto frame = std::make_unique<BufferFrame>();
+    frame->page_id = page_id;
+    frame->data = mapping.data + segment_page_id * page_size;
+    BufferFrame* installed = nullptr;
+    if (slot.compare_exchange_strong(installed, frame.get(), std::memory_order_acq_rel)) {
+        counters.add(kMisses);
+        return *frame.release();
+    }
+    counters.add(kHits);
+    return *installed;
+}
+
+
+BufferManager::Mapping& BufferManager::get_mapping(uint16_t segment_id) {
+    if (auto* mapping = mappings[segment_id].load(std::memory_order_acquire)) {
+        return *mapping;
+    }
+    std::unique_lock file_guard(file_latch);
+    if (auto* mapping = mappings[segment_id].load(std::memory_order_acquire)) {
+        return *mapping;
+    }
+
+    auto name = std::to_string(segment_id);
+    int fd = ::open(name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(),
+                                "cannot open segment file " + name);
+    }
+    struct stat status;
+    if (::fstat(fd, &status) != 0) {
+        auto error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(),
+                                "cannot open segment file " + name);
+    }
+    auto mapping = std::make_unique<Mapping>();
+    mapping->size = status.st_size / page_size * page_size;
+    if (mapping->size > 0) {
+        void* data = ::mmap(nullptr, mapping->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            auto error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(),
+                                    "cannot map segment file " + name);
+        }
+        mapping->data = static_cast<char*>(data);
+    }
+    ::close(fd);
+    mapping->frames = std::make_unique<std::atomic<BufferFrame*>[]>(mapping->size / page_size);
+    apply_access_hint(*mapping);
+    mappings[segment_id].store(mapping.get(), std::memory_order_release);
+    return *mapping.release();
+}
+
+
+void BufferManager::set_access_hint(AccessHint hint) {
+    std::unique_lock file_guard(file_latch);
+    access_hint = hint;
+    if (!mappings) return;
+    for (size_t segment_id = 0; segment_id < (1 << 16); segment_id++) {
+        if (auto* mapping = mappings[segment_id].load(std::memory_order_acquire)) {
+            apply_access_hint(*mapping);
+        }
+    }
 }
 
 
-BufferManager::BufferManager(size_t page_size, size_t /*page_count*/) : page_size(page_size) {
+void BufferManager::apply_access_hint(const Mapping& mapping) {
+    if (!mapping.data) return;
+    int advice = MADV_NORMAL;
+    switch (access_hint) {
+        case AccessHint::Normal: advice = MADV_NORMAL; break;
+        case AccessHint::Random: advice = MADV_RANDOM; break;
+        case AccessHint::Sequential: advice = MADV_SEQUENTIAL; break;
+        case AccessHint::WillNeed: advice = MADV_WILLNEED; break;
+    }
+    // only a hint, failures do not matter
+    ::madvise(mapping.data, mapping.size, advice);
 }
 
 
-BufferManager::~BufferManager() = default;
+BufferFrame& BufferManager::pin_page(uint64_t page_id) {
+    auto hash = hash_page(page_id);
+    auto& shard = get_shard(hash);
+    std::unique_lock shard_guard(shard.latch);
+    if (auto frame_id = shard.page_table.find(page_id, hash); frame_id != INVALID_FRAME_ID) {
+        auto& frame = frames[frame_id];
+        auto& queue = frame.in_lru ? shard.lru_queue : shard.fifo_queue;
+        shard.lru_queue.splice(shard.lru_queue.end(), queue, frame.queue_position);
+        frame.in_lru = true;
+        frame.referenced.store(false, std::memory_order_relaxed);
+        ++frame.fix_count;
+        counters.add(kFixes);
+        counters.add(kHits);
+        return frame;
+    }
 
+    auto frame_id = allocate_frame(shard);
+    counters.add(kFixes);
+    counters.add(kMisses);
+    auto& frame = frames[frame_id];
 
-BufferFrame& BufferManager::fix_page(uint64_t page_id, bool /*exclusive*/) {
-    auto result = pages.emplace(page_id, BufferFrame{});
-    auto& page = result.first->second;
-    bool is_new = result.second;
-    if (is_new) {
-        page.data.resize(page_size, 0);
+    // Nobody else can hold the latch of a frame that was unfixed. Concurrent
+    // fixes of the same page wait on the latch until the page is loaded.
+    // The version is odd before the page id changes, see `Swip`.
+    frame.latch.lock();
+    frame.version.fetch_add(1, std::memory_order_acq_rel);
+    frame.page_id = page_id;
+    frame.is_dirty = false;
+    frame.in_lru = false;
+    frame.referenced.store(false, std::memory_order_relaxed);
+    frame.fix_count = 1;
+    frame.queue_position = shard.fifo_queue.insert(shard.fifo_queue.end(), frame_id);
+    shard.page_table.insert(page_id, hash, frame_id);
+    shard_guard.unlock();
+    try {
+        read_page(frame);
+    } catch (...) {
+        // Take the page out of the pool again. Threads that found it in the
+        // page table meanwhile see the invalid page id and unpin the frame,
+        // the last unpin returns it to the free frames.
+        shard_guard.lock();
+        shard.page_table.erase(page_id, hash);
+        shard.fifo_queue.erase(frame.queue_position);
+        frame.page_id.store(INVALID_PAGE_ID, std::memory_order_release);
+        if (--frame.fix_count == 0) {
+            shard.free_frames.push_back(frame_id);
+        }
+        shard_guard.unlock();
+        frame.version.fetch_add(1, std::memory_order_release);
+        frame.latch.unlock();
+        throw;
     }
-    return page;
+    frame.version.fetch_add(1, std::memory_order_release);
+    frame.latch.unlock();
+    return frame;
 }
 
 
-void BufferManager::unfix_page(BufferFrame& /*page*/, bool /*is_dirty*/) {
+void BufferManager::unpin_page(BufferFrame& page, bool is_dirty) {
+    auto& shard = shards[page.shard_id];
+    std::unique_lock shard_guard(shard.latch);
+    page.is_dirty |= is_dirty;
+    if (--page.fix_count == 0 && page.page_id.load(std::memory_order_relaxed) == INVALID_PAGE_ID) {
+        // the load of the page failed while others waited for it
+        shard.free_frames.push_back(&page - frames.data());
+    }
+}
+
+
+void BufferManager::flush_all() {
+    std::vector<size_t> dirty_frames;
+    for (size_t i = 0; i < shard_count; i++) {
+        std::unique_lock shard_guard(shards[i].latch);
+        for (auto& queue : {&shards[i].fifo_queue, &shards[i].lru_queue}) {
+            for (auto frame_id : *queue) {
+                if (frames[frame_id].is_dirty) {
+                    ++frames[frame_id].fix_count;
+                    dirty_frames.push_back(frame_id);
+                }
+            }
+        }
+    }
+    write_back(std::move(dirty_frames), true);
+
+    std::unique_lock file_guard(file_latch);
+    for (auto& [segment_id, fd] : segment_files) {
+        if (::fsync(fd) != 0) {
+            throw std::system_error(errno, std::generic_category(), "cannot sync segment file");
+        }
+    }
+}
+
+
+BufferManager::Stats BufferManager::get_stats() const {
+    Stats stats;
+    stats.fixes = counters.get(kFixes);
+    stats.hits = counters.get(kHits);
+    stats.misses = counters.get(kMisses);
+    stats.evictions = counters.get(kEvictions);
+    stats.write_backs = counters.get(kWriteBacks);
+    return stats;
 }
 
 
 std::vector<uint64_t> BufferManager::get_fifo_list() const {
-    return {};
+    std::vector<uint64_t> list;
+    for (size_t i = 0; i < shard_count; i++) {
+        std::unique_lock shard_guard(shards[i].latch);
+        for (auto frame_id : shards[i].fifo_queue) {
+            list.push_back(frames[frame_id].page_id);
+        }
+    }
+    return list;
 }
 
 
 std::vector<uint64_t> BufferManager::get_lru_list() const {
-    return {};
+    std::vector<uint64_t> list;
+    for (size_t i = 0; i < shard_count; i++) {
+        std::unique_lock shard_guard(shards[i].latch);
+        for (auto frame_id : shards[i].lru_queue) {
+            list.push_back(frames[frame_id].page_id);
+        }
+    }
+    return list;
 }
 
-}  
+
+size_t BufferManager::allocate_frame(Shard& shard) {
+    if (!shard.free_frames.empty()) {
+        auto frame_id = shard.free_frames.back();
+        shard.free_frames.pop_back();
+        return frame_id;
+    }
+    if (writer.joinable()) {
+        // the background writer keeps the front of the queues clean
+        size_t candidates = 0;
+        size_t window = get_clean_window(shard);
+        for (auto* queue : {&shard.fifo_queue, &shard.lru_queue}) {
+            for (auto it = queue->begin(); it != queue->end() && candidates < window;) {
+                auto frame_id = *it++;
+                if (frames[frame_id].fix_count != 0) continue;
+                if (give_second_chance(shard, frame_id)) continue;
+                candidates++;
+                if (!frames[frame_id].is_dirty) {
+                    evict(shard, frame_id);
+                    return frame_id;
+                }
+            }
+        }
+        if (!writer_requested.exchange(true)) writer_cv.notify_one();
+    }
+    // A frame that gets a second chance moves to the end of the LRU queue,
+    // the second pass evicts it when all other frames are fixed.
+    for (int pass = 0; pass < 2; pass++) {
+        for (auto* queue : {&shard.fifo_queue, &shard.lru_queue}) {
+            for (auto it = queue->begin(); it != queue->end();) {
+                auto frame_id = *it++;
+                if (frames[frame_id].fix_count != 0) continue;
+                if (pass == 0 && give_second_chance(shard, frame_id)) continue;
+                evict(shard, frame_id);
+                return frame_id;
+            }
+        }
+    }
+    throw buffer_full_error{};
+}
+
+
+bool BufferManager::give_second_chance(Shard& shard, size_t frame_id) {
+    auto& frame = frames[frame_id];
+    if (!frame.referenced.exchange(false, std::memory_order_relaxed)) return false;
+    auto& queue = frame.in_lru ? shard.lru_queue : shard.fifo_queue;
+    shard.lru_queue.splice(shard.lru_queue.end(), queue, frame.queue_position);
+    frame.in_lru = true;
+    return true;
+}
+
+
+void BufferManager::run_writer() {
+    std::unique_lock writer_guard(writer_latch);
+    while (!writer_stop) {
+        if (!writer_requested.exchange(false)) {
+            writer_cv.wait_for(writer_guard, kWriterInterval);
+            writer_requested = false;
+        }
+        if (writer_stop) break;
+        writer_guard.unlock();
+        for (size_t i = 0; i < shard_count; i++) {
+            auto& shard = shards[i];
+            std::vector<size_t> dirty_frames;
+            {
+                std::unique_lock shard_guard(shard.latch);
+                size_t candidates = 0;
+                size_t window = get_clean_window(shard);
+                for (auto* queue : {&shard.fifo_queue, &shard.lru_queue}) {
+                    for (auto it = queue->begin(); it != queue->end() && candidates < window; ++it) {
+                        auto& frame = frames[*it];
+                        if (frame.fix_count != 0) continue;
+                        candidates++;
+                        if (frame.is_dirty) {
+                            ++frame.fix_count;
+                            dirty_frames.push_back(*it);
+                        }
+                    }
+                }
+            }
+            try {
+                write_back(std::move(dirty_frames), false);
+            } catch (...) {
+                // the pages stay dirty, the eviction that writes them itself
+                // reports the error
+            }
+        }
+        writer_guard.lock();
+    }
+}
+
+
+void BufferManager::write_back(std::vector<size_t> frame_ids, bool wait) {
+    Defer unpin([&]() {
+        for (auto frame_id : frame_ids) {
+            auto& frame = frames[frame_id];
+            std::unique_lock shard_guard(get_shard(hash_page(frame.page_id)).latch);
+            --frame.fix_count;
+        }
+    });
+    if (frame_ids.empty()) return;
+    std::sort(frame_ids.begin(), frame_ids.end(), [&](size_t lhs, size_t rhs) {
+        return frames[lhs].page_id < frames[rhs].page_id;
+    });
+
+    size_t batch_pages = std::max<size_t>(1, kMaxWriteBytes / page_size);
+    size_t batch_size = (batch_pages * page_size + kDirectIOAlignment - 1) / kDirectIOAlignment * kDirectIOAlignment;
+    std::unique_ptr<char, decltype(&std::free)> batch(
+        static_cast<char*>(std::aligned_alloc(kDirectIOAlignment, batch_size)), &std::free);
+    if (!batch) throw std::bad_alloc();
+
+    // the copied pages with the version they were copied at
+    std::vector<std::pair<size_t, uint64_t>> run;
+    uint64_t run_lsn = 0;
+    auto write_run = [&]() {
+        if (run.empty()) return;
+        if (log && run_lsn != 0) log->flush(run_lsn);
+        auto first_page_id = frames[run.front().first].page_id.load();
+        auto fd = get_segment_file(get_segment_id(first_page_id));
+        auto offset = get_segment_page_id(first_page_id) * page_size;
+        size_t size = run.size() * page_size;
+        size_t bytes_written = 0;
+        while (bytes_written < size) {
+            auto result = ::pwrite(fd, batch.get() + bytes_written, size - bytes_written,
+                                   static_cast<off_t>(offset + bytes_written));
+            if (result < 0) {
+                if (errno == EINTR) continue;
+                throw std::system_error(errno, std::generic_category(), "cannot write page");
+            }
+            bytes_written += result;
+        }
+        counters.add(kWriteBacks, run.size());
+        for (auto [frame_id, version] : run) {
+            auto& frame = frames[frame_id];
+            std::unique_lock shard_guard(get_shard(hash_page(frame.page_id)).latch);
+            // a page that was changed after it was copied stays dirty
+            if (frame.version.load() == version) frame.is_dirty = false;
+        }
+        run.clear();
+        run_lsn = 0;
+    };
+
+    for (auto frame_id : frame_ids) {
+        auto& frame = frames[frame_id];
+        uint64_t page_id = frame.page_id;
+        if (!run.empty()) {
+            auto last_page_id = frames[run.back().first].page_id.load();
+            if (page_id != last_page_id + 1 || get_segment_id(page_id) != get_segment_id(last_page_id) ||
+                run.size() == batch_pages) {
+                write_run();
+            }
+        }
+        if (wait) {
+            frame.latch.lock_shared();
+        } else if (!frame.latch.try_lock_shared()) {
+            // a writer changes the page right now, it will be dirty again
+            write_run();
+            continue;
+        }
+        std::memcpy(batch.get() + run.size() * page_size, frame.data, page_size);
+        uint64_t lsn;
+        std::memcpy(&lsn, frame.data, sizeof(lsn));
+        run.emplace_back(frame_id, frame.version.load());
+        frame.latch.unlock_shared();
+        run_lsn = std::max(run_lsn, lsn);
+    }
+    write_run();
+}
+
+
+void BufferManager::evict(Shard& shard, size_t frame_id) {
+    auto& frame = frames[frame_id];
+    if (frame.is_dirty) {
+        write_page(frame);
+        frame.is_dirty = false;
+    }
+    (frame.in_lru ? shard.lru_queue : shard.fifo_queue).erase(frame.queue_position);
+    counters.add(kEvictions);
+    shard.page_table.erase(frame.page_id, hash_page(frame.page_id));
+    frame.page_id = INVALID_PAGE_ID;
+}
+
+
+int BufferManager::get_segment_file(uint16_t segment_id) {
+    std::unique_lock file_guard(file_latch);
+    if (auto it = segment_files.find(segment_id); it != segment_files.end()) {
+        return it->second;
+    }
+    auto name = std::to_string(segment_id);
+    int flags = O_RDWR | O_CREAT | (options.direct_io ? O_DIRECT : 0);
+    int fd = ::open(name.c_str(), flags, 0666);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(),
+                                "cannot open segment file " + name);
+    }
+    segment_files.emplace(segment_id, fd);
+    return fd;
+}
+
+
+void BufferManager::read_page(BufferFrame& frame) {
+    auto fd = get_segment_file(get_segment_id(frame.page_id));
+    auto offset = static_cast<off_t>(get_segment_page_id(frame.page_id) * page_size);
+    size_t bytes_read = 0;
+    while (bytes_read < page_size) {
+        auto result = ::pread(fd, frame.data + bytes_read,
+                              page_size - bytes_read, offset + bytes_read);
+        if (result < 0) {
+            if (errno == EINTR) continue;
+            throw std::system_error(errno, std::generic_category(), "cannot read page");
+        }
+        if (result == 0) {
+            // Pages behind the end of the segment file have never been
+            // written and are initialized with zeros.
+            std::memset(frame.data + bytes_read, 0, page_size - bytes_read);
+            break;
+        }
+        bytes_read += result;
+    }
+}
+
+
+void BufferManager::write_page(BufferFrame& frame) {
+    if (log) {
+        uint64_t lsn;
+        std::memcpy(&lsn, frame.data, sizeof(lsn));
+        if (lsn != 0) log->flush(lsn);
+    }
+    counters.add(kWriteBacks);
+    auto fd = get_segment_file(get_segment_id(frame.page_id));
+    auto offset = static_cast<off_t>(get_segment_page_id(frame.page_id) * page_size);
+    size_t bytes_written = 0;
+    while (bytes_written < page_size) {
+        auto result = ::pwrite(fd, frame.data + bytes_written,
+                               page_size - bytes_written, offset + bytes_written);
+        if (result < 0) {
+            if (errno == EINTR) continue;
+            throw std::system_error(errno, std::generic_category(), "cannot write page");
+        }
+        bytes_written += result;
+    }
+}
+
+}
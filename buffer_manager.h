@@ -1,23 +1,115 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
 #include <exception>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
+#include "common/macros.h"
+#include "common/stats.h"
+
 
 namespace buzzdb {
 
+class WriteAheadLog;
+class BufferFrame;
+
+/// A swizzled reference to a page. It remembers the frame the page resided
+/// in when it was last fixed through the reference, so the page can be
+/// fixed again without the page table. The page id stays authoritative: a
+/// frame that was evicted or reused for another page is noticed when the
+/// reference is followed, so references never have to be unswizzled.
+class Swip {
+private:
+    friend class BufferManager;
+
+    std::atomic<BufferFrame*> frame = nullptr;
+};
+
+
 class BufferFrame {
 private:
     friend class BufferManager;
 
-    std::vector<char> data;
+    /// The id of the page that currently resides in this frame. A new page id
+    /// is only set while the version is odd, so optimistic readers that
+    /// validate their version also know that the frame held their page.
+    std::atomic<uint64_t> page_id = INVALID_PAGE_ID;
+
+    /// How often the page is currently fixed. Protected by the latch of the
+    /// shard of the buffer manager that the frame belongs to.
+    size_t fix_count = 0;
+
+    /// The shard of the buffer manager that the frame belongs to. Fixed when
+    /// the buffer manager is created, the page id only determines the shard
+    /// while the frame holds a page.
+    size_t shard_id = 0;
+
+    /// Reader/writer latch of the page. Held from `fix_page()` until
+    /// `unfix_page()`.
+    std::shared_mutex latch;
+
+    /// Is the latch held exclusively?
+    bool exclusive = false;
+
+    /// Version of the page for optimistic readers. Odd while the page is
+    /// latched exclusively, incremented again when the page is unfixed dirty.
+    std::atomic<uint64_t> version = 0;
+
+    /// Has the page been modified since it was read from disk?
+    bool is_dirty = false;
+
+    /// Is the frame in the LRU queue? Otherwise it is in the FIFO queue.
+    bool in_lru = false;
+
+    /// Was the page fixed through a swizzled reference since the replacement
+    /// last passed it? Those fixes do not take the latch of the shard, so
+    /// the page is moved to the end of the LRU queue when it would be
+    /// evicted instead, a second chance.
+    std::atomic<bool> referenced = false;
+
+    /// Position of the frame in its replacement queue.
+    std::list<size_t>::iterator queue_position;
+
+    /// The page. Points into the arena of the buffer manager, or into the
+    /// mapping of its segment file in `Mode::ReadOnlyMapped`.
+    char* data = nullptr;
+
+    /// References to the pages this page refers to, by slot. Allocated when
+    /// the first one is used and kept when the frame is reused, stale
+    /// references are detected like evicted ones.
+    std::atomic<Swip*> child_swips = nullptr;
 
 public:
+    ~BufferFrame() { delete[] child_swips.load(); }
+
     /// Returns a pointer to this page's data.
     char* get_data();
+
+    /// Returns the current version of the page. An odd version means that a
+    /// writer holds the page and its data must not be read optimistically.
+    uint64_t get_version() const {
+        return version.load(std::memory_order_acquire);
+    }
+
+    /// Returns true when the page was not modified since `get_version()`
+    /// returned `expected`. Optimistic readers must validate every value
+    /// they read from the page before acting on it.
+    bool validate(uint64_t expected) const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return version.load(std::memory_order_relaxed) == expected;
+    }
 };
 
 
@@ -31,20 +123,298 @@ public:
 
 
 class BufferManager {
+public:
+    /// How the buffer manager holds pages.
+    enum class Mode {
+        /// Pages are read into at most `page_count` frames and written back.
+        ReadWrite,
+        /// Segment files are mapped read-only and pages point directly into
+        /// the mapping, the operating system caches them. Pages can only be
+        /// fixed shared and must not be unfixed dirty. The segment files must
+        /// not be changed while they are mapped, pages behind their end at
+        /// the time they were mapped cannot be fixed.
+        ReadOnlyMapped,
+    };
+
+    /// Access pattern hints for mapped segment files, see `madvise(2)`.
+    enum class AccessHint { Normal, Random, Sequential, WillNeed };
+
+    /// How the memory of the frames is allocated and how pages are read.
+    struct Options {
+        /// Back the frames by huge pages. Explicit huge pages are used when
+        /// enough of them are reserved, transparent ones otherwise.
+        bool huge_pages = false;
+        /// Read and write pages with `O_DIRECT`, bypassing the page cache of
+        /// the operating system. The page size has to be a multiple of
+        /// `kDirectIOAlignment`.
+        bool direct_io = false;
+        /// Run a background thread that writes dirty pages back before they
+        /// are evicted, evictions then prefer clean pages.
+        bool background_writer = false;
+        /// Share of the frames of every shard, counted from the front of its
+        /// replacement queues, that the background writer keeps clean.
+        double clean_fraction = 0.1;
+    };
+
+    /// Alignment of the pages in memory and of their size for direct I/O.
+    static constexpr size_t kDirectIOAlignment = 4096;
+
+    /// Counters of the buffer manager since its construction.
+    struct Stats {
+        /// Number of fixes, including optimistic fixes.
+        uint64_t fixes = 0;
+        /// Number of fixes that found their page in memory.
+        uint64_t hits = 0;
+        /// Number of fixes that had to load their page.
+        uint64_t misses = 0;
+        /// Number of pages that were evicted to make room for another page.
+        uint64_t evictions = 0;
+        /// Number of dirty pages that were written back.
+        uint64_t write_backs = 0;
+    };
+
 private:
+    enum Counter : size_t { kFixes, kHits, kMisses, kEvictions, kWriteBacks, kCounterCount };
+
+    /// Maps the page ids of resident pages to their frames. Uses open
+    /// addressing with linear probing in a fixed array that has at least
+    /// twice as many slots as pages can be resident, so it never rehashes.
+    class PageTable {
+    private:
+        struct Slot {
+            uint64_t page_id = INVALID_PAGE_ID;
+            size_t frame_id = INVALID_FRAME_ID;
+        };
+
+        std::vector<Slot> slots;
+        size_t mask = 0;
+
+    public:
+        /// Constructor.
+        /// @param[in] capacity  Maximum number of pages in the table.
+        explicit PageTable(size_t capacity = 0);
+
+        /// Returns the frame of a page, `INVALID_FRAME_ID` if it is missing.
+        size_t find(uint64_t page_id, uint64_t hash) const;
+
+        /// Adds a page that is not in the table.
+        void insert(uint64_t page_id, uint64_t hash, size_t frame_id);
+
+        /// Removes a page that is in the table.
+        void erase(uint64_t page_id, uint64_t hash);
+    };
+
+    /// A partition of the buffer pool. Pages belong to a shard by the hash of
+    /// their page id and only ever reside in its frames, so every shard
+    /// replaces its pages on its own and threads only contend when they fix
+    /// pages of the same shard.
+    struct alignas(64) Shard {
+        /// Protects the members below and the fix counts of the frames of
+        /// the shard. Never held while waiting for a page latch.
+        mutable std::mutex latch;
+
+        /// Number of frames of the shard.
+        size_t frame_count = 0;
+
+        /// Frames of the shard that do not hold a page yet.
+        std::vector<size_t> free_frames;
+
+        /// Maps page ids of the resident pages of the shard to their frame.
+        PageTable page_table;
+
+        /// 2Q replacement queues. Pages enter the FIFO queue when they are
+        /// loaded and move to the LRU queue when they are fixed again.
+        std::list<size_t> fifo_queue;
+        std::list<size_t> lru_queue;
+    };
+
+    /// Shards have at least this many frames, smaller pools use one shard.
+    static constexpr size_t kMinShardFrames = 1024;
+    static constexpr size_t kMaxShards = 64;
+
+    /// Size of explicit and transparent huge pages.
+    static constexpr size_t kHugePageSize = 2 << 20;
+
+    /// Most bytes of adjacent pages that are written back with one write.
+    static constexpr size_t kMaxWriteBytes = 1 << 20;
+
+    /// How long the background writer sleeps when nobody wakes it up.
+    static constexpr std::chrono::milliseconds kWriterInterval{10};
+
     size_t page_size;
-    std::unordered_map<uint64_t, BufferFrame> pages;
+    size_t page_count;
+    Mode mode;
+    Options options;
+
+    /// The memory of all pages of the buffer pool, allocated at once and
+    /// aligned to `kDirectIOAlignment`. Frame `i` holds its page at
+    /// `arena + i * page_size`.
+    char* arena = nullptr;
+    size_t arena_size = 0;
+
+    /// All frames of the buffer pool. Never grows beyond `page_count`.
+    std::vector<BufferFrame> frames;
+
+    /// The shards, a power of two of them. Every shard owns a contiguous
+    /// range of `frames`.
+    std::unique_ptr<Shard[]> shards;
+    size_t shard_count = 0;
+
+    /// File descriptors of the opened segment files.
+    std::unordered_map<uint16_t, int> segment_files;
+
+    /// Protects `segment_files`.
+    std::mutex file_latch;
+
+    /// The log that has to be written up to the LSN of a page before the
+    /// page is written, nullptr when pages are not logged.
+    WriteAheadLog* log = nullptr;
+
+    /// Event counters, see `Stats`.
+    StatsCounters<kCounterCount> counters;
+
+    /// The background writer, see `Options::background_writer`.
+    std::thread writer;
+
+    /// Protects `writer_stop`.
+    std::mutex writer_latch;
+
+    /// Wakes up the background writer.
+    std::condition_variable writer_cv;
+
+    /// Asks the background writer to terminate.
+    bool writer_stop = false;
+
+    /// Has the background writer been woken up since its last pass? Saves
+    /// evictions from waking it up again and again.
+    std::atomic<bool> writer_requested = false;
+
+    /// A segment file that is mapped read-only.
+    struct Mapping {
+        char* data = nullptr;
+        size_t size = 0;
+        /// The frames of the pages, created when a page is fixed first.
+        std::unique_ptr<std::atomic<BufferFrame*>[]> frames;
+    };
+
+    /// Mappings by segment id in `Mode::ReadOnlyMapped`. Created on first
+    /// use while `file_latch` is held and only removed by the destructor.
+    std::unique_ptr<std::atomic<Mapping*>[]> mappings;
+
+    /// The hint for all mappings. Protected by `file_latch`.
+    AccessHint access_hint = AccessHint::Normal;
+
+    /// Hashes a page id for the shards and the page tables.
+    static uint64_t hash_page(uint64_t page_id);
+
+    /// Returns the shard of a page.
+    Shard& get_shard(uint64_t hash) {
+        return shards[(hash >> 40) & (shard_count - 1)];
+    }
+
+    /// Returns a frame of a shard that can hold a new page. Evicts a page when
+    /// no frame is free and throws `buffer_full_error` when all frames of the
+    /// shard are fixed. The latch of the shard has to be held.
+    size_t allocate_frame(Shard& shard);
+
+    /// Moves an unfixed frame that was referenced since the replacement last
+    /// passed it to the end of the LRU queue, like a fix through the page
+    /// table would have. The latch of the shard has to be held.
+    /// @return             True when the frame was moved and is not evicted.
+    bool give_second_chance(Shard& shard, size_t frame_id);
+
+    /// Removes the page in the given frame from its shard and writes it back
+    /// if it is dirty. The latch of the shard has to be held.
+    void evict(Shard& shard, size_t frame_id);
+
+    /// Pins a page in a frame without latching it. Loads the page when it is
+    /// not in memory.
+    BufferFrame& pin_page(uint64_t page_id);
+
+    /// Releases a pin that was taken by `pin_page()`.
+    void unpin_page(BufferFrame& page, bool is_dirty);
+
+    /// Returns the file descriptor of a segment file, opens it on first use.
+    int get_segment_file(uint16_t segment_id);
+
+    /// Reads the page of a frame from its segment file.
+    void read_page(BufferFrame& frame);
+
+    /// Writes the page of a frame to its segment file.
+    void write_page(BufferFrame& frame);
+
+    /// Writes pages back in the order of their page ids, runs of adjacent
+    /// pages of a segment with a single write, and marks them clean unless
+    /// they were modified meanwhile. The frames have to be pinned, they are
+    /// unpinned when this returns.
+    /// @param[in] frame_ids    The frames of the pages.
+    /// @param[in] wait         Wait for pages that are latched exclusively,
+    ///                         otherwise they are skipped and stay dirty.
+    void write_back(std::vector<size_t> frame_ids, bool wait);
+
+    /// The loop of the background writer.
+    void run_writer();
+
+    /// Returns how many unfixed frames at the front of the replacement
+    /// queues of a shard the background writer keeps clean.
+    size_t get_clean_window(const Shard& shard) const {
+        return std::max<size_t>(1, shard.frame_count * options.clean_fraction);
+    }
+
+    /// Returns the mapping of a segment file, maps it on first use.
+    Mapping& get_mapping(uint16_t segment_id);
+
+    /// Returns the frame of a page in `Mode::ReadOnlyMapped`.
+    BufferFrame& fix_mapped_page(uint64_t page_id);
+
+    /// Applies `access_hint` to a mapping.
+    void apply_access_hint(const Mapping& mapping);
 
 public:
+    /// Constructor.
+    /// @param[in] page_size  Size in bytes that all pages will have.
+    /// @param[in] page_count Maximum number of pages that should reside in
+    //                        memory at the same time. Pools of at least
+    ///                       `2 * kMinShardFrames` pages are split into
+    ///                       shards, every page only resides in the frames
+    ///                       of its shard, see `fix_page()`. Not used by
+    ///                       `Mode::ReadOnlyMapped`.
+    /// @param[in] mode       How pages are held.
+    BufferManager(size_t page_size, size_t page_count, Mode mode = Mode::ReadWrite);
+
     /// Constructor.
     /// @param[in] page_size  Size in bytes that all pages will have.
     /// @param[in] page_count Maximum number of pages that should reside in
     //                        memory at the same time.
-    BufferManager(size_t page_size, size_t page_count);
+    /// @param[in] mode       How pages are held.
+    /// @param[in] options    How the memory of the frames is allocated and
+    ///                       how pages are read.
+    BufferManager(size_t page_size, size_t page_count, Mode mode, Options options);
 
     /// Destructor. Writes all dirty pages to disk.
     ~BufferManager();
 
+    /// Attaches a write-ahead log. All pages of the buffer manager must start
+    /// with the LSN of their last logged change then, and a dirty page is
+    /// only written after the log up to that LSN is on disk.
+    void set_log(WriteAheadLog* log) { this->log = log; }
+
+    /// Sets the expected access pattern of all mapped segment files in
+    /// `Mode::ReadOnlyMapped`, e.g. `Random` for point lookups to avoid
+    /// read-ahead or `Sequential` for scans.
+    void set_access_hint(AccessHint hint);
+
+    /// Writes all dirty pages to disk and syncs the segment files. Latches
+    /// every dirty page shared while it is copied, adjacent pages are written
+    /// together. Used by checkpoints.
+    void flush_all();
+
+    /// Wakes up the background writer, e.g. before a burst of inserts.
+    void wake_writer() {
+        writer_requested = true;
+        writer_cv.notify_one();
+    }
+
     /// Returns size of a page
     size_t get_page_size() { return page_size; }
 
@@ -52,7 +422,11 @@ public:
     /// the page is not loaded into memory, it is read from disk. Otherwise the
     /// loaded page is used.
     /// When the page cannot be loaded because the buffer is full, throws the
-    /// exception `buffer_full_error`.
+    /// exception `buffer_full_error`. With several shards, that is when all
+    /// frames of the shard of the page are fixed, even if other shards have
+    /// unfixed frames: pages are spread evenly over the shards by their hash,
+    /// but a caller can only rely on fixing as many pages at once as one
+    /// shard has frames, at least `kMinShardFrames`.
     /// Is thread-safe w.r.t. other concurrent calls to `fix_page()` and
     /// `unfix_page()`.
     /// @param[in] page_id   Page id of the page that should be loaded.
@@ -66,16 +440,64 @@ public:
     /// written back to disk eventually.
     void unfix_page(BufferFrame& page, bool is_dirty);
 
+    /// Like `fix_page()`, but does not latch the page. The page stays in
+    /// memory until `unfix_page_optimistic()` is called, but it can be
+    /// modified by other threads at any time, so every read has to be
+    /// validated against the version of the frame.
+    /// Is thread-safe w.r.t. other concurrent calls to `fix_page()` and
+    /// `unfix_page()`.
+    /// @param[in] page_id   Page id of the page that should be loaded.
+    BufferFrame& fix_page_optimistic(uint64_t page_id);
+
+    /// Like `fix_page_optimistic()`, but follows a swizzled reference to the
+    /// page. When the reference still points to the frame of the page, the
+    /// page is neither looked up nor pinned. Otherwise the page is pinned and
+    /// the reference is swizzled to its frame.
+    /// @param[in] page_id   Page id of the page that should be loaded.
+    /// @param[in] swip      The reference that is followed.
+    /// @param[out] version  The version that reads of the page have to be
+    ///                      validated against, odd if a writer holds it.
+    ///                      Validating it also verifies that the frame held
+    ///                      the page.
+    /// @param[out] pinned   Was the page pinned? Only then it has to be
+    ///                      unfixed with `unfix_page_optimistic()`.
+    BufferFrame& fix_page_optimistic(uint64_t page_id, Swip& swip, uint64_t& version, bool& pinned);
+
+    /// Takes a `BufferFrame` reference that was returned by an earlier call to
+    /// `fix_page_optimistic()` and unfixes it.
+    void unfix_page_optimistic(BufferFrame& page);
+
+    /// Returns the reference in slot `slot` of a frame, e.g. the reference
+    /// to the child at that position of an inner node. A page refers to at
+    /// most `page_size / sizeof(uint64_t)` pages. The frame only has to be
+    /// pinned optimistically.
+    Swip& get_child_swip(BufferFrame& page, size_t slot);
+
+    /// Prefetches the frame a reference points to, so that fixing the page
+    /// through the reference soon after does not wait for memory.
+    void prefetch(const Swip& swip) const {
+        if (auto* frame = swip.frame.load(std::memory_order_relaxed)) {
+            __builtin_prefetch(frame);
+        }
+    }
+
     /// Returns the page ids of all pages (fixed and unfixed) that are in the
-    /// FIFO list in FIFO order.
+    /// FIFO list in FIFO order. With several shards, the lists of the shards
+    /// follow each other.
     /// Is not thread-safe.
     std::vector<uint64_t> get_fifo_list() const;
 
     /// Returns the page ids of all pages (fixed and unfixed) that are in the
-    /// LRU list in LRU order.
+    /// LRU list in LRU order. With several shards, the lists of the shards
+    /// follow each other.
     /// Is not thread-safe.
     std::vector<uint64_t> get_lru_list() const;
 
+    /// Returns the counters of the buffer manager. The counters are updated
+    /// without synchronization, so a snapshot taken during concurrent fixes
+    /// is not exact.
+    Stats get_stats() const;
+
     /// Returns the segment id for a given page id which is contained in the 16
     /// most significant bits of the page id.
     static constexpr uint16_t get_segment_id(uint64_t page_id) {
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+
+#include "buffer/buffer_manager.h"
+
+
+namespace buzzdb {
+
+/// A part of the database that keeps its pages in one segment of the buffer
+/// manager, e.g. an index. The page ids of the segment are built with
+/// `BufferManager::get_overall_page_id()`.
+class Segment {
+public:
+    /// Constructor.
+    /// @param[in] segment_id       The id of the segment.
+    /// @param[in] buffer_manager   The buffer manager that holds its pages.
+    Segment(uint16_t segment_id, BufferManager& buffer_manager)
+        : segment_id(segment_id), buffer_manager(buffer_manager) {}
+
+    /// Destructor.
+    virtual ~Segment() = default;
+
+protected:
+    /// The id of the segment.
+    uint16_t segment_id;
+
+    /// The buffer manager that holds the pages of the segment.
+    BufferManager& buffer_manager;
+};
+
+
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+
+namespace buzzdb {
+
+/// A fixed set of event counters that stays cheap under concurrency. Every
+/// thread increments the counters in its own cache line, the counters of all
+/// threads are only summed up when they are read.
+template <size_t Count>
+class StatsCounters {
+public:
+    /// Number of cache lines. Threads beyond that share cache lines, which is
+    /// still correct but slower.
+    static constexpr size_t kSlots = 64;
+
+    /// Constructor.
+    StatsCounters() : slots(new Slot[kSlots]) {}
+
+    /// Adds `n` to a counter.
+    void add(size_t counter, uint64_t n = 1) {
+        slots[slot_index()].values[counter].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    /// Returns the sum of a counter over all threads.
+    uint64_t get(size_t counter) const {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < kSlots; i++) {
+            sum += slots[i].values[counter].load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> values[Count]{};
+    };
+
+    /// The counters of every thread.
+    std::unique_ptr<Slot[]> slots;
+
+    /// Returns the cache line of the calling thread.
+    static size_t slot_index() {
+        static std::atomic<size_t> next_slot{0};
+        thread_local size_t slot = next_slot++ % kSlots;
+        return slot;
+    }
+};
+
+
+}
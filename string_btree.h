@@ -0,0 +1,998 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "buffer/buffer_manager.h"
+#include "common/macros.h"
+#include "index/tree_segment.h"
+#include "log/wal.h"
+
+using namespace std;
+
+namespace buzzdb {
+
+/// B+-tree with variable-length keys, e.g. URLs or composite keys whose
+/// parts are encoded so that their bytes sort like the keys. Keys are
+/// compared bytewise like `std::string_view`, a key sorts before all keys
+/// it is a prefix of.
+///
+/// The nodes are slotted pages: the slot array grows from the header, the
+/// keys and their payloads grow from the end of the page towards it. Every
+/// node stores the separators that bound it in its parent as fence keys and
+/// leaves out the prefix that all its keys share with both fences. A slot
+/// keeps the first bytes of the rest of its key as a big-endian integer, so
+/// most comparisons of a search never leave the slot array.
+template<typename ValueT, size_t PageSize>
+struct StringBTree : public TreeSegment<PageSize> {
+    static_assert(std::is_trivially_copyable_v<ValueT>, "values are copied into the pages");
+    static_assert(PageSize <= 65536, "slots address the page with 16 bits");
+
+    /// An entry of the slot array.
+    struct Slot {
+        /// Position of the key behind the prefix, the payload follows it.
+        uint16_t offset;
+        /// Length of the key behind the prefix.
+        uint16_t keyLength;
+        /// The first bytes of the key behind the prefix, see `key_head()`.
+        uint32_t head;
+    };
+
+    /// A fence key in the heap of a node.
+    struct Fence {
+        uint16_t offset = 0;
+        uint16_t length = 0;
+    };
+
+    struct NodeHeader {
+        /// The LSN of the last logged change of the page. Has to be the first
+        /// member, the write-ahead log stamps it into the page.
+        uint64_t lsn = 0;
+
+        /// The level in the tree.
+        uint16_t level;
+
+        /// The number of slots. Inner nodes have one more child, `link`.
+        uint16_t count = 0;
+
+        /// The length of the prefix that is left out of all keys, the common
+        /// prefix of both fences.
+        uint16_t prefixLength = 0;
+
+        /// The fence keys. The keys of the node are greater than the lower
+        /// fence and not greater than the upper one. A fence is empty when
+        /// the node is not bounded on that side.
+        Fence lowerFence;
+        Fence upperFence;
+
+        /// Leaves: the bytes that the leaf uses below which an underflowing
+        /// erase tries to merge it again, after a merge found no sibling
+        /// that fits. 0 when every underflow tries to merge.
+        uint16_t mergeRetry = 0;
+
+        /// Bytes of the heap that are used, including the fences.
+        uint32_t spaceUsed = 0;
+
+        /// The start of the heap.
+        uint32_t dataOffset = PageSize;
+
+        /// Leaves: the right sibling, `INVALID_PAGE_ID` for the last leaf.
+        /// Inner nodes: the child right of the last separator.
+        uint64_t link = INVALID_PAGE_ID;
+    };
+
+    /// A node of the tree. Leaves store `ValueT` behind every key, inner
+    /// nodes the page id of the child left of the separator.
+    struct Node: public NodeHeader {
+        static constexpr size_t kSpace = PageSize - sizeof(NodeHeader);
+
+        union {
+            Slot slots[kSpace / sizeof(Slot)];
+            uint8_t heap[kSpace];
+        };
+
+        /// Constructor.
+        /// @param[in] level    The level in the tree.
+        /// @param[in] lower    The lower fence.
+        /// @param[in] upper    The upper fence.
+        Node(uint16_t level, string_view lower, string_view upper) {
+            this->level = level;
+            this->lowerFence = store_fence(lower);
+            this->upperFence = store_fence(upper);
+            this->prefixLength = common_prefix(lower, upper);
+        }
+
+        /// Is the node a leaf node?
+        bool is_leaf() const { return this->level == 0; }
+
+        uint8_t* ptr() { return reinterpret_cast<uint8_t*>(this); }
+        const uint8_t* ptr() const { return reinterpret_cast<const uint8_t*>(this); }
+
+        /// The size of the payload behind every key.
+        uint32_t payload_size() const { return is_leaf() ? sizeof(ValueT) : sizeof(uint64_t); }
+
+        string_view lower_fence() const {
+            return {reinterpret_cast<const char*>(ptr() + this->lowerFence.offset), this->lowerFence.length};
+        }
+
+        string_view upper_fence() const {
+            return {reinterpret_cast<const char*>(ptr() + this->upperFence.offset), this->upperFence.length};
+        }
+
+        /// The prefix that all keys of the node share.
+        string_view prefix() const { return lower_fence().substr(0, this->prefixLength); }
+
+        /// The key of a slot behind the prefix.
+        string_view key_suffix(uint32_t pos) const {
+            return {reinterpret_cast<const char*>(ptr() + this->slots[pos].offset), this->slots[pos].keyLength};
+        }
+
+        /// The complete key of a slot.
+        string full_key(uint32_t pos) const {
+            string key(prefix());
+            key.append(key_suffix(pos));
+            return key;
+        }
+
+        uint8_t* payload(uint32_t pos) { return ptr() + this->slots[pos].offset + this->slots[pos].keyLength; }
+        const uint8_t* payload(uint32_t pos) const { return ptr() + this->slots[pos].offset + this->slots[pos].keyLength; }
+
+        ValueT value(uint32_t pos) const {
+            ValueT value;
+            std::memcpy(&value, payload(pos), sizeof(ValueT));
+            return value;
+        }
+
+        /// The child at a position of an inner node, `count` is `link`.
+        uint64_t child(uint32_t pos) const {
+            if (pos == this->count) return this->link;
+            uint64_t child;
+            std::memcpy(&child, payload(pos), sizeof(uint64_t));
+            return child;
+        }
+
+        void set_child(uint32_t pos, uint64_t child) {
+            if (pos == this->count) {
+                this->link = child;
+            } else {
+                std::memcpy(payload(pos), &child, sizeof(uint64_t));
+            }
+        }
+
+        /// Bytes between the slot array and the heap.
+        uint32_t free_space() const {
+            return this->dataOffset - sizeof(NodeHeader) - this->count * sizeof(Slot);
+        }
+
+        /// Bytes that are free once the heap is compacted.
+        uint32_t free_space_after_compaction() const {
+            return PageSize - sizeof(NodeHeader) - this->count * sizeof(Slot) - this->spaceUsed;
+        }
+
+        /// The bytes that a new entry with a key of `keyLength` takes.
+        uint32_t space_needed(uint32_t keyLength) const {
+            return keyLength - this->prefixLength + payload_size() + sizeof(Slot);
+        }
+
+        /// Makes room for a new entry, compacts the heap when only that
+        /// makes it fit.
+        /// @return             False when the node has to be split.
+        bool request_space(uint32_t keyLength) {
+            auto needed = space_needed(keyLength);
+            if (needed <= free_space()) return true;
+            if (needed > free_space_after_compaction()) return false;
+            compact();
+            return true;
+        }
+
+        /// Search a key with binary search. The key has to be in the range
+        /// of the fences, so it starts with the prefix of the node.
+        /// @param[in] key      The key that should be searched.
+        /// @param[out] found   Is the key at the returned position?
+        /// @return             The index of the first key that is not less
+        ///                     than `key`.
+        uint32_t lower_bound(string_view key, bool &found) const {
+            auto suffix = key.substr(this->prefixLength);
+            auto head = key_head(suffix);
+            uint32_t low = 0;
+            uint32_t high = this->count;
+            found = false;
+            while (low < high) {
+                uint32_t m = ((high - low) / 2) + low;
+                int cmp;
+                if (this->slots[m].head != head) {
+                    cmp = this->slots[m].head < head ? -1 : 1;
+                } else {
+                    cmp = compare_behind_head(key_suffix(m), suffix);
+                }
+                if (cmp < 0) {
+                    low = m + 1;
+                } else if (cmp > 0) {
+                    high = m;
+                } else {
+                    found = true;
+                    return m;
+                }
+            }
+            return low;
+        }
+
+        /// Inserts an entry, there has to be room for it.
+        /// @param[in] pos      The position of the new entry.
+        /// @param[in] key      The complete key.
+        /// @param[in] payload  The value or child, `payload_size()` bytes.
+        void insert_at(uint32_t pos, string_view key, const void *payload) {
+            std::memmove(this->slots + pos + 1, this->slots + pos, (this->count - pos) * sizeof(Slot));
+            store_entry(pos, key.substr(this->prefixLength), payload);
+            this->count++;
+        }
+
+        /// Overwrites the payload of an existing key or inserts the key at
+        /// its position, there has to be room for it.
+        void store(uint32_t pos, bool found, string_view key, const void *payload) {
+            if (found) {
+                std::memcpy(this->payload(pos), payload, payload_size());
+            } else {
+                insert_at(pos, key, payload);
+            }
+        }
+
+        /// Removes an entry, its bytes in the heap are reclaimed by the next
+        /// compaction.
+        void remove_at(uint32_t pos) {
+            this->spaceUsed -= this->slots[pos].keyLength + payload_size();
+            std::memmove(this->slots + pos, this->slots + pos + 1, (this->count - pos - 1) * sizeof(Slot));
+            this->count--;
+        }
+
+        /// Rewrites the heap without the gaps that removed and overwritten
+        /// entries left.
+        void compact() {
+            alignas(Node) std::byte buffer[PageSize];
+            auto compacted = new (buffer) Node(this->level, lower_fence(), upper_fence());
+            for (uint32_t i = 0; i < this->count; i++) {
+                compacted->store_entry(i, key_suffix(i), payload(i));
+            }
+            compacted->count = this->count;
+            compacted->link = this->link;
+            compacted->lsn = this->lsn;
+            compacted->mergeRetry = this->mergeRetry;
+            std::memcpy(static_cast<void*>(this), buffer, PageSize);
+        }
+
+    private:
+        /// Copies a key behind the prefix and its payload into the heap.
+        void store_entry(uint32_t pos, string_view suffix, const void *payload) {
+            uint32_t size = suffix.size() + payload_size();
+            this->dataOffset -= size;
+            this->spaceUsed += size;
+            if (!suffix.empty()) std::memcpy(ptr() + this->dataOffset, suffix.data(), suffix.size());
+            std::memcpy(ptr() + this->dataOffset + suffix.size(), payload, payload_size());
+            this->slots[pos] = Slot{static_cast<uint16_t>(this->dataOffset), static_cast<uint16_t>(suffix.size()),
+                                    key_head(suffix)};
+        }
+
+        Fence store_fence(string_view key) {
+            this->dataOffset -= key.size();
+            this->spaceUsed += key.size();
+            if (!key.empty()) std::memcpy(ptr() + this->dataOffset, key.data(), key.size());
+            return Fence{static_cast<uint16_t>(this->dataOffset), static_cast<uint16_t>(key.size())};
+        }
+    };
+
+    static_assert(sizeof(Node) == PageSize, "nodes have to fill their page");
+    static_assert(offsetof(NodeHeader, lsn) == 0, "the LSN has to start the page");
+
+    /// The largest payload of a node.
+    static constexpr size_t kMaxPayload = std::max(sizeof(ValueT), sizeof(uint64_t));
+
+    /// The most bytes an entry takes, a tenth of the usable page. A split
+    /// leaves both nodes at most about half full, which leaves room for the
+    /// new entry and the longer fences they may get.
+    static constexpr size_t kMaxEntrySize = Node::kSpace / 10;
+
+    static_assert(kMaxEntrySize >= sizeof(Slot) + kMaxPayload + 16, "pages are too small for useful keys");
+
+    /// The longest key that can be stored.
+    static constexpr size_t kMaxKeyLength = kMaxEntrySize - sizeof(Slot) - kMaxPayload;
+
+    /// A leaf whose entries take less than a quarter of its page is merged
+    /// with a sibling when both fit into one page.
+    static constexpr size_t kMinLeafUsed = PageSize / 4;
+
+    /// How many bytes an underflowing leaf that could not be merged has to
+    /// lose before its erases try to merge it again, see
+    /// `NodeHeader::mergeRetry`.
+    static constexpr size_t kMergeRetryStep = kMinLeafUsed / 4;
+
+    /// The first 4 bytes of a key as a big-endian integer, padded with zero
+    /// bytes. Different heads order two keys like their bytes.
+    static uint32_t key_head(string_view key) {
+        uint32_t head = 0;
+        for (size_t i = 0; i < 4; i++) {
+            head <<= 8;
+            if (i < key.size()) head |= static_cast<uint8_t>(key[i]);
+        }
+        return head;
+    }
+
+    /// Compares two keys with the same head. The bytes behind the head only
+    /// decide when both keys are longer than the head, otherwise the head
+    /// contains padding and the shorter key is the smaller one.
+    static int compare_behind_head(string_view a, string_view b) {
+        if (a.size() < 4 || b.size() < 4) {
+            return a.size() < b.size() ? -1 : (a.size() > b.size() ? 1 : 0);
+        }
+        return a.substr(4).compare(b.substr(4));
+    }
+
+    static uint16_t common_prefix(string_view a, string_view b) {
+        uint16_t length = 0;
+        auto limit = std::min(a.size(), b.size());
+        while (length < limit && a[length] == b[length]) length++;
+        return length;
+    }
+
+    /// The shortest separator `sep` with `left <= sep < right` for two
+    /// neighbouring keys `left < right` of a leaf: a prefix of `right` that
+    /// ends at its first byte that differs from `left`, or `left` itself.
+    static string_view shortest_separator(string_view left, string_view right) {
+        auto length = common_prefix(left, right) + 1u;
+        if (length < right.size() && length <= left.size()) return right.substr(0, length);
+        return left;
+    }
+
+    static constexpr uint64_t kMetadataMagic = 0x45455254535a42ull;  // "BZSTREE"
+
+    /// The pages of one level of the tree.
+    struct LevelStats {
+        uint64_t pages = 0;
+        /// Entries of all leaves or children of all inner nodes.
+        uint64_t entries = 0;
+        /// Number of pages by the bytes they use, bucket `i` counts the
+        /// pages that are filled to at least `i * 10` percent.
+        std::array<uint64_t, 10> fill_histogram{};
+    };
+
+    /// Types of the logged changes that are replayed by `redo()`. Splits log
+    /// whole pages instead. The payload is the length of the key as
+    /// `uint16_t`, the key and for inserts the value. The types start at 16,
+    /// those of `BTree` stay below, so both trees can share a log.
+    enum LogType : uint8_t {
+        kLogLeafInsert = 16,
+        kLogLeafErase,
+    };
+
+    /// Constructor. Opens the tree of the segment when its metadata page is
+    /// initialized, which only reads that page. Otherwise creates an empty
+    /// tree. A logged tree has to be recovered before it is opened.
+    /// @param[in] segment_id       The segment that holds the pages.
+    /// @param[in] buffer_manager   The buffer manager.
+    /// @param[in] log              Logs every change when given. Every
+    ///                             operation returns only when its change is
+    ///                             durable.
+    StringBTree(uint16_t segment_id, BufferManager &buffer_manager, WriteAheadLog* log = nullptr)
+        : TreeSegment<PageSize>(segment_id, buffer_manager, log, kMetadataMagic) {
+        /// a new tree starts with an empty leaf as root
+        if (!this->is_open()) {
+            this->create_root([](char *data) { new (data) Node(0, {}, {}); });
+        }
+    }
+
+    static Node* as_node(BufferFrame &page) {
+        return reinterpret_cast<Node*>(page.get_data());
+    }
+
+    /// Logs the insert or erase of a key in a leaf that is latched
+    /// exclusively.
+    /// @return             The LSN of the change, 0 when nothing is logged.
+    uint64_t log_key_change(uint64_t pageID, BufferFrame &page, LogType type, string_view key, const ValueT *value) {
+        if (!this->log) return 0;
+        char record[sizeof(uint16_t) + kMaxKeyLength + sizeof(ValueT)];
+        auto keyLength = static_cast<uint16_t>(key.size());
+        std::memcpy(record, &keyLength, sizeof(uint16_t));
+        std::memcpy(record + sizeof(uint16_t), key.data(), key.size());
+        uint32_t size = sizeof(uint16_t) + key.size();
+        if (value) {
+            std::memcpy(record + size, value, sizeof(ValueT));
+            size += sizeof(ValueT);
+        }
+        return this->log_change(pageID, page, type, record, size);
+    }
+
+    /// Replays a logged change on a page, see `WriteAheadLog::recover()`.
+    /// The page is in the state it was logged in, so an insert compacts the
+    /// heap exactly when it did before.
+    static void redo(char* page, uint8_t type, const char* payload, [[maybe_unused]] uint32_t size) {
+        // changes of other kinds of trees
+        if (type != kLogLeafInsert && type != kLogLeafErase) return;
+        auto leaf = reinterpret_cast<Node*>(page);
+        uint16_t keyLength;
+        std::memcpy(&keyLength, payload, sizeof(uint16_t));
+        string_view key(payload + sizeof(uint16_t), keyLength);
+        bool found;
+        auto pos = leaf->lower_bound(key, found);
+        switch (type) {
+            case kLogLeafInsert: {
+                if (!found) leaf->request_space(key.size());
+                leaf->store(pos, found, key, payload + sizeof(uint16_t) + keyLength);
+                break;
+            }
+            case kLogLeafErase: {
+                if (found) leaf->remove_at(pos);
+                break;
+            }
+        }
+    }
+
+    /// Visits every page of the tree and returns the pages and their fill per
+    /// level, the leaves are at index 0. The pages of a level are latched one
+    /// after another, so the result is only exact when no writer runs
+    /// concurrently.
+    vector<LevelStats> get_structure() {
+        std::shared_lock root_guard(this->root_latch);
+        vector<LevelStats> levels(this->levelTree + 1);
+        vector<uint64_t> pages{this->root};
+        root_guard.unlock();
+
+        for (auto level = levels.size(); level-- > 0 && !pages.empty();) {
+            vector<uint64_t> children;
+            for (auto pageID : pages) {
+                auto& page = this->buffer_manager.fix_page(pageID, false);
+                auto node = as_node(page);
+                auto& stats = levels[level];
+                stats.pages++;
+                stats.entries += node->count;
+                if (!node->is_leaf()) {
+                    for (uint32_t i = 0; i <= node->count; i++) children.push_back(node->child(i));
+                    stats.entries++;
+                }
+                auto used = sizeof(NodeHeader) + node->count * sizeof(Slot) + node->spaceUsed;
+                stats.fill_histogram[std::min<size_t>(9, used * 10 / PageSize)]++;
+                this->buffer_manager.unfix_page(page, false);
+            }
+            pages = std::move(children);
+        }
+        return levels;
+    }
+
+    /// Descends to the leaf that may contain a key with lock coupling.
+    /// @param[in] key          The key.
+    /// @param[in] exclusive    Latch the leaf exclusively? Inner nodes are
+    ///                         always latched shared.
+    /// @param[out] leafID      The page id of the leaf.
+    /// @return                 The latched leaf.
+    BufferFrame& fix_leaf(string_view key, bool exclusive, uint64_t &leafID) {
+        std::shared_lock root_guard(this->root_latch);
+        leafID = this->root;
+        auto* curr = &this->buffer_manager.fix_page(leafID, exclusive && this->levelTree == 0);
+        root_guard.unlock();
+        while (!as_node(*curr)->is_leaf()) {
+            auto node = as_node(*curr);
+            bool found;
+            leafID = node->child(node->lower_bound(key, found));
+            auto& child = this->buffer_manager.fix_page(leafID, exclusive && node->level == 1);
+            this->buffer_manager.unfix_page(*curr, false);
+            curr = &child;
+        }
+        return *curr;
+    }
+
+    /// Lookup an entry in the tree.
+    /// @param[in] key      The key that should be searched.
+    optional<ValueT> lookup(string_view key) {
+        uint64_t leafID;
+        auto& page = fix_leaf(key, false, leafID);
+        auto leaf = as_node(page);
+        optional<ValueT> result;
+        bool found;
+        auto pos = leaf->lower_bound(key, found);
+        if (found) result = leaf->value(pos);
+        this->buffer_manager.unfix_page(page, false);
+        return result;
+    }
+
+    /// Inserts a new entry into the tree, or overwrites the value of an
+    /// existing key. Most inserts latch the inner pages shared and only the
+    /// leaf exclusively, only a leaf that has to be split is latched again
+    /// with exclusive lock coupling.
+    /// @param[in] key      The key that should be inserted, at most
+    ///                     `kMaxKeyLength` bytes.
+    /// @param[in] value    The value that should be inserted.
+    void insert(string_view key, const ValueT &value) {
+        if (key.size() > kMaxKeyLength) {
+            throw std::invalid_argument("key is longer than kMaxKeyLength");
+        }
+        if (!insert_in_leaf(key, value)) {
+            insert_split(key, value);
+        }
+    }
+
+    /// Inserts into a leaf that has room for the entry.
+    /// @return             False when the leaf has to be split.
+    bool insert_in_leaf(string_view key, const ValueT &value) {
+        uint64_t leafID;
+        auto& page = fix_leaf(key, true, leafID);
+        auto leaf = as_node(page);
+        bool found;
+        auto pos = leaf->lower_bound(key, found);
+        if (!found && !leaf->request_space(key.size())) {
+            this->buffer_manager.unfix_page(page, false);
+            return false;
+        }
+        leaf->store(pos, found, key, &value);
+        auto lsn = this->log_key_change(leafID, page, kLogLeafInsert, key, &value);
+        this->buffer_manager.unfix_page(page, true);
+        this->commit(lsn);
+        return true;
+    }
+
+    /// Inserts with exclusive lock coupling and splits the leaf and the inner
+    /// nodes above it that overflow. Ancestors are released at an inner node
+    /// that has room for a separator of any length.
+    void insert_split(string_view key, const ValueT &value) {
+        std::unique_lock root_guard(this->root_latch);
+        vector<pair<uint64_t, BufferFrame*>> path;
+        uint64_t pageID = this->root;
+        auto* page = &this->buffer_manager.fix_page(pageID, true);
+        while (!as_node(*page)->is_leaf()) {
+            auto node = as_node(*page);
+            if (node->free_space_after_compaction() >= kMaxEntrySize) {
+                for (auto& entry : path) {
+                    this->buffer_manager.unfix_page(*entry.second, false);
+                }
+                path.clear();
+                if (root_guard.owns_lock()) root_guard.unlock();
+            }
+            path.emplace_back(pageID, page);
+            bool found;
+            pageID = node->child(node->lower_bound(key, found));
+            page = &this->buffer_manager.fix_page(pageID, true);
+        }
+
+        vector<pair<uint64_t, BufferFrame*>> modified{{pageID, page}};
+        optional<pair<uint64_t, uint16_t>> newRoot;
+        uint64_t lsn;
+        auto leaf = as_node(*page);
+        bool found;
+        auto pos = leaf->lower_bound(key, found);
+        if (found || leaf->request_space(key.size())) {
+            // another insert split the leaf in the meantime
+            leaf->store(pos, found, key, &value);
+            lsn = this->log_key_change(pageID, *page, kLogLeafInsert, key, &value);
+        } else {
+            // split the leaf, then insert the separators into the parents
+            // until one has room for it
+            auto rightID = this->allocate_page();
+            auto& rightPage = this->buffer_manager.fix_page(rightID, true);
+            modified.emplace_back(rightID, &rightPage);
+            string sep = split_node(leaf, pos, key, &value, rightID, as_node(rightPage));
+            uint64_t leftID = pageID;
+            uint16_t level = 0;
+            while (true) {
+                level++;
+                if (path.empty()) {
+                    auto newRootID = this->allocate_page();
+                    auto& rootPage = this->buffer_manager.fix_page(newRootID, true);
+                    auto rootNode = new (rootPage.get_data()) Node(level, {}, {});
+                    rootNode->insert_at(0, sep, &leftID);
+                    rootNode->link = rightID;
+                    modified.emplace_back(newRootID, &rootPage);
+                    newRoot = {newRootID, level};
+                    break;
+                }
+                auto [parentID, parentPage] = path.back();
+                path.pop_back();
+                modified.emplace_back(parentID, parentPage);
+                auto parent = as_node(*parentPage);
+                auto parentPos = parent->lower_bound(sep, found);
+                // the split node keeps its place for the left part
+                parent->set_child(parentPos, rightID);
+                if (parent->request_space(sep.size())) {
+                    parent->insert_at(parentPos, sep, &leftID);
+                    break;
+                }
+                auto addID = this->allocate_page();
+                auto& addPage = this->buffer_manager.fix_page(addID, true);
+                modified.emplace_back(addID, &addPage);
+                sep = split_node(parent, parentPos, sep, &leftID, addID, as_node(addPage));
+                leftID = parentID;
+                rightID = addID;
+            }
+            lsn = this->log_structure(modified, {}, newRoot);
+        }
+
+        for (auto& entry : path) {
+            this->buffer_manager.unfix_page(*entry.second, false);
+        }
+        for (auto& entry : modified) {
+            this->buffer_manager.unfix_page(*entry.second, true);
+        }
+        if (root_guard.owns_lock()) root_guard.unlock();
+        this->commit(lsn);
+    }
+
+    /// An entry of a node that is split, with its complete key.
+    struct SplitEntry {
+        string key;
+        std::array<uint8_t, kMaxPayload> payload;
+    };
+
+    /// The bytes that a node with the given fences and entries uses.
+    static size_t node_size(const vector<SplitEntry> &entries, size_t begin, size_t end,
+                            string_view lower, string_view upper, size_t payloadSize) {
+        size_t prefixLength = common_prefix(lower, upper);
+        size_t size = sizeof(NodeHeader) + lower.size() + upper.size();
+        for (auto i = begin; i < end; i++) {
+            size += entries[i].key.size() - prefixLength + payloadSize + sizeof(Slot);
+        }
+        return size;
+    }
+
+    /// Split a node that has no room for a new entry. The node keeps the
+    /// smaller keys, the other ones move to a new page.
+    /// The split point is chosen near the middle of the bytes of the entries
+    /// to get the shortest separator, since separators are stored in the
+    /// parent and become the fences of both nodes. A leaf separator is cut
+    /// to the shortest key between both neighbours, an inner node pushes the
+    /// shortest of its keys up. A key beyond all keys of the rightmost leaf
+    /// starts a new leaf, which leaves the full leaf behind for ascending
+    /// inserts.
+    /// @param[in] node     The full node, latched exclusively.
+    /// @param[in] pos      The position of the new entry.
+    /// @param[in] key      The key of the new entry.
+    /// @param[in] payload  The payload of the new entry.
+    /// @param[in] addID    The page id of the new page.
+    /// @param[out] addNode The buffer of the new page.
+    /// @return             The separator between both nodes.
+    string split_node(Node *node, uint32_t pos, string_view key, const void *payload, uint64_t addID, Node *addNode) {
+        bool leaf = node->is_leaf();
+        auto payloadSize = node->payload_size();
+        vector<SplitEntry> entries(node->count + 1);
+        for (uint32_t i = 0, j = 0; i < entries.size(); i++) {
+            if (i == pos) {
+                entries[i].key = key;
+                std::memcpy(entries[i].payload.data(), payload, payloadSize);
+            } else {
+                entries[i].key = node->full_key(j);
+                std::memcpy(entries[i].payload.data(), node->payload(j), payloadSize);
+                j++;
+            }
+        }
+        string lower(node->lower_fence());
+        string upper(node->upper_fence());
+        auto level = node->level;
+        auto link = node->link;
+        auto lsn = node->lsn;
+
+        // candidates keep at least one key in both nodes, inner nodes also
+        // need one key to push up
+        size_t n = entries.size();
+        size_t first = 1;
+        size_t last = leaf ? n - 1 : n - 2;
+        auto separator = [&](size_t middle) -> string_view {
+            if (leaf) return shortest_separator(entries[middle - 1].key, entries[middle].key);
+            return entries[middle].key;
+        };
+        auto fits = [&](size_t middle) {
+            auto sep = separator(middle);
+            return node_size(entries, 0, middle, lower, sep, payloadSize) <= PageSize &&
+                   node_size(entries, leaf ? middle : middle + 1, n, sep, upper, payloadSize) <= PageSize;
+        };
+
+        size_t middle = first;
+        if (leaf && link == INVALID_PAGE_ID && pos == n - 1 && fits(n - 1)) {
+            middle = n - 1;
+        } else {
+            size_t total = node_size(entries, 0, n, {}, {}, payloadSize);
+            size_t half = sizeof(NodeHeader);
+            size_t center = first;
+            while (center < last && half < total / 2) {
+                half += entries[center - 1].key.size() + payloadSize + sizeof(Slot);
+                center++;
+            }
+            size_t window = n / 16;
+            size_t best = 0;
+            for (auto i = center > first + window ? center - window : first; i <= std::min(last, center + window); i++) {
+                if (!fits(i)) continue;
+                auto length = separator(i).size();
+                auto distance = i > center ? i - center : center - i;
+                auto bestDistance = best > center ? best - center : center - best;
+                if (best == 0 || length < separator(best).size() ||
+                    (length == separator(best).size() && distance < bestDistance)) {
+                    best = i;
+                }
+            }
+            if (best == 0) throw std::logic_error("no split point fits into the pages");
+            middle = best;
+        }
+
+        string sep(separator(middle));
+        auto left = new (node) Node(level, lower, sep);
+        auto right = new (addNode) Node(level, sep, upper);
+        left->lsn = lsn;
+        for (size_t i = 0; i < middle; i++) {
+            left->insert_at(left->count, entries[i].key, entries[i].payload.data());
+        }
+        for (auto i = leaf ? middle : middle + 1; i < n; i++) {
+            right->insert_at(right->count, entries[i].key, entries[i].payload.data());
+        }
+        if (leaf) {
+            left->link = addID;
+            right->link = link;
+        } else {
+            std::memcpy(&left->link, entries[middle].payload.data(), sizeof(uint64_t));
+            right->link = link;
+        }
+        return sep;
+    }
+
+    /// Erase an entry in the tree. Most erases latch the inner pages shared
+    /// and only the leaf exclusively. Only when the leaf would underflow the
+    /// erase is repeated with exclusive lock coupling, so the leaf can be
+    /// merged with a sibling. Once that found no sibling to merge with, the
+    /// leaf stays underfull and only tries again after it lost another
+    /// `kMergeRetryStep` bytes or its last entry.
+    /// @param[in] key      The key that should be searched.
+    void erase(string_view key) {
+        if (key.size() > kMaxKeyLength) return;
+        uint64_t leafID;
+        auto& page = fix_leaf(key, true, leafID);
+        auto leaf = as_node(page);
+        bool found;
+        auto pos = leaf->lower_bound(key, found);
+        uint32_t after = found ? leaf_used(leaf) - entry_size(leaf, pos) : 0;
+        if (found && after < kMinLeafUsed &&
+            (leaf->mergeRetry == 0 || after < leaf->mergeRetry || leaf->count == 1)) {
+            this->buffer_manager.unfix_page(page, false);
+            erase_merge(key);
+            return;
+        }
+        uint64_t lsn = 0;
+        if (found) {
+            leaf->remove_at(pos);
+            lsn = this->log_key_change(leafID, page, kLogLeafErase, key, nullptr);
+        }
+        this->buffer_manager.unfix_page(page, found);
+        this->commit(lsn);
+    }
+
+    /// The bytes of the page that a node uses once its heap is compacted.
+    static uint32_t leaf_used(const Node *node) {
+        return PageSize - node->free_space_after_compaction();
+    }
+
+    /// The bytes that the entry at a position takes.
+    static uint32_t entry_size(const Node *node, uint32_t pos) {
+        return node->slots[pos].keyLength + node->payload_size() + sizeof(Slot);
+    }
+
+    /// Erases an entry and merges its leaf with a sibling when the leaf
+    /// underflows and both fit into one page. The merged leaf replaces both
+    /// in their parent, which loses the separator between them, and the
+    /// right leaf is freed. Inner nodes are not merged, but a root that is
+    /// left with a single child is replaced by it.
+    /// Only the parent of the leaf changes, so pages are latched exclusively
+    /// from the root and every page above the parent is released.
+    /// @param[in] key      The key that should be erased.
+    void erase_merge(string_view key) {
+        std::unique_lock root_guard(this->root_latch);
+        uint64_t parentID = INVALID_PAGE_ID;
+        BufferFrame* parentPage = nullptr;
+        uint64_t pageID = this->root;
+        auto* page = &this->buffer_manager.fix_page(pageID, true);
+        while (!as_node(*page)->is_leaf()) {
+            auto node = as_node(*page);
+            // the root changes only when the parent is the root and loses its last separator
+            if (node->level > 1 || node->count > 1) {
+                if (root_guard.owns_lock()) root_guard.unlock();
+            }
+            if (parentPage) this->buffer_manager.unfix_page(*parentPage, false);
+            parentID = pageID;
+            parentPage = page;
+            bool found;
+            pageID = node->child(node->lower_bound(key, found));
+            page = &this->buffer_manager.fix_page(pageID, true);
+        }
+
+        auto leaf = as_node(*page);
+        bool found;
+        auto pos = leaf->lower_bound(key, found);
+        if (!found) {
+            this->buffer_manager.unfix_page(*page, false);
+            if (parentPage) this->buffer_manager.unfix_page(*parentPage, false);
+            return;
+        }
+        leaf->remove_at(pos);
+
+        vector<pair<uint64_t, BufferFrame*>> modified{{pageID, page}};
+        vector<pair<uint64_t, BufferFrame*>> freed;
+        optional<pair<uint64_t, uint16_t>> newRoot;
+        auto parent = parentPage ? as_node(*parentPage) : nullptr;
+        if (parent && parent->count > 0 && leaf_used(leaf) < kMinLeafUsed) {
+            // merge with the right sibling, the last child with the left one
+            uint32_t idx = parent->lower_bound(key, found);
+            uint32_t leftIdx = idx < parent->count ? idx : idx - 1;
+            uint64_t siblingID = parent->child(idx < parent->count ? idx + 1 : idx - 1);
+            auto& siblingPage = this->buffer_manager.fix_page(siblingID, true);
+            uint64_t leftID = leftIdx == idx ? pageID : siblingID;
+            uint64_t rightID = leftIdx == idx ? siblingID : pageID;
+            BufferFrame* leftPage = leftIdx == idx ? page : &siblingPage;
+            BufferFrame* rightPage = leftIdx == idx ? &siblingPage : page;
+            if (merge_leaves(as_node(*leftPage), as_node(*rightPage))) {
+                parent->set_child(leftIdx + 1, leftID);
+                parent->remove_at(leftIdx);
+                modified = {{leftID, leftPage}, {parentID, parentPage}};
+                freed.emplace_back(rightID, rightPage);
+                if (root_guard.owns_lock() && parent->count == 0) {
+                    newRoot.emplace(leftID, parent->level - 1);
+                    modified.pop_back();
+                    freed.emplace_back(parentID, parentPage);
+                }
+                parentPage = nullptr;
+            } else {
+                this->buffer_manager.unfix_page(siblingPage, false);
+            }
+        }
+        if (freed.empty() && leaf_used(leaf) < kMinLeafUsed) {
+            // the leaf stays underfull, its next erases keep to the shared path
+            auto used = leaf_used(leaf);
+            leaf->mergeRetry = static_cast<uint16_t>(used > kMergeRetryStep ? used - kMergeRetryStep : 1);
+        }
+
+        uint64_t lsn = freed.empty()
+            ? this->log_key_change(pageID, *page, kLogLeafErase, key, nullptr)
+            : this->log_structure(modified, freed, newRoot);
+        for (auto& entry : modified) {
+            this->buffer_manager.unfix_page(*entry.second, true);
+        }
+        if (parentPage) this->buffer_manager.unfix_page(*parentPage, false);
+        if (root_guard.owns_lock()) root_guard.unlock();
+        this->commit(lsn);
+    }
+
+    /// Moves all entries of a leaf into its left sibling, which takes over
+    /// its upper fence and sibling link. The merged leaf may share a shorter
+    /// prefix than both leaves, so it is only merged when it fits.
+    /// @return             False when both do not fit into one page, then
+    ///                     nothing is changed.
+    static bool merge_leaves(Node *left, Node *right) {
+        vector<SplitEntry> entries(left->count + right->count);
+        for (uint32_t i = 0; i < entries.size(); i++) {
+            auto node = i < left->count ? left : right;
+            uint32_t pos = i < left->count ? i : i - left->count;
+            entries[i].key = node->full_key(pos);
+            std::memcpy(entries[i].payload.data(), node->payload(pos), sizeof(ValueT));
+        }
+        string lower(left->lower_fence());
+        string upper(right->upper_fence());
+        if (node_size(entries, 0, entries.size(), lower, upper, sizeof(ValueT)) > PageSize) return false;
+        auto link = right->link;
+        auto lsn = left->lsn;
+        auto merged = new (left) Node(0, lower, upper);
+        merged->lsn = lsn;
+        for (auto& entry : entries) {
+            merged->insert_at(merged->count, entry.key, entry.payload.data());
+        }
+        merged->link = link;
+        return true;
+    }
+
+    /// Iterator over the entries of a key range in ascending key order.
+    /// The qualifying entries of one leaf are copied at once, so no latch is
+    /// held between calls and the tree may be modified while iterating. The
+    /// iterator follows the sibling links of the leaves and only descends
+    /// from the root again when the leaf it came from was modified in the
+    /// meantime, because then its link may be outdated.
+    class Iterator {
+        friend struct StringBTree;
+
+        StringBTree &tree;
+
+        /// The inclusive bounds of the range.
+        string lower;
+        string upper;
+
+        /// Entries of the current leaf.
+        vector<pair<string, ValueT>> entries;
+        size_t position = 0;
+
+        /// The last key that was copied from a leaf.
+        optional<string> last;
+
+        /// The current leaf and the frame it was copied from.
+        typename TreeSegment<PageSize>::LeafCursor cursor;
+
+        /// Is there nothing left to copy?
+        bool done = false;
+
+        Iterator(StringBTree &tree, string_view lower, string_view upper)
+            : tree(tree), lower(lower), upper(upper) {
+            if (upper < lower) {
+                done = true;
+            } else {
+                descend(this->lower);
+            }
+        }
+
+        /// Copies the entries of a leaf that follow `last` up to `upper`.
+        /// @param[in] bound    The key the leaf was searched for, nothing
+        ///                     when it was reached through a sibling link and
+        ///                     all its keys follow `last`.
+        void copy(Node *leafNow, const string *bound) {
+            uint32_t pos = 0;
+            if (bound) {
+                bool found;
+                pos = leafNow->lower_bound(*bound, found);
+                if (found && last) pos++;
+            }
+            for (; pos < leafNow->count; pos++) {
+                auto key = leafNow->full_key(pos);
+                if (upper < key) {
+                    done = true;
+                    break;
+                }
+                entries.emplace_back(key, leafNow->value(pos));
+                last = std::move(key);
+            }
+        }
+
+        /// Descends to the leaf that contains `key` and copies its entries.
+        void descend(const string &key) {
+            auto& curr = tree.fix_leaf(key, false, cursor.leafID);
+            read(curr, &key);
+        }
+
+        /// Copies the entries of a leaf that is latched shared and unfixes it.
+        void read(BufferFrame &curr, const string *bound) {
+            auto leafNow = as_node(curr);
+            copy(leafNow, bound);
+            if (leafNow->link == INVALID_PAGE_ID) done = true;
+            cursor.leave(tree.buffer_manager, curr);
+        }
+
+        /// Moves to the right sibling of the current leaf.
+        void next_leaf() {
+            auto next = [](const char *data) { return reinterpret_cast<const Node*>(data)->link; };
+            if (auto* sibling = cursor.fix_next(tree.buffer_manager, next)) {
+                read(*sibling, nullptr);
+            } else {
+                descend(last ? *last : lower);
+            }
+        }
+
+    public:
+        /// Returns the next entry of the range, or nothing at its end.
+        optional<pair<string, ValueT>> next() {
+            while (position == entries.size()) {
+                if (done) return nullopt;
+                entries.clear();
+                position = 0;
+                next_leaf();
+            }
+            return entries[position++];
+        }
+    };
+
+    /// Returns an iterator over all entries with `lower <= key <= upper` in
+    /// ascending key order.
+    /// @param[in] lower    The smallest key of the range.
+    /// @param[in] upper    The largest key of the range.
+    Iterator scan(string_view lower, string_view upper) {
+        return Iterator(*this, lower, upper);
+    }
+};
+
+}
@@ -0,0 +1,1136 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <limits>
+#include <map>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "buffer/buffer_manager.h"
+#include "index/btree.h"
+#include "log/wal.h"
+
+using namespace buzzdb;
+
+namespace {
+
+using Tree = BTree<uint64_t, uint64_t, std::less<uint64_t>, 1024>;
+
+/// Compares all entries of the tree with the expected ones, by a scan over
+/// all keys and a lookup of every key.
+void check_tree(Tree &tree, const std::map<uint64_t, uint64_t> &expected) {
+    std::map<uint64_t, uint64_t> found;
+    auto it = tree.scan(0, std::numeric_limits<uint64_t>::max());
+    while (auto entry = it.next()) {
+        ASSERT_TRUE(found.empty() || found.rbegin()->first < entry->first);
+        found.insert(*entry);
+    }
+    ASSERT_EQ(found, expected);
+    for (auto& [key, value] : expected) {
+        ASSERT_EQ(tree.lookup(key), value) << "key " << key;
+    }
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, ConcurrentReadersAndWriters) {
+    std::remove("0");
+    // the pool is much smaller than the tree, so pages are evicted while
+    // they are latched by other threads
+    BufferManager buffer_manager(1024, 100);
+    Tree tree(0, buffer_manager);
+    std::map<uint64_t, uint64_t> expected;
+    // every tenth key is there from the start
+    for (uint64_t key = 0; key < 40000; key += 10) {
+        tree.insert(key, key);
+        expected[key] = key;
+    }
+
+    std::atomic<bool> done = false;
+    std::atomic<uint64_t> misses = 0;
+    std::vector<std::thread> readers;
+    for (uint64_t thread = 0; thread < 2; ++thread) {
+        readers.emplace_back([&, thread] {
+            std::mt19937_64 random(thread);
+            while (!done) {
+                uint64_t key = random() % 4000 * 10;
+                if (tree.lookup_latched(key) != key) misses++;
+            }
+        });
+    }
+    std::vector<std::thread> writers;
+    for (uint64_t thread = 0; thread < 4; ++thread) {
+        writers.emplace_back([&, thread] {
+            for (uint64_t key = thread + 1; key < 40000; key += 4) {
+                if (key % 10 != 0) tree.insert(key, key * 2);
+            }
+            // the odd keys that are not there from the start go again
+            for (uint64_t key = thread + 1; key < 40000; key += 4) {
+                if (key % 10 != 0 && key % 2 == 1) tree.erase(key);
+            }
+        });
+    }
+    for (auto& thread : writers) thread.join();
+    done = true;
+    for (auto& thread : readers) thread.join();
+
+    EXPECT_EQ(misses, 0u);
+    for (uint64_t key = 1; key < 40000; ++key) {
+        if (key % 10 != 0 && key % 2 == 0) expected[key] = key * 2;
+    }
+    check_tree(tree, expected);
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, OptimisticLookupsDuringSplits) {
+    std::remove("0");
+    BufferManager buffer_manager(1024, 200);
+    Tree tree(0, buffer_manager);
+    // few keys, so the root is split while the readers run
+    for (uint64_t key = 0; key < 100; ++key) tree.insert(key * 1000, key);
+
+    std::atomic<bool> done = false;
+    std::atomic<uint64_t> wrong = 0;
+    std::vector<std::thread> readers;
+    for (uint64_t thread = 0; thread < 3; ++thread) {
+        readers.emplace_back([&, thread] {
+            std::mt19937_64 random(thread);
+            while (!done) {
+                uint64_t key = random() % 100;
+                if (tree.lookup(key * 1000) != key) wrong++;
+                // keys between the first ones are found with their value or
+                // not at all
+                uint64_t other = random() % 100000;
+                auto value = tree.lookup(other);
+                if (other % 1000 != 0 && value && *value != other) wrong++;
+            }
+        });
+    }
+    std::vector<std::thread> writers;
+    for (uint64_t thread = 0; thread < 2; ++thread) {
+        writers.emplace_back([&, thread] {
+            std::mt19937_64 random(thread + 10);
+            for (int i = 0; i < 30000; ++i) {
+                uint64_t key = random() % 100000;
+                if (key % 1000 != 0) tree.insert(key, key);
+            }
+        });
+    }
+    for (auto& thread : writers) thread.join();
+    done = true;
+    for (auto& thread : readers) thread.join();
+    EXPECT_EQ(wrong, 0u);
+    EXPECT_GT(tree.get_stats().height, 2u);
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, ScanBounds) {
+    std::remove("0");
+    BufferManager buffer_manager(1024, 100);
+    Tree tree(0, buffer_manager);
+    for (uint64_t key = 10; key <= 10000; key += 10) tree.insert(key, key + 1);
+
+    std::vector<uint64_t> keys;
+    auto it = tree.scan(995, 2000);
+    while (auto entry = it.next()) {
+        EXPECT_EQ(entry->second, entry->first + 1);
+        keys.push_back(entry->first);
+    }
+    ASSERT_EQ(keys.size(), 101u);
+    EXPECT_EQ(keys.front(), 1000u);
+    EXPECT_EQ(keys.back(), 2000u);
+
+    keys.clear();
+    auto reverse = tree.scan_reverse(995, 2000);
+    while (auto entry = reverse.next()) keys.push_back(entry->first);
+    ASSERT_EQ(keys.size(), 101u);
+    EXPECT_EQ(keys.front(), 2000u);
+    EXPECT_EQ(keys.back(), 1000u);
+
+    EXPECT_FALSE(tree.scan(2000, 1000).next());
+    EXPECT_FALSE(tree.scan_reverse(2000, 1000).next());
+    EXPECT_FALSE(tree.scan(10001, 20000).next());
+    EXPECT_FALSE(tree.scan_reverse(0, 9).next());
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, ScanWhileModified) {
+    std::remove("0");
+    BufferManager buffer_manager(1024, 200);
+    Tree tree(0, buffer_manager);
+    // the multiples of 10 stay, all other keys come and go
+    for (uint64_t key = 0; key < 50000; key += 10) tree.insert(key, key);
+
+    std::atomic<bool> done = false;
+    std::vector<std::thread> writers;
+    for (uint64_t thread = 0; thread < 2; ++thread) {
+        writers.emplace_back([&, thread] {
+            std::mt19937_64 random(thread);
+            while (!done) {
+                uint64_t key = random() % 50000;
+                if (key % 10 == 0) continue;
+                if (random() % 2) {
+                    tree.insert(key, key);
+                } else {
+                    tree.erase(key);
+                }
+            }
+        });
+    }
+    for (int round = 0; round < 10; ++round) {
+        // every entry is returned once in order, the stable ones all
+        uint64_t lower = round * 1000;
+        uint64_t upper = 50000 - round * 1000;
+        uint64_t expectedStable = std::min<uint64_t>(upper, 49990) / 10 - lower / 10 + 1;
+        int64_t previous = -1;
+        uint64_t stable = 0;
+        auto it = tree.scan(lower, upper);
+        while (auto entry = it.next()) {
+            ASSERT_EQ(entry->first, entry->second);
+            ASSERT_TRUE(entry->first >= lower && entry->first <= upper);
+            ASSERT_LT(previous, static_cast<int64_t>(entry->first));
+            previous = entry->first;
+            stable += entry->first % 10 == 0;
+        }
+        EXPECT_EQ(stable, expectedStable);
+
+        previous = std::numeric_limits<int64_t>::max();
+        stable = 0;
+        auto reverse = tree.scan_reverse(lower, upper);
+        while (auto entry = reverse.next()) {
+            ASSERT_EQ(entry->first, entry->second);
+            ASSERT_TRUE(entry->first >= lower && entry->first <= upper);
+            ASSERT_GT(previous, static_cast<int64_t>(entry->first));
+            previous = entry->first;
+            stable += entry->first % 10 == 0;
+        }
+        EXPECT_EQ(stable, expectedStable);
+    }
+    done = true;
+    for (auto& thread : writers) thread.join();
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, LeafInsertInPlace) {
+    alignas(Tree::LeafNode) std::byte buffer[1024];
+    auto leaf = new (buffer) Tree::LeafNode();
+    std::map<uint64_t, uint64_t> expected;
+    std::mt19937_64 random(3);
+    while (expected.size() < Tree::LeafNode::kCapacity) {
+        uint64_t key = random() % 1000;
+        uint64_t value = random();
+        // a key that is there already gets the new value
+        leaf->insert(key, value);
+        expected[key] = value;
+        ASSERT_EQ(leaf->count, expected.size());
+    }
+    uint32_t pos = 0;
+    for (auto& [key, value] : expected) {
+        ASSERT_EQ(leaf->keys[pos], key);
+        ASSERT_EQ(leaf->values[pos], value);
+        pos++;
+    }
+    leaf->erase(0);
+    leaf->erase(leaf->count - 1);
+    expected.erase(expected.begin());
+    expected.erase(std::prev(expected.end()));
+    pos = 0;
+    for (auto& [key, value] : expected) {
+        ASSERT_EQ(leaf->keys[pos], key);
+        ASSERT_EQ(leaf->values[pos], value);
+        pos++;
+    }
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, InnerInsertInPlace) {
+    alignas(Tree::InnerNode) std::byte buffer[1024];
+    auto inner = new (buffer) Tree::InnerNode();
+    inner->level = 1;
+    inner->children[0] = 1000;
+    inner->count = 1;
+    // every separator brings the child right of it
+    std::map<uint64_t, uint64_t> expected;
+    std::mt19937_64 random(4);
+    while (inner->count < Tree::InnerNode::kCapacity + 1) {
+        uint64_t key = random() % 100000;
+        if (expected.count(key)) continue;
+        inner->insert(key, key + 1);
+        expected[key] = key + 1;
+    }
+    ASSERT_EQ(inner->children[0], 1000u);
+    uint32_t pos = 0;
+    for (auto& [key, child] : expected) {
+        ASSERT_EQ(inner->keys[pos], key);
+        ASSERT_EQ(inner->children[pos + 1], child);
+        pos++;
+    }
+    // a key is erased with the child right of it
+    auto second = std::next(expected.begin());
+    inner->erase(1);
+    expected.erase(second);
+    pos = 0;
+    for (auto& [key, child] : expected) {
+        ASSERT_EQ(inner->keys[pos], key);
+        ASSERT_EQ(inner->children[pos + 1], child);
+        pos++;
+    }
+}
+
+/// Checks a search policy against `std::lower_bound` on sorted keys of all
+/// counts up to a few cache lines, including duplicates and the extremes of
+/// the key type.
+template<typename Policy, typename KeyT, typename ComparatorT = std::less<KeyT>>
+void check_search(const std::vector<KeyT> &values) {
+    std::mt19937_64 random(5);
+    for (uint32_t count = 0; count < 160; ++count) {
+        std::vector<KeyT> keys;
+        for (uint32_t i = 0; i < count; ++i) keys.push_back(values[random() % values.size()]);
+        std::sort(keys.begin(), keys.end(), ComparatorT());
+        for (auto& key : values) {
+            uint32_t expected = std::lower_bound(keys.begin(), keys.end(), key, ComparatorT()) - keys.begin();
+            ASSERT_EQ((Policy::template lower_bound<KeyT, ComparatorT>(keys.data(), count, key)), expected)
+                << "count " << count;
+        }
+    }
+}
+
+/// Keys of an arithmetic type from its minimum to its maximum.
+template<typename KeyT>
+std::vector<KeyT> arithmetic_keys() {
+    std::vector<KeyT> keys{std::numeric_limits<KeyT>::lowest(), std::numeric_limits<KeyT>::max(), KeyT(0), KeyT(1)};
+    if constexpr (std::is_signed_v<KeyT>) keys.push_back(KeyT(-1));
+    std::mt19937_64 random(6);
+    for (int i = 0; i < 200; ++i) {
+        if constexpr (std::is_floating_point_v<KeyT>) {
+            keys.push_back(static_cast<KeyT>(std::uniform_real_distribution<double>(-1e6, 1e6)(random)));
+        } else {
+            keys.push_back(static_cast<KeyT>(random()));
+            keys.push_back(static_cast<KeyT>(random() % 64));
+        }
+    }
+    return keys;
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, SimdSearchArithmeticKeys) {
+    check_search<SimdSearch, uint64_t>(arithmetic_keys<uint64_t>());
+    check_search<SimdSearch, int64_t>(arithmetic_keys<int64_t>());
+    check_search<SimdSearch, uint32_t>(arithmetic_keys<uint32_t>());
+    check_search<SimdSearch, int32_t>(arithmetic_keys<int32_t>());
+    check_search<SimdSearch, uint16_t>(arithmetic_keys<uint16_t>());
+    check_search<SimdSearch, int8_t>(arithmetic_keys<int8_t>());
+    check_search<SimdSearch, double>(arithmetic_keys<double>());
+    check_search<SimdSearch, float>(arithmetic_keys<float>());
+}
+
+/// Checks that every node below the root holds at least the minimum number
+/// of entries, i.e. lies in the third fill bucket or above.
+void check_min_fill(Tree &tree) {
+    auto levels = tree.get_structure();
+    for (size_t level = 0; level + 1 < levels.size(); ++level) {
+        ASSERT_EQ(levels[level].fill_histogram[0], 0u) << "level " << level;
+        ASSERT_EQ(levels[level].fill_histogram[1], 0u) << "level " << level;
+    }
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, EraseMergesAndBorrows) {
+    std::remove("0");
+    BufferManager buffer_manager(1024, 100);
+    Tree tree(0, buffer_manager);
+    std::map<uint64_t, uint64_t> expected;
+    std::vector<uint64_t> keys;
+    for (uint64_t key = 0; key < 20000; ++key) {
+        tree.insert(key, key + 1);
+        expected[key] = key + 1;
+        keys.push_back(key);
+    }
+    ASSERT_GE(tree.get_stats().height, 3u);
+
+    // random erases leave underfull nodes everywhere, they are merged with
+    // or borrow from their siblings
+    std::mt19937_64 random(8);
+    std::shuffle(keys.begin(), keys.end(), random);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        tree.erase(keys[i]);
+        expected.erase(keys[i]);
+        if (i % 2500 == 0) {
+            check_tree(tree, expected);
+            check_min_fill(tree);
+        }
+        ASSERT_FALSE(tree.lookup(keys[i]));
+    }
+    auto stats = tree.get_stats();
+    ASSERT_EQ(stats.erases, keys.size());
+    ASSERT_GT(stats.leaf_merges, 0u);
+    ASSERT_GT(stats.inner_merges, 0u);
+
+    // the root collapsed level by level down to an empty leaf
+    ASSERT_EQ(stats.height, 1u);
+    check_tree(tree, expected);
+    // erasing a missing key changes nothing
+    tree.erase(5);
+    tree.insert(5, 6);
+    ASSERT_EQ(tree.lookup(5), 6u);
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, Stats) {
+    std::remove("0");
+    BufferManager buffer_manager(1024, 100);
+    Tree tree(0, buffer_manager);
+    auto stats = tree.get_stats();
+    EXPECT_EQ(stats.height, 1u);
+    EXPECT_EQ(stats.inserts + stats.lookups + stats.leaf_splits, 0u);
+
+    for (uint64_t key = 0; key < 10000; ++key) tree.insert(key, key);
+    for (uint64_t key = 0; key < 500; ++key) tree.lookup(key * 7);
+    tree.upsert(3, [](uint64_t &value) { value++; });
+    tree.insert_if_absent(10001, 1);
+    tree.update_if_present(10002, [](uint64_t &value) { value++; });
+    for (uint64_t key = 0; key < 10000; key += 2) tree.erase(key);
+
+    stats = tree.get_stats();
+    EXPECT_EQ(stats.inserts, 10000u);
+    EXPECT_EQ(stats.lookups, 500u);
+    EXPECT_EQ(stats.updates, 3u);
+    EXPECT_EQ(stats.erases, 5000u);
+    // a split adds one page to its level, a merge removes one
+    auto levels = tree.get_structure();
+    EXPECT_EQ(levels.size(), stats.height);
+    EXPECT_EQ(levels[0].pages, 1 + stats.leaf_splits - stats.leaf_merges);
+    EXPECT_GT(stats.leaf_splits, 0u);
+    EXPECT_GT(stats.inner_splits, 0u);
+    EXPECT_EQ(levels[0].entries, 5001u);
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, ReopenFromMetadata) {
+    std::remove("0");
+    std::map<uint64_t, uint64_t> expected;
+    uint64_t height, nextID, freeHead;
+    {
+        BufferManager buffer_manager(1024, 100);
+        Tree tree(0, buffer_manager);
+        for (uint64_t key = 0; key < 20000; ++key) {
+            tree.insert(key, key + 1);
+            expected[key] = key + 1;
+        }
+        // merges leave pages in the free list
+        for (uint64_t key = 5000; key < 15000; ++key) {
+            tree.erase(key);
+            expected.erase(key);
+        }
+        height = tree.get_stats().height;
+        nextID = tree.nextID;
+        freeHead = tree.freeHead;
+        ASSERT_NE(freeHead, INVALID_PAGE_ID);
+    }
+    // the buffer manager wrote all pages back, the tree opens from its
+    // metadata page without creating a new root
+    BufferManager buffer_manager(1024, 100);
+    Tree tree(0, buffer_manager);
+    ASSERT_EQ(tree.get_stats().height, height);
+    ASSERT_EQ(tree.nextID, nextID);
+    ASSERT_EQ(tree.freeHead, freeHead);
+    check_tree(tree, expected);
+
+    // new pages come from the free list first and overwrite no node
+    for (uint64_t key = 5000; key < 15000; ++key) {
+        tree.insert(key, key + 2);
+        expected[key] = key + 2;
+    }
+    ASSERT_EQ(tree.freeHead, INVALID_PAGE_ID);
+    check_tree(tree, expected);
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, ConcurrentChurnReusesFreedPages) {
+    std::remove("0");
+    BufferManager buffer_manager(1024, 200);
+    Tree tree(0, buffer_manager);
+    // every thread fills its own range and empties it again, the merges of
+    // one thread free the pages that the splits of the others take
+    constexpr uint64_t kThreads = 4;
+    constexpr uint64_t kKeys = 4000;
+    std::vector<std::thread> threads;
+    for (uint64_t thread = 0; thread < kThreads; ++thread) {
+        threads.emplace_back([&, thread] {
+            std::mt19937_64 random(thread);
+            std::vector<uint64_t> keys;
+            for (uint64_t key = 0; key < kKeys; ++key) keys.push_back(key * kThreads + thread);
+            for (int round = 0; round < 10; ++round) {
+                std::shuffle(keys.begin(), keys.end(), random);
+                for (auto key : keys) tree.insert(key, key + round);
+                std::shuffle(keys.begin(), keys.end(), random);
+                // the last round keeps the first half of the keys
+                for (size_t i = round == 9 ? keys.size() / 2 : 0; i < keys.size(); ++i) tree.erase(keys[i]);
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+
+    std::map<uint64_t, uint64_t> expected;
+    auto it = tree.scan(0, std::numeric_limits<uint64_t>::max());
+    while (auto entry = it.next()) {
+        ASSERT_EQ(entry->second, entry->first + 9);
+        expected.insert(*entry);
+    }
+    ASSERT_EQ(expected.size(), kThreads * kKeys / 2);
+    check_tree(tree, expected);
+    check_min_fill(tree);
+
+    // the pages of the emptied tree were reused, without that every round
+    // adds a full tree of pages
+    auto pages = BufferManager::get_segment_page_id(tree.nextID);
+    ASSERT_LT(pages, 2 * kThreads * kKeys / (Tree::LeafNode::kCapacity / 2));
+    tree.insert(kThreads * kKeys, 0);
+    expected[kThreads * kKeys] = 0;
+    check_tree(tree, expected);
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, ReadOnlyMapped) {
+    std::remove("0");
+    std::map<uint64_t, uint64_t> expected;
+    {
+        BufferManager buffer_manager(1024, 100);
+        Tree tree(0, buffer_manager);
+        for (uint64_t key = 0; key < 20000; ++key) {
+            tree.insert(key * 2, key);
+            expected[key * 2] = key;
+        }
+    }
+    // lookups and scans read the pages straight from the mapped file
+    BufferManager buffer_manager(1024, 0, BufferManager::Mode::ReadOnlyMapped);
+    Tree tree(0, buffer_manager);
+    ASSERT_TRUE(tree.is_open());
+    check_tree(tree, expected);
+    EXPECT_FALSE(tree.lookup(1));
+    EXPECT_EQ(tree.lookup_latched(400), 200u);
+    std::vector<uint64_t> keys;
+    auto reverse = tree.scan_reverse(100, 200);
+    while (auto entry = reverse.next()) keys.push_back(entry->first);
+    ASSERT_EQ(keys.size(), 51u);
+    EXPECT_EQ(keys.front(), 200u);
+    // changes need exclusive latches, which the mapped pages refuse
+    EXPECT_THROW(tree.insert(1, 1), std::logic_error);
+    EXPECT_EQ(tree.lookup(400), 200u);
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, SwizzledLookupsAfterEviction) {
+    std::remove("0");
+    std::map<uint64_t, uint64_t> expected;
+    {
+        BufferManager buffer_manager(1024, 100);
+        Tree tree(0, buffer_manager);
+        for (uint64_t key = 0; key < 20000; ++key) {
+            tree.insert(key, key + 1);
+            expected[key] = key + 1;
+        }
+    }
+    // a cold pool, far smaller than the leaves: the references of the inner
+    // nodes go stale when their leaves are evicted and are followed again
+    BufferManager buffer_manager(1024, 50);
+    Tree tree(0, buffer_manager);
+    std::mt19937_64 random(9);
+    for (int i = 0; i < 50000; ++i) {
+        uint64_t key = random() % 25000;
+        auto value = tree.lookup(key);
+        if (key < 20000) {
+            ASSERT_EQ(value, key + 1);
+        } else {
+            ASSERT_FALSE(value);
+        }
+    }
+
+    // the inner nodes are found through their references on every lookup,
+    // so they are never evicted once they moved to the LRU queue
+    auto lru = buffer_manager.get_lru_list();
+    auto resident = buffer_manager.get_fifo_list();
+    resident.insert(resident.end(), lru.begin(), lru.end());
+    std::vector<uint64_t> inner{tree.root.load()};
+    for (size_t i = 0; i < inner.size(); ++i) {
+        auto& page = buffer_manager.fix_page(inner[i], false);
+        auto node = reinterpret_cast<Tree::InnerNode*>(page.get_data());
+        if (node->level > 1) inner.insert(inner.end(), node->children, node->children + node->count);
+        buffer_manager.unfix_page(page, false);
+    }
+    ASSERT_GT(inner.size(), 1u);
+    for (auto pageID : inner) {
+        EXPECT_NE(std::find(resident.begin(), resident.end(), pageID), resident.end()) << "page " << pageID;
+    }
+    check_tree(tree, expected);
+}
+
+/// Checks a subtree: its level, keys that are sorted and lie within the
+/// separators around it in the parent, and the leaves, which are appended
+/// in order.
+void check_node(BufferManager &buffer_manager, uint64_t pageID, uint16_t level, std::optional<uint64_t> lower,
+                std::optional<uint64_t> upper, std::vector<uint64_t> &leaves) {
+    auto& page = buffer_manager.fix_page(pageID, false);
+    auto node = reinterpret_cast<Tree::Node*>(page.get_data());
+    ASSERT_EQ(node->level, level);
+    // a child holds the keys up to and including its separator
+    auto inBounds = [&](uint64_t key) { return (!lower || key > *lower) && (!upper || key <= *upper); };
+    std::vector<std::pair<uint64_t, std::optional<uint64_t>>> children;
+    if (node->is_leaf()) {
+        auto leaf = static_cast<Tree::LeafNode*>(node);
+        for (uint32_t i = 0; i < leaf->count; ++i) {
+            ASSERT_TRUE(inBounds(Tree::leaf_key(leaf, i)));
+            if (i > 0) {
+                ASSERT_LT(Tree::leaf_key(leaf, i - 1), Tree::leaf_key(leaf, i));
+            }
+        }
+        leaves.push_back(pageID);
+    } else {
+        auto inner = static_cast<Tree::InnerNode*>(node);
+        ASSERT_GE(inner->count, 2u);
+        for (uint32_t i = 0; i + 1 < inner->count; ++i) {
+            ASSERT_TRUE(inBounds(inner->keys[i]));
+            if (i > 0) {
+                ASSERT_LT(inner->keys[i - 1], inner->keys[i]);
+            }
+        }
+        for (uint32_t i = 0; i < inner->count; ++i) {
+            children.emplace_back(inner->children[i], i + 1 < inner->count ? std::optional(inner->keys[i]) : upper);
+        }
+    }
+    buffer_manager.unfix_page(page, false);
+
+    auto childLower = lower;
+    for (auto& [childID, childUpper] : children) {
+        check_node(buffer_manager, childID, level - 1, childLower, childUpper, leaves);
+        if (testing::Test::HasFatalFailure()) return;
+        childLower = childUpper;
+    }
+}
+
+/// Checks the structure of the whole tree: all leaves are on level 0 and
+/// linked in key order.
+void check_structure(Tree &tree, BufferManager &buffer_manager) {
+    std::vector<uint64_t> leaves;
+    check_node(buffer_manager, tree.root.load(), tree.levelTree, std::nullopt, std::nullopt, leaves);
+    for (size_t i = 0; i < leaves.size(); ++i) {
+        auto& page = buffer_manager.fix_page(leaves[i], false);
+        auto next = Tree::leaf_next(reinterpret_cast<Tree::LeafNode*>(page.get_data()));
+        buffer_manager.unfix_page(page, false);
+        ASSERT_EQ(next, i + 1 < leaves.size() ? leaves[i + 1] : INVALID_PAGE_ID);
+    }
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, ConcurrentSplitsWithoutParentPointers) {
+    std::remove("0");
+    BufferManager buffer_manager(1024, 1000);
+    Tree tree(0, buffer_manager);
+    // the writers split nodes on all levels at once, every split finds the
+    // parent on the path it latched on the way down
+    std::vector<std::thread> threads;
+    for (uint64_t thread = 0; thread < 4; ++thread) {
+        threads.emplace_back([&, thread] {
+            std::mt19937_64 random(thread);
+            for (int i = 0; i < 30000; ++i) {
+                uint64_t key = random() % 1000000 * 4 + thread;
+                tree.insert(key, key + 1);
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+
+    auto stats = tree.get_stats();
+    ASSERT_GE(stats.height, 4u);
+    ASSERT_GT(stats.inner_splits, 0u);
+    check_structure(tree, buffer_manager);
+    std::map<uint64_t, uint64_t> expected;
+    for (uint64_t thread = 0; thread < 4; ++thread) {
+        std::mt19937_64 random(thread);
+        for (int i = 0; i < 30000; ++i) {
+            uint64_t key = random() % 1000000 * 4 + thread;
+            expected[key] = key + 1;
+        }
+    }
+    check_tree(tree, expected);
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, SearchPoliciesAgree) {
+    auto check_all = [](auto keys) {
+        using KeyT = typename decltype(keys)::value_type;
+        check_search<BinarySearch, KeyT>(keys);
+        check_search<LinearSearch, KeyT>(keys);
+        check_search<SimdSearch, KeyT>(keys);
+        // other comparators fall back to the comparator on every key
+        check_search<BinarySearch, KeyT, std::greater<KeyT>>(keys);
+        check_search<LinearSearch, KeyT, std::greater<KeyT>>(keys);
+        check_search<SimdSearch, KeyT, std::greater<KeyT>>(keys);
+    };
+    check_all(arithmetic_keys<uint64_t>());
+    check_all(arithmetic_keys<int64_t>());
+    check_all(arithmetic_keys<uint32_t>());
+    check_all(arithmetic_keys<int32_t>());
+    check_all(arithmetic_keys<uint16_t>());
+    check_all(arithmetic_keys<int8_t>());
+    check_all(arithmetic_keys<double>());
+    check_all(arithmetic_keys<float>());
+
+    // keys that are not arithmetic
+    std::vector<std::array<char, 12>> names;
+    std::mt19937_64 random(7);
+    for (int i = 0; i < 200; ++i) {
+        std::array<char, 12> name{};
+        for (auto& c : name) c = static_cast<char>('a' + random() % 4);
+        names.push_back(name);
+    }
+    check_all(names);
+}
+
+/// Runs the same inserts and erases on a tree of every search policy and
+/// checks that all of them hold the same entries.
+template<typename Policy>
+void check_policy_tree(uint16_t segment, BufferManager &buffer_manager) {
+    using PolicyTree = BTree<int32_t, uint64_t, std::less<int32_t>, 1024, Policy>;
+    // the keys start at a cache line for the vectorized searches, the
+    // capacities fill the page with that padding
+    alignas(64) std::byte buffer[1024];
+    auto leaf = new (buffer) typename PolicyTree::LeafNode();
+    auto inner = new (buffer) typename PolicyTree::InnerNode();
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(inner->keys) % Policy::kKeyAlignment, 0u);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(leaf->keys) % Policy::kKeyAlignment, 0u);
+    EXPECT_LE(sizeof(typename PolicyTree::LeafNode), 1024u);
+    EXPECT_LE(sizeof(typename PolicyTree::InnerNode), 1024u);
+
+    PolicyTree tree(segment, buffer_manager);
+    std::map<int32_t, uint64_t> expected;
+    std::mt19937_64 random(3);
+    for (int i = 0; i < 30000; ++i) {
+        auto key = static_cast<int32_t>(random() % 20000) - 10000;
+        if (random() % 3 == 0) {
+            tree.erase(key);
+            expected.erase(key);
+        } else {
+            tree.insert(key, i);
+            expected[key] = i;
+        }
+    }
+    std::map<int32_t, uint64_t> found;
+    auto it = tree.scan(std::numeric_limits<int32_t>::min(), std::numeric_limits<int32_t>::max());
+    while (auto entry = it.next()) found.insert(*entry);
+    ASSERT_EQ(found, expected);
+    for (int32_t key = -10000; key < 10000; ++key) {
+        auto value = tree.lookup(key);
+        auto pos = expected.find(key);
+        if (pos == expected.end()) {
+            ASSERT_FALSE(value) << "key " << key;
+        } else {
+            ASSERT_EQ(value, pos->second) << "key " << key;
+        }
+    }
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, TreesOfAllSearchPolicies) {
+    std::remove("0");
+    std::remove("1");
+    std::remove("2");
+    BufferManager buffer_manager(1024, 200);
+    check_policy_tree<BinarySearch>(0, buffer_manager);
+    check_policy_tree<LinearSearch>(1, buffer_manager);
+    check_policy_tree<SimdSearch>(2, buffer_manager);
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, ReadModifyWrite) {
+    std::remove("0");
+    BufferManager buffer_manager(1024, 100);
+    Tree tree(0, buffer_manager);
+    // missing keys start from a value-initialized value, enough of them to
+    // split leaves and inner nodes
+    for (uint64_t key = 0; key < 10000; ++key) {
+        tree.upsert(key * 2, [](uint64_t &value) { value += 5; });
+    }
+    EXPECT_EQ(tree.lookup(100), 5u);
+    EXPECT_GT(tree.get_stats().height, 2u);
+
+    EXPECT_FALSE(tree.insert_if_absent(100, 1));
+    EXPECT_EQ(tree.lookup(100), 5u);
+    EXPECT_TRUE(tree.insert_if_absent(101, 1));
+    EXPECT_EQ(tree.lookup(101), 1u);
+
+    EXPECT_FALSE(tree.update_if_present(103, [](uint64_t &value) { value = 7; }));
+    EXPECT_FALSE(tree.lookup(103));
+    EXPECT_TRUE(tree.update_if_present(102, [](uint64_t &value) { value = 7; }));
+    EXPECT_EQ(tree.lookup(102), 7u);
+
+    // concurrent counters lose no increment
+    std::vector<std::thread> threads;
+    for (uint64_t thread = 0; thread < 4; ++thread) {
+        threads.emplace_back([&, thread] {
+            std::mt19937_64 random(thread);
+            for (int i = 0; i < 20000; ++i) {
+                uint64_t key = random() % 5000 * 4 + 1;
+                tree.upsert(key, [](uint64_t &count) { count++; });
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    std::map<uint64_t, uint64_t> expected;
+    for (uint64_t key = 0; key < 10000; ++key) expected[key * 2] = 5;
+    expected[101] = 1;
+    expected[102] = 7;
+    for (uint64_t thread = 0; thread < 4; ++thread) {
+        std::mt19937_64 random(thread);
+        for (int i = 0; i < 20000; ++i) expected[random() % 5000 * 4 + 1]++;
+    }
+    check_tree(tree, expected);
+    EXPECT_EQ(tree.get_stats().updates, 10000u + 2 + 2 + 80000);
+}
+
+/// Looks up every key of the expected entries and its successor in one
+/// batch, in random order.
+void check_lookup_batch(Tree &tree, const std::map<uint64_t, uint64_t> &expected) {
+    std::vector<uint64_t> keys;
+    for (auto& [key, value] : expected) {
+        keys.push_back(key);
+        keys.push_back(key + 1);
+    }
+    std::shuffle(keys.begin(), keys.end(), std::mt19937_64(11));
+    std::vector<std::optional<uint64_t>> found(keys.size());
+    tree.lookup_batch(keys.data(), keys.size(), found.data());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        auto entry = expected.find(keys[i]);
+        if (entry == expected.end()) {
+            ASSERT_FALSE(found[i]) << "key " << keys[i];
+        } else {
+            ASSERT_EQ(found[i], entry->second) << "key " << keys[i];
+        }
+    }
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, LookupBatch) {
+    std::remove("0");
+    // the batch touches far more pages than the pool holds
+    BufferManager buffer_manager(1024, 50);
+    Tree tree(0, buffer_manager);
+    std::map<uint64_t, uint64_t> expected;
+    std::mt19937_64 random(12);
+    for (int i = 0; i < 20000; ++i) {
+        uint64_t key = random() % 100000;
+        tree.insert(key, i);
+        expected[key] = i;
+    }
+    check_lookup_batch(tree, expected);
+
+    // duplicates and keys beyond both ends, in small batches too
+    std::vector<uint64_t> keys{std::numeric_limits<uint64_t>::max(), 0, 0, 100000, 5, 5};
+    for (size_t count = 0; count <= keys.size(); ++count) {
+        std::vector<std::optional<uint64_t>> found(count);
+        tree.lookup_batch(keys.data(), count, found.data());
+        for (size_t i = 0; i < count; ++i) {
+            auto entry = expected.find(keys[i]);
+            ASSERT_EQ(found[i], entry == expected.end() ? std::nullopt : std::optional(entry->second));
+        }
+    }
+    EXPECT_EQ(tree.get_stats().lookups, 2 * expected.size() + 21);
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, LookupBatchEmpty) {
+    std::remove("0");
+    BufferManager buffer_manager(1024, 16);
+    Tree tree(0, buffer_manager);
+    std::vector<uint64_t> keys{3, 1, 2};
+    std::vector<std::optional<uint64_t>> found(keys.size(), 0);
+    tree.lookup_batch(keys.data(), keys.size(), found.data());
+    for (auto& value : found) EXPECT_FALSE(value);
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, InsertBatch) {
+    std::remove("0");
+    BufferManager buffer_manager(1024, 256);
+    Tree tree(0, buffer_manager);
+    std::map<uint64_t, uint64_t> expected;
+    std::mt19937_64 random(42);
+    for (int round = 0; round < 50; ++round) {
+        // unsorted batches with duplicates, some overwrite existing keys
+        size_t count = random() % 2000;
+        std::vector<uint64_t> keys(count), values(count);
+        for (size_t i = 0; i < count; ++i) {
+            keys[i] = random() % 50000;
+            values[i] = random();
+            expected[keys[i]] = values[i];
+        }
+        // the last of duplicate keys in a batch wins
+        tree.insert_batch(keys.data(), values.data(), count);
+        for (int i = 0; i < 100; ++i) {
+            uint64_t key = random() % 50000;
+            tree.erase(key);
+            expected.erase(key);
+        }
+    }
+    check_tree(tree, expected);
+    check_lookup_batch(tree, expected);
+    check_structure(tree, buffer_manager);
+
+    // a batch that fills a leaf many times over splits it into many at once
+    std::vector<uint64_t> keys, values;
+    for (uint64_t key = 0; key < 1000; ++key) {
+        keys.push_back(100000 + key);
+        values.push_back(key);
+        expected[100000 + key] = key;
+    }
+    auto splits = tree.get_stats().leaf_splits;
+    tree.insert_batch(keys.data(), values.data(), keys.size());
+    EXPECT_GE(tree.get_stats().leaf_splits - splits, keys.size() / Tree::LeafNode::kCapacity);
+    check_tree(tree, expected);
+    check_structure(tree, buffer_manager);
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, EdgeSplits) {
+    for (bool ascending : {true, false}) {
+        std::remove("0");
+        BufferManager buffer_manager(1024, 100);
+        Tree tree(0, buffer_manager);
+        std::map<uint64_t, uint64_t> expected;
+        for (uint64_t i = 0; i < 20000; ++i) {
+            uint64_t key = ascending ? i : 20000 - i;
+            tree.insert(key, i);
+            expected[key] = i;
+        }
+        // splits at the edge leave full pages behind, only the pages at the
+        // edge the keys grow to may be emptier
+        auto levels = tree.get_structure();
+        for (size_t level = 0; level + 1 < levels.size(); ++level) {
+            EXPECT_GE(levels[level].fill_histogram[9] + 1, levels[level].pages) << "level " << level;
+        }
+        EXPECT_LE(levels[0].pages * Tree::LeafNode::kCapacity * 9 / 10, expected.size());
+        check_structure(tree, buffer_manager);
+        check_tree(tree, expected);
+
+        // random inserts into the full pages split them in the middle
+        auto pages = levels[0].pages;
+        std::mt19937_64 random(13);
+        for (int i = 0; i < 2000; ++i) {
+            uint64_t key = 100000 + random() % 100000;
+            tree.insert(key, key);
+        }
+        auto after = tree.get_structure();
+        EXPECT_GT(after[0].pages - pages, 2000 / Tree::LeafNode::kCapacity);
+        EXPECT_GT(after[0].fill_histogram[5] + after[0].fill_histogram[6] + after[0].fill_histogram[7], 0u);
+    }
+}
+
+/// Sorted entries `(key * 3, key)` for bulk loading.
+std::vector<std::pair<uint64_t, uint64_t>> sorted_entries(uint64_t count) {
+    std::vector<std::pair<uint64_t, uint64_t>> entries;
+    for (uint64_t key = 0; key < count; ++key) entries.emplace_back(key * 3, key);
+    return entries;
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, BulkLoadFillFactors) {
+    auto entries = sorted_entries(20000);
+    std::map<uint64_t, uint64_t> expected(entries.begin(), entries.end());
+    for (double fill : {1.0, 0.7, 0.1}) {
+        std::remove("0");
+        BufferManager buffer_manager(1024, 200);
+        Tree tree(0, buffer_manager);
+        tree.bulk_load(entries.begin(), entries.end(), fill);
+        check_tree(tree, expected);
+        // all leaves but the last two are filled to the fill factor
+        uint64_t perLeaf = std::max<uint64_t>(1, Tree::LeafNode::kCapacity * fill);
+        auto leaves = tree.get_structure()[0].pages;
+        EXPECT_GE(leaves, (entries.size() + perLeaf - 1) / perLeaf) << fill;
+        EXPECT_LE(leaves, entries.size() / perLeaf + 1) << fill;
+        // the tree takes inserts afterwards
+        for (uint64_t key = 1; key < 3000; key += 3) {
+            tree.insert(key, key);
+            expected[key] = key;
+        }
+        check_tree(tree, expected);
+        for (uint64_t key = 1; key < 3000; key += 3) expected.erase(key);
+    }
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, BulkLoadRejects) {
+    std::remove("0");
+    BufferManager buffer_manager(1024, 100);
+    Tree tree(0, buffer_manager);
+    auto entries = sorted_entries(100);
+    EXPECT_THROW(tree.bulk_load(entries.begin(), entries.end(), 0.0), std::invalid_argument);
+    EXPECT_THROW(tree.bulk_load(entries.begin(), entries.end(), 1.5), std::invalid_argument);
+
+    // no input leaves the tree empty
+    tree.bulk_load(entries.begin(), entries.begin());
+    check_tree(tree, {});
+
+    tree.insert(1, 1);
+    EXPECT_THROW(tree.bulk_load(entries.begin(), entries.end()), std::logic_error);
+    check_tree(tree, {{1, 1}});
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, BulkLoadUnsortedInput) {
+    std::remove("0");
+    BufferManager buffer_manager(1024, 100);
+    Tree tree(0, buffer_manager);
+    auto entries = sorted_entries(20000);
+    auto unsorted = entries;
+    unsorted.back().first = 0;
+    EXPECT_THROW(tree.bulk_load(unsorted.begin(), unsorted.end()), std::invalid_argument);
+    check_tree(tree, {});
+
+    // the next load reuses the pages of the failed one
+    EXPECT_NE(tree.freeHead, INVALID_PAGE_ID);
+    uint64_t nextID = tree.nextID;
+    tree.bulk_load(entries.begin(), entries.end());
+    check_tree(tree, std::map<uint64_t, uint64_t>(entries.begin(), entries.end()));
+    EXPECT_LE(tree.nextID, nextID + 2);
+}
+
+/// Bulk load input that ends the process after `crashAt` entries, once the
+/// log is durable up to there.
+struct CrashingInput {
+    WriteAheadLog *log;
+    uint64_t position;
+    uint64_t crashAt;
+
+    std::pair<uint64_t, uint64_t> operator*() const { return {position * 3, position}; }
+    bool operator!=(const CrashingInput &other) const { return position != other.position; }
+    CrashingInput& operator++() {
+        if (++position == crashAt) {
+            log->flush();
+            _exit(0);
+        }
+        return *this;
+    }
+};
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, BulkLoadCrashReusingFreedPages) {
+    std::remove("0");
+    std::remove("wal.log");
+    pid_t child = fork();
+    ASSERT_NE(child, -1);
+    if (child == 0) {
+        auto log = new WriteAheadLog("wal.log");
+        auto buffer_manager = new BufferManager(1024, 100);
+        buffer_manager->set_log(log);
+        auto tree = new Tree(0, *buffer_manager, log);
+        // erasing all entries again fills the free list
+        for (uint64_t key = 0; key < 20000; ++key) tree->insert(key, key);
+        for (uint64_t key = 0; key < 20000; ++key) tree->erase(key);
+        tree->bulk_load(CrashingInput{log, 0, 15000}, CrashingInput{log, 20000, 0});
+        _exit(1);
+    }
+    int status;
+    ASSERT_EQ(waitpid(child, &status, 0), child);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+
+    WriteAheadLog log("wal.log");
+    BufferManager buffer_manager(1024, 100);
+    buffer_manager.set_log(&log);
+    log.recover(buffer_manager, Tree::redo);
+    Tree tree(0, buffer_manager, &log);
+    check_tree(tree, {});
+    // the recovered free list only holds free pages
+    std::map<uint64_t, uint64_t> expected;
+    for (uint64_t key = 0; key < 30000; ++key) {
+        tree.insert(key * 7 % 30000, key);
+        expected[key * 7 % 30000] = key;
+    }
+    check_tree(tree, expected);
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, PackedLeaves) {
+    std::remove("0");
+    BufferManager buffer_manager(1024, 256);
+    Tree tree(0, buffer_manager);
+    tree.set_leaf_compression(true);
+    std::map<uint64_t, uint64_t> expected;
+    // clustered keys with small values are packed
+    for (uint64_t cluster = 0; cluster < 8; ++cluster) {
+        for (uint64_t key = 0; key < 5000; ++key) {
+            tree.insert((cluster << 40) + key, key % 100);
+            expected[(cluster << 40) + key] = key % 100;
+        }
+    }
+    auto structure = tree.get_structure();
+    EXPECT_GT(structure[0].packed_pages, 0u);
+    EXPECT_LT(structure[0].pages * Tree::LeafNode::kCapacity, expected.size());
+    check_tree(tree, expected);
+    check_lookup_batch(tree, expected);
+
+    // values that need more bits and erases in the packed leaves
+    std::mt19937_64 random(7);
+    for (int i = 0; i < 20000; ++i) {
+        uint64_t key = ((random() % 8) << 40) + random() % 6000;
+        if (i % 3 == 0) {
+            tree.erase(key);
+            expected.erase(key);
+        } else {
+            uint64_t value = i % 2 ? random() : i;
+            tree.insert(key, value);
+            expected[key] = value;
+        }
+    }
+    check_tree(tree, expected);
+    check_lookup_batch(tree, expected);
+
+    // a range in the middle of a cluster
+    auto it = tree.scan((3ull << 40) + 100, (3ull << 40) + 2000);
+    auto entry = expected.lower_bound((3ull << 40) + 100);
+    while (auto found = it.next()) {
+        ASSERT_NE(entry, expected.end());
+        EXPECT_EQ(found->first, entry->first);
+        EXPECT_EQ(found->second, entry->second);
+        ++entry;
+    }
+    EXPECT_TRUE(entry == expected.end() || entry->first > (3ull << 40) + 2000);
+}
+
+// NOLINTNEXTLINE
+TEST(BTreeTest, BulkLoadPackedDescendingValues) {
+    // every appended value is below the value base of its packed leaf
+    std::vector<std::pair<uint64_t, uint64_t>> entries;
+    for (uint64_t key = 0; key < 200000; ++key) entries.emplace_back(key, 1000000 - key);
+    std::map<uint64_t, uint64_t> expected(entries.begin(), entries.end());
+    for (double fill : {1.0, 0.5}) {
+        std::remove("0");
+        BufferManager buffer_manager(1024, 400);
+        Tree tree(0, buffer_manager);
+        tree.set_leaf_compression(true);
+        tree.bulk_load(entries.begin(), entries.end(), fill);
+        auto structure = tree.get_structure();
+        EXPECT_EQ(structure[0].packed_pages, structure[0].pages) << fill;
+        EXPECT_LT(structure[0].pages * Tree::LeafNode::kCapacity * fill, expected.size()) << fill;
+        check_tree(tree, expected);
+
+        // smaller and larger values than the bulk loaded ones
+        for (uint64_t key = 0; key < 200000; key += 97) {
+            uint64_t value = key % 2 ? key : 2000000 + key;
+            tree.insert(key, value);
+            expected[key] = value;
+        }
+        check_tree(tree, expected);
+        expected = std::map<uint64_t, uint64_t>(entries.begin(), entries.end());
+    }
+}
+
+}  // namespace
@@ -0,0 +1,393 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "buffer/buffer_manager.h"
+
+using namespace buzzdb;
+
+namespace {
+
+/// Removes the segment files of earlier tests.
+void remove_segments() {
+    std::remove("0");
+    std::remove("1");
+}
+
+// NOLINTNEXTLINE
+TEST(BufferManagerTest, FIFOEvict) {
+    remove_segments();
+    BufferManager buffer_manager(1024, 10);
+    for (uint64_t i = 1; i < 11; ++i) {
+        auto& page = buffer_manager.fix_page(i, false);
+        buffer_manager.unfix_page(page, false);
+    }
+    EXPECT_EQ(buffer_manager.get_fifo_list(), (std::vector<uint64_t>{1, 2, 3, 4, 5, 6, 7, 8, 9, 10}));
+    EXPECT_TRUE(buffer_manager.get_lru_list().empty());
+
+    // the first page that was loaded is evicted first
+    auto& page = buffer_manager.fix_page(11, false);
+    buffer_manager.unfix_page(page, false);
+    EXPECT_EQ(buffer_manager.get_fifo_list(), (std::vector<uint64_t>{2, 3, 4, 5, 6, 7, 8, 9, 10, 11}));
+    EXPECT_TRUE(buffer_manager.get_lru_list().empty());
+}
+
+// NOLINTNEXTLINE
+TEST(BufferManagerTest, LRUPromotion) {
+    remove_segments();
+    BufferManager buffer_manager(1024, 10);
+    for (uint64_t i : {1, 2, 3, 2, 1, 2}) {
+        auto& page = buffer_manager.fix_page(i, false);
+        buffer_manager.unfix_page(page, false);
+    }
+    // pages that are fixed again move to the end of the LRU queue
+    EXPECT_EQ(buffer_manager.get_fifo_list(), (std::vector<uint64_t>{3}));
+    EXPECT_EQ(buffer_manager.get_lru_list(), (std::vector<uint64_t>{1, 2}));
+}
+
+// NOLINTNEXTLINE
+TEST(BufferManagerTest, EvictLRUWhenFIFOIsFixed) {
+    remove_segments();
+    BufferManager buffer_manager(1024, 3);
+    for (uint64_t i : {1, 2, 1}) {
+        auto& page = buffer_manager.fix_page(i, false);
+        buffer_manager.unfix_page(page, false);
+    }
+    // FIFO: 2, LRU: 1, then page 2 is fixed again and page 3 is loaded:
+    // FIFO: 3, LRU: 1, 2
+    auto& page2 = buffer_manager.fix_page(2, false);
+    auto& page3 = buffer_manager.fix_page(3, false);
+    // all FIFO pages are fixed, the LRU queue has to give up its first page
+    auto& page4 = buffer_manager.fix_page(4, false);
+    EXPECT_EQ(buffer_manager.get_fifo_list(), (std::vector<uint64_t>{3, 4}));
+    EXPECT_EQ(buffer_manager.get_lru_list(), (std::vector<uint64_t>{2}));
+    buffer_manager.unfix_page(page2, false);
+    buffer_manager.unfix_page(page3, false);
+    buffer_manager.unfix_page(page4, false);
+}
+
+// NOLINTNEXTLINE
+TEST(BufferManagerTest, BufferFull) {
+    remove_segments();
+    BufferManager buffer_manager(1024, 10);
+    std::vector<BufferFrame*> pages;
+    for (uint64_t i = 1; i < 11; ++i) {
+        pages.push_back(&buffer_manager.fix_page(i, false));
+    }
+    EXPECT_THROW(buffer_manager.fix_page(11, false), buffer_full_error);
+    // a resident page can still be fixed again
+    auto& page = buffer_manager.fix_page(1, false);
+    buffer_manager.unfix_page(page, false);
+    buffer_manager.unfix_page(*pages[0], false);
+    auto& page11 = buffer_manager.fix_page(11, false);
+    buffer_manager.unfix_page(page11, false);
+    for (size_t i = 1; i < pages.size(); ++i) {
+        buffer_manager.unfix_page(*pages[i], false);
+    }
+}
+
+// NOLINTNEXTLINE
+TEST(BufferManagerTest, Stats) {
+    remove_segments();
+    BufferManager buffer_manager(1024, 4);
+    for (uint64_t i : {1, 2, 3, 4, 1}) {
+        auto& page = buffer_manager.fix_page(i, false);
+        buffer_manager.unfix_page(page, false);
+    }
+    // pages 2 and 3 are evicted clean, page 1 was fixed again
+    for (uint64_t i : {5, 6}) {
+        auto& page = buffer_manager.fix_page(i, true);
+        buffer_manager.unfix_page(page, true);
+    }
+    auto stats = buffer_manager.get_stats();
+    EXPECT_EQ(stats.fixes, 7u);
+    EXPECT_EQ(stats.hits, 1u);
+    EXPECT_EQ(stats.misses, 6u);
+    EXPECT_EQ(stats.evictions, 2u);
+    EXPECT_EQ(stats.write_backs, 0u);
+
+    // evicting pages 4, 5 and 6 writes back the two dirty ones
+    for (uint64_t i : {7, 8, 9}) {
+        auto& page = buffer_manager.fix_page(i, false);
+        buffer_manager.unfix_page(page, false);
+    }
+    stats = buffer_manager.get_stats();
+    EXPECT_EQ(stats.fixes, 10u);
+    EXPECT_EQ(stats.hits, 1u);
+    EXPECT_EQ(stats.misses, 9u);
+    EXPECT_EQ(stats.evictions, 5u);
+    EXPECT_EQ(stats.write_backs, 2u);
+    EXPECT_EQ(buffer_manager.get_lru_list(), (std::vector<uint64_t>{1}));
+}
+
+// NOLINTNEXTLINE
+TEST(BufferManagerTest, SwizzledFixSecondChance) {
+    remove_segments();
+    BufferManager buffer_manager(1024, 4);
+    Swip swip;
+    uint64_t version;
+    bool pinned;
+    auto& page1 = buffer_manager.fix_page_optimistic(1, swip, version, pinned);
+    ASSERT_TRUE(pinned);
+    buffer_manager.unfix_page_optimistic(page1);
+    for (uint64_t i : {2, 3, 4}) {
+        auto& page = buffer_manager.fix_page(i, false);
+        buffer_manager.unfix_page(page, false);
+    }
+    // the reference finds the frame without the page table, the page stays
+    // in the FIFO queue until it would be evicted
+    auto& again = buffer_manager.fix_page_optimistic(1, swip, version, pinned);
+    ASSERT_FALSE(pinned);
+    ASSERT_EQ(&again, &page1);
+    EXPECT_EQ(buffer_manager.get_fifo_list(), (std::vector<uint64_t>{1, 2, 3, 4}));
+
+    // then it moves to the LRU queue and the next page is evicted instead
+    auto& page5 = buffer_manager.fix_page(5, false);
+    buffer_manager.unfix_page(page5, false);
+    EXPECT_EQ(buffer_manager.get_fifo_list(), (std::vector<uint64_t>{3, 4, 5}));
+    EXPECT_EQ(buffer_manager.get_lru_list(), (std::vector<uint64_t>{1}));
+
+    // without another fix it is evicted once the FIFO pages are fixed
+    std::vector<BufferFrame*> pages;
+    for (uint64_t i : {3, 4, 5}) pages.push_back(&buffer_manager.fix_page(i, false));
+    auto& page6 = buffer_manager.fix_page(6, false);
+    EXPECT_EQ(buffer_manager.get_lru_list(), (std::vector<uint64_t>{3, 4, 5}));
+    EXPECT_EQ(buffer_manager.get_fifo_list(), (std::vector<uint64_t>{6}));
+    buffer_manager.unfix_page(page6, false);
+    for (auto* page : pages) buffer_manager.unfix_page(*page, false);
+
+    // a referenced page at the end of the LRU queue that is the only
+    // unfixed one is still evicted
+    pages.clear();
+    for (uint64_t i : {3, 4, 5}) pages.push_back(&buffer_manager.fix_page(i, false));
+    auto& page7 = buffer_manager.fix_page_optimistic(7, swip, version, pinned);
+    buffer_manager.unfix_page_optimistic(page7);
+    buffer_manager.unfix_page(buffer_manager.fix_page(7, false), false);
+    buffer_manager.fix_page_optimistic(7, swip, version, pinned);
+    ASSERT_FALSE(pinned);
+    EXPECT_EQ(buffer_manager.get_lru_list(), (std::vector<uint64_t>{3, 4, 5, 7}));
+    auto& page8 = buffer_manager.fix_page(8, false);
+    EXPECT_EQ(buffer_manager.get_fifo_list(), (std::vector<uint64_t>{8}));
+    buffer_manager.unfix_page(page8, false);
+    for (auto* page : pages) buffer_manager.unfix_page(*page, false);
+}
+
+// NOLINTNEXTLINE
+TEST(BufferManagerTest, BufferFullPerShard) {
+    remove_segments();
+    // two shards of 1024 frames
+    BufferManager buffer_manager(1024, 2048);
+    std::vector<BufferFrame*> pages;
+    uint64_t page_id = 0;
+    try {
+        for (; page_id < 2048; ++page_id) {
+            pages.push_back(&buffer_manager.fix_page(page_id, false));
+        }
+    } catch (const buffer_full_error&) {
+    }
+    // one shard is full before the pool is, pages of the other shard can
+    // still be fixed
+    ASSERT_LT(pages.size(), 2048u);
+    ASSERT_GE(pages.size(), 1024u);
+    size_t more = 0;
+    for (uint64_t other = page_id + 1; other < page_id + 100; ++other) {
+        try {
+            pages.push_back(&buffer_manager.fix_page(other, false));
+            more++;
+        } catch (const buffer_full_error&) {
+        }
+    }
+    EXPECT_GT(more, 0u);
+    EXPECT_LT(more, 99u);
+    for (auto* page : pages) buffer_manager.unfix_page(*page, false);
+}
+
+// NOLINTNEXTLINE
+TEST(BufferManagerTest, ShardedPageTableChurn) {
+    remove_segments();
+    // pages come and go in random order, so the page tables of the shards
+    // see long probe sequences and deletes in the middle of them
+    BufferManager buffer_manager(1024, 2048);
+    std::vector<std::thread> threads;
+    std::atomic<uint64_t> wrong = 0;
+    for (uint64_t thread = 0; thread < 2; ++thread) {
+        threads.emplace_back([&, thread] {
+            std::mt19937_64 random(thread);
+            std::vector<uint64_t> writes(4096);
+            for (int i = 0; i < 100000; ++i) {
+                uint64_t slot = random() % writes.size();
+                uint64_t page_id = BufferManager::get_overall_page_id(thread, slot * 7);
+                bool exclusive = random() % 4 == 0;
+                auto& page = buffer_manager.fix_page(page_id, exclusive);
+                uint64_t stored[2];
+                std::memcpy(stored, page.get_data(), sizeof(stored));
+                // a page that was never written is read as zeros
+                if (writes[slot] != 0 && (stored[0] != page_id || stored[1] != writes[slot])) wrong++;
+                if (exclusive) {
+                    stored[0] = page_id;
+                    stored[1] = ++writes[slot];
+                    std::memcpy(page.get_data(), stored, sizeof(stored));
+                }
+                buffer_manager.unfix_page(page, exclusive);
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    EXPECT_EQ(wrong, 0u);
+    auto stats = buffer_manager.get_stats();
+    EXPECT_GT(stats.evictions, 0u);
+    EXPECT_GT(stats.write_backs, 0u);
+    EXPECT_EQ(stats.fixes, 200000u);
+}
+
+// NOLINTNEXTLINE
+TEST(BufferManagerTest, ArenaDirectIO) {
+    remove_segments();
+    BufferManager::Options options;
+    options.huge_pages = true;
+    options.direct_io = true;
+    EXPECT_THROW(BufferManager(1024, 4, BufferManager::Mode::ReadWrite, options), std::invalid_argument);
+    {
+        // the frames share one arena, every page is aligned for direct I/O
+        BufferManager buffer_manager(4096, 64, BufferManager::Mode::ReadWrite, options);
+        for (uint64_t i = 0; i < 256; ++i) {
+            auto& page = buffer_manager.fix_page(i, true);
+            EXPECT_EQ(reinterpret_cast<uintptr_t>(page.get_data()) % BufferManager::kDirectIOAlignment, 0u);
+            std::memset(page.get_data(), static_cast<int>(i), 4096);
+            buffer_manager.unfix_page(page, true);
+        }
+    }
+    BufferManager buffer_manager(4096, 64, BufferManager::Mode::ReadWrite, options);
+    for (uint64_t i = 0; i < 256; ++i) {
+        auto& page = buffer_manager.fix_page(i, false);
+        auto data = page.get_data();
+        EXPECT_EQ(static_cast<unsigned char>(data[0]), i % 256);
+        EXPECT_EQ(static_cast<unsigned char>(data[4095]), i % 256);
+        buffer_manager.unfix_page(page, false);
+    }
+}
+
+// NOLINTNEXTLINE
+TEST(BufferManagerTest, BackgroundWriter) {
+    remove_segments();
+    BufferManager::Options options;
+    options.background_writer = true;
+    options.clean_fraction = 0.5;
+    BufferManager buffer_manager(1024, 64, BufferManager::Mode::ReadWrite, options);
+    for (uint64_t i = 0; i < 1024; ++i) {
+        auto& page = buffer_manager.fix_page(i, true);
+        std::memcpy(page.get_data(), &i, sizeof(i));
+        buffer_manager.unfix_page(page, true);
+    }
+    // the writer cleans the front of the queues on its own
+    auto written = buffer_manager.get_stats().write_backs;
+    buffer_manager.wake_writer();
+    for (int i = 0; i < 200 && buffer_manager.get_stats().write_backs == written; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_GT(buffer_manager.get_stats().write_backs, written);
+    for (uint64_t i = 0; i < 1024; ++i) {
+        auto& page = buffer_manager.fix_page(i, false);
+        uint64_t value;
+        std::memcpy(&value, page.get_data(), sizeof(value));
+        EXPECT_EQ(value, i);
+        buffer_manager.unfix_page(page, false);
+    }
+
+    // after a flush the file holds every page while the pool still runs
+    for (uint64_t i = 1000; i < 1024; ++i) {
+        auto& page = buffer_manager.fix_page(i, true);
+        uint64_t value = i + 1;
+        std::memcpy(page.get_data(), &value, sizeof(value));
+        buffer_manager.unfix_page(page, true);
+    }
+    buffer_manager.flush_all();
+    BufferManager mapped(1024, 0, BufferManager::Mode::ReadOnlyMapped);
+    for (uint64_t i = 0; i < 1024; ++i) {
+        auto& page = mapped.fix_page(i, false);
+        uint64_t value;
+        std::memcpy(&value, page.get_data(), sizeof(value));
+        EXPECT_EQ(value, i < 1000 ? i : i + 1);
+        mapped.unfix_page(page, false);
+    }
+}
+
+// NOLINTNEXTLINE
+TEST(BufferManagerTest, PersistentPages) {
+    remove_segments();
+    {
+        BufferManager buffer_manager(1024, 4);
+        for (uint16_t segment = 0; segment < 2; ++segment) {
+            for (uint64_t i = 0; i < 16; ++i) {
+                auto page_id = BufferManager::get_overall_page_id(segment, i);
+                auto& page = buffer_manager.fix_page(page_id, true);
+                std::memcpy(page.get_data(), &page_id, sizeof(page_id));
+                buffer_manager.unfix_page(page, true);
+            }
+        }
+        // evicted dirty pages were written back
+        for (uint64_t i = 0; i < 16; ++i) {
+            auto& page = buffer_manager.fix_page(i, false);
+            uint64_t value;
+            std::memcpy(&value, page.get_data(), sizeof(value));
+            EXPECT_EQ(value, i);
+            buffer_manager.unfix_page(page, false);
+        }
+    }
+    // the destructor writes the remaining dirty pages
+    BufferManager buffer_manager(1024, 4);
+    for (uint16_t segment = 0; segment < 2; ++segment) {
+        for (uint64_t i = 0; i < 16; ++i) {
+            auto page_id = BufferManager::get_overall_page_id(segment, i);
+            auto& page = buffer_manager.fix_page(page_id, false);
+            uint64_t value;
+            std::memcpy(&value, page.get_data(), sizeof(value));
+            EXPECT_EQ(value, page_id);
+            buffer_manager.unfix_page(page, false);
+        }
+    }
+}
+
+// NOLINTNEXTLINE
+TEST(BufferManagerTest, ReadOnlyMapped) {
+    remove_segments();
+    {
+        BufferManager buffer_manager(1024, 4);
+        for (uint64_t i = 0; i < 16; ++i) {
+            auto& page = buffer_manager.fix_page(i, true);
+            std::memcpy(page.get_data(), &i, sizeof(i));
+            buffer_manager.unfix_page(page, true);
+        }
+    }
+    BufferManager buffer_manager(1024, 0, BufferManager::Mode::ReadOnlyMapped);
+    buffer_manager.set_access_hint(BufferManager::AccessHint::Random);
+    for (uint64_t round = 0; round < 2; ++round) {
+        for (uint64_t i = 0; i < 16; ++i) {
+            auto& page = buffer_manager.fix_page(i, false);
+            uint64_t value;
+            std::memcpy(&value, page.get_data(), sizeof(value));
+            EXPECT_EQ(value, i);
+            buffer_manager.unfix_page(page, false);
+        }
+    }
+    // the second round found every page mapped
+    auto stats = buffer_manager.get_stats();
+    EXPECT_EQ(stats.fixes, 32u);
+    EXPECT_EQ(stats.hits, 16u);
+
+    EXPECT_THROW(buffer_manager.fix_page(1, true), std::logic_error);
+    auto& page = buffer_manager.fix_page(1, false);
+    EXPECT_THROW(buffer_manager.unfix_page(page, true), std::logic_error);
+    buffer_manager.unfix_page(page, false);
+    EXPECT_THROW(buffer_manager.fix_page(16, false), std::out_of_range);
+    EXPECT_THROW(buffer_manager.fix_page_optimistic(100), std::out_of_range);
+}
+
+}  // namespace
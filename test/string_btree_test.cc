@@ -0,0 +1,166 @@
+#include <cstdio>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "buffer/buffer_manager.h"
+#include "index/string_btree.h"
+
+using namespace buzzdb;
+
+namespace {
+
+using Tree = StringBTree<uint64_t, 4096>;
+
+/// Compares all entries of the tree with the reference.
+void check_tree(Tree &tree, const std::map<std::string, uint64_t> &expected) {
+    std::map<std::string, uint64_t> found;
+    std::string previous;
+    auto it = tree.scan("", std::string(Tree::kMaxKeyLength, '\xff'));
+    while (auto entry = it.next()) {
+        ASSERT_TRUE(found.empty() || previous < entry->first);
+        previous = entry->first;
+        found.emplace(entry->first, entry->second);
+    }
+    ASSERT_EQ(found, expected);
+    for (auto& [key, value] : expected) ASSERT_EQ(tree.lookup(key), value) << key;
+}
+
+// NOLINTNEXTLINE
+TEST(StringBTreeTest, LongSharedPrefixes) {
+    std::remove("1");
+    BufferManager buffer_manager(4096, 512);
+    Tree tree(1, buffer_manager);
+    std::map<std::string, uint64_t> expected;
+    std::vector<std::string> keys;
+    std::mt19937_64 random(7);
+    const std::string prefix = "https://very.long.shared.prefix.example.com/a/b/c/d/e/f/";
+    for (uint64_t i = 0; i < 40000; ++i) {
+        // a few keys share even longer prefixes
+        auto key = prefix + (i % 7 == 0 ? std::string(300, 'x') : "") + std::to_string(random() % 1000000000);
+        keys.push_back(key);
+        tree.insert(key, i);
+        expected[key] = i;
+    }
+    check_tree(tree, expected);
+    EXPECT_FALSE(tree.lookup(prefix));
+    EXPECT_FALSE(tree.lookup(prefix + "x"));
+
+    auto leaves = tree.get_structure()[0].pages;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (i % 20 != 0) {
+            tree.erase(keys[i]);
+            expected.erase(keys[i]);
+        }
+    }
+    check_tree(tree, expected);
+    // underfull leaves are merged
+    EXPECT_LT(tree.get_structure()[0].pages * 4, leaves);
+
+    // the pages of merged leaves are allocated again
+    uint64_t nextID = tree.nextID;
+    for (size_t i = 0; i < keys.size(); i += 2) {
+        tree.insert(keys[i], i);
+        expected[keys[i]] = i;
+    }
+    check_tree(tree, expected);
+    EXPECT_EQ(tree.nextID, nextID);
+}
+
+// NOLINTNEXTLINE
+TEST(StringBTreeTest, EraseAll) {
+    std::remove("1");
+    BufferManager buffer_manager(4096, 256);
+    Tree tree(1, buffer_manager);
+    std::map<std::string, uint64_t> expected;
+    std::string prefix(Tree::kMaxKeyLength - 4, 'p');
+    for (uint64_t i = 0; i < 5000; ++i) {
+        tree.insert(prefix + std::to_string(i), i);
+    }
+    for (uint64_t i = 0; i < 5000; ++i) {
+        tree.erase(prefix + std::to_string(i));
+    }
+    check_tree(tree, expected);
+    for (uint64_t i = 0; i < 5000; i += 3) {
+        tree.insert(prefix + std::to_string(i), i);
+        expected[prefix + std::to_string(i)] = i;
+    }
+    check_tree(tree, expected);
+}
+
+/// Returns the bytes that a page of the tree uses and the retry mark of a
+/// leaf.
+std::pair<uint32_t, uint16_t> leaf_state(BufferManager &buffer_manager, uint64_t pageID) {
+    auto& page = buffer_manager.fix_page(pageID, false);
+    auto node = Tree::as_node(page);
+    std::pair<uint32_t, uint16_t> state{Tree::leaf_used(node), node->mergeRetry};
+    buffer_manager.unfix_page(page, false);
+    return state;
+}
+
+// NOLINTNEXTLINE
+TEST(StringBTreeTest, UnderfullLeafNextToFullSibling) {
+    std::remove("1");
+    BufferManager buffer_manager(4096, 64);
+    Tree tree(1, buffer_manager);
+    auto key = [](uint64_t i) {
+        auto digits = std::to_string(i);
+        return "key" + std::string(6 - digits.size(), '0') + digits;
+    };
+    std::map<std::string, uint64_t> expected;
+    uint64_t count = 0;
+    while (tree.get_structure()[0].pages < 2) {
+        tree.insert(key(count), count);
+        expected[key(count)] = count;
+        count++;
+    }
+    // fill the right leaf up to the last entry that fits
+    auto& rootPage = buffer_manager.fix_page(tree.root.load(), false);
+    auto leftID = Tree::as_node(rootPage)->child(0);
+    auto rightID = Tree::as_node(rootPage)->child(1);
+    buffer_manager.unfix_page(rootPage, false);
+    while (leaf_state(buffer_manager, rightID).first + 64 < 4096) {
+        tree.insert(key(count), count);
+        expected[key(count)] = count;
+        count++;
+    }
+    ASSERT_EQ(tree.get_structure()[0].pages, 2u);
+
+    // the first underflow of the left leaf finds no room in its sibling,
+    // further erases stay on the shared path until the leaf lost another
+    // step of bytes
+    uint64_t next = 0;
+    while (leaf_state(buffer_manager, leftID).second == 0) {
+        tree.erase(key(next));
+        expected.erase(key(next));
+        next++;
+    }
+    auto [used, retry] = leaf_state(buffer_manager, leftID);
+    ASSERT_LT(used, Tree::kMinLeafUsed);
+    ASSERT_EQ(retry, used - Tree::kMergeRetryStep);
+    tree.erase(key(next));
+    expected.erase(key(next));
+    next++;
+    EXPECT_EQ(leaf_state(buffer_manager, leftID).second, retry);
+    while (leaf_state(buffer_manager, leftID).first >= retry) {
+        tree.erase(key(next));
+        expected.erase(key(next));
+        next++;
+    }
+    EXPECT_LT(leaf_state(buffer_manager, leftID).second, retry);
+    check_tree(tree, expected);
+
+    // the empty leaf is merged in the end
+    while (tree.get_structure()[0].pages == 2) {
+        tree.erase(key(next));
+        expected.erase(key(next));
+        next++;
+    }
+    EXPECT_EQ(tree.get_structure()[0].entries, expected.size());
+    check_tree(tree, expected);
+}
+
+}  // namespace
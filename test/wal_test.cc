@@ -0,0 +1,218 @@
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "buffer/buffer_manager.h"
+#include "index/btree.h"
+#include "index/string_btree.h"
+#include "log/wal.h"
+
+using namespace buzzdb;
+
+namespace {
+
+using Tree = BTree<uint64_t, uint64_t, std::less<uint64_t>, 1024>;
+
+constexpr uint64_t kKeys = 20000;
+
+/// Removes the segment file and the log of an earlier run.
+void remove_files() {
+    std::remove("0");
+    std::remove("wal.log");
+    std::remove("wal.log.tmp");
+}
+
+/// The entries the crashed process leaves behind.
+std::map<uint64_t, uint64_t> expected_entries() {
+    std::map<uint64_t, uint64_t> expected;
+    for (uint64_t key = 0; key < kKeys; ++key) {
+        if (key % 10 == 0) expected[key] = key * 2;
+    }
+    for (uint64_t key = 0; key < kKeys; key += 5) expected[key] = key + 1;
+    return expected;
+}
+
+/// Modifies a logged tree in a child process that exits without flushing
+/// any page, like a crash after the last commit.
+/// @param[in] checkpoint   Checkpoints the log after the inserts.
+void run_and_crash(bool checkpoint) {
+    pid_t child = fork();
+    ASSERT_NE(child, -1);
+    if (child == 0) {
+        auto log = new WriteAheadLog("wal.log");
+        auto buffer_manager = new BufferManager(1024, 64);
+        buffer_manager->set_log(log);
+        auto tree = new Tree(0, *buffer_manager, log);
+        std::vector<std::thread> threads;
+        for (uint64_t thread = 0; thread < 4; ++thread) {
+            threads.emplace_back([&, thread] {
+                for (uint64_t key = thread; key < kKeys; key += 4) tree->insert(key, key * 2);
+            });
+        }
+        for (auto& thread : threads) thread.join();
+        if (checkpoint) log->checkpoint(*buffer_manager);
+        for (uint64_t key = 0; key < kKeys; ++key) {
+            if (key % 10 != 0) tree->erase(key);
+        }
+        for (uint64_t key = 0; key < kKeys; key += 5) tree->insert(key, key + 1);
+        _exit(0);
+    }
+    int status;
+    ASSERT_EQ(waitpid(child, &status, 0), child);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+}
+
+/// Recovers the tree twice, the second time from the pages the first
+/// recovery wrote back, and compares it with the expected entries.
+void recover_and_check() {
+    auto expected = expected_entries();
+    for (int round = 0; round < 2; ++round) {
+        WriteAheadLog log("wal.log");
+        BufferManager buffer_manager(1024, 64);
+        buffer_manager.set_log(&log);
+        log.recover(buffer_manager, Tree::redo);
+        Tree tree(0, buffer_manager, &log);
+        std::map<uint64_t, uint64_t> found;
+        auto it = tree.scan(0, UINT64_MAX);
+        while (auto entry = it.next()) found.insert(*entry);
+        EXPECT_EQ(found, expected) << "round " << round;
+        buffer_manager.flush_all();
+    }
+}
+
+// NOLINTNEXTLINE
+TEST(WriteAheadLogTest, RecoverAfterCrash) {
+    remove_files();
+    run_and_crash(false);
+    recover_and_check();
+}
+
+// NOLINTNEXTLINE
+TEST(WriteAheadLogTest, RecoverAfterCheckpoint) {
+    remove_files();
+    run_and_crash(true);
+    recover_and_check();
+}
+
+// NOLINTNEXTLINE
+TEST(WriteAheadLogTest, InterruptedCheckpoint) {
+    remove_files();
+    run_and_crash(false);
+    // a checkpoint that crashed before its new log replaced the old one
+    {
+        std::ofstream tmp("wal.log.tmp", std::ios::binary);
+        tmp << "partial";
+    }
+    recover_and_check();
+    // the next checkpoint starts its new log from scratch
+    {
+        WriteAheadLog log("wal.log");
+        BufferManager buffer_manager(1024, 64);
+        buffer_manager.set_log(&log);
+        log.recover(buffer_manager, Tree::redo);
+        log.checkpoint(buffer_manager);
+    }
+    EXPECT_NE(access("wal.log.tmp", F_OK), 0);
+    recover_and_check();
+}
+
+// NOLINTNEXTLINE
+TEST(WriteAheadLogTest, TornTail) {
+    remove_files();
+    char page[64] = {};
+    uint64_t lsn;
+    {
+        WriteAheadLog log("wal.log");
+        for (int i = 0; i < 10; ++i) lsn = log.log_change(1, page, 1, "abcdef", 6);
+        log.flush();
+    }
+    std::ifstream in("wal.log", std::ios::binary | std::ios::ate);
+    auto size = static_cast<off_t>(in.tellg());
+    ASSERT_EQ(truncate("wal.log", size - 3), 0);
+    // the incomplete last record is dropped and its LSN is used again
+    WriteAheadLog log("wal.log");
+    EXPECT_EQ(log.log_change(1, page, 1, "abcdef", 6), lsn);
+}
+
+// NOLINTNEXTLINE
+TEST(WriteAheadLogTest, RejectShortFile) {
+    remove_files();
+    {
+        std::ofstream out("wal.log", std::ios::binary);
+        out << "abc";
+    }
+    EXPECT_THROW(WriteAheadLog("wal.log"), std::runtime_error);
+}
+
+// NOLINTNEXTLINE
+TEST(WriteAheadLogTest, SharedLogOfBothTrees) {
+    using StringTree = StringBTree<uint64_t, 1024>;
+    remove_files();
+    std::remove("1");
+    pid_t child = fork();
+    ASSERT_NE(child, -1);
+    if (child == 0) {
+        auto log = new WriteAheadLog("wal.log");
+        auto buffer_manager = new BufferManager(1024, 64);
+        buffer_manager->set_log(log);
+        auto tree = new Tree(0, *buffer_manager, log);
+        auto stringTree = new StringTree(1, *buffer_manager, log);
+        for (uint64_t key = 0; key < kKeys; ++key) {
+            tree->insert(key, key * 2);
+            stringTree->insert(std::to_string(key), key * 3);
+        }
+        for (uint64_t key = 0; key < kKeys; key += 2) {
+            tree->erase(key);
+            stringTree->erase(std::to_string(key));
+        }
+        // the last inserts are still in the pool when the process ends
+        for (uint64_t key = kKeys - 2000; key < kKeys; key += 2) {
+            tree->insert(key, key * 5);
+            stringTree->insert(std::to_string(key), key * 7);
+        }
+        _exit(0);
+    }
+    int status;
+    ASSERT_EQ(waitpid(child, &status, 0), child);
+    ASSERT_TRUE(WIFEXITED(status));
+
+    // the types of the changes of both trees do not overlap, every change
+    // is replayed by the tree it belongs to
+    WriteAheadLog log("wal.log");
+    BufferManager buffer_manager(1024, 64);
+    buffer_manager.set_log(&log);
+    log.recover(buffer_manager, [](char* page, uint8_t type, const char* payload, uint32_t size) {
+        Tree::redo(page, type, payload, size);
+        StringTree::redo(page, type, payload, size);
+    });
+    Tree tree(0, buffer_manager, &log);
+    StringTree stringTree(1, buffer_manager, &log);
+    std::map<uint64_t, uint64_t> found;
+    auto it = tree.scan(0, UINT64_MAX);
+    while (auto entry = it.next()) found.insert(*entry);
+    std::map<std::string, uint64_t> foundStrings;
+    auto stringIt = stringTree.scan("", std::string(StringTree::kMaxKeyLength, '\xff'));
+    while (auto entry = stringIt.next()) foundStrings.emplace(entry->first, entry->second);
+    ASSERT_EQ(found.size(), kKeys / 2 + 1000);
+    ASSERT_EQ(foundStrings.size(), kKeys / 2 + 1000);
+    for (uint64_t key = 1; key < kKeys; key += 2) {
+        EXPECT_EQ(found[key], key * 2);
+        EXPECT_EQ(foundStrings[std::to_string(key)], key * 3);
+    }
+    for (uint64_t key = kKeys - 2000; key < kKeys; key += 2) {
+        EXPECT_EQ(found[key], key * 5);
+        EXPECT_EQ(foundStrings[std::to_string(key)], key * 7);
+    }
+}
+
+}  // namespace
@@ -0,0 +1,322 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+
+#include "buffer/buffer_manager.h"
+#include "log/wal.h"
+#include "storage/segment.h"
+
+using namespace std;
+
+namespace buzzdb {
+
+/// The parts of a tree in a segment that do not depend on the layout of its
+/// nodes: the metadata page that opens the tree again, the allocation of
+/// pages with a list of freed pages, logging, and how forward iterators
+/// follow the chain of leaves. `BTree` and `StringBTree` derive from it.
+///
+/// The first page of the segment is the metadata page, the root starts as
+/// its second page.
+template<size_t PageSize>
+struct TreeSegment : public Segment {
+    /// The root page of the tree. Only changed while `root_latch` is held
+    /// exclusively, optimistic readers load it without the latch.
+    std::atomic<uint64_t> root;
+
+    /// The level of the root page. Protected by `root_latch`.
+    uint16_t levelTree = 0;
+
+    /// Latch for `root` and `levelTree`. Writers keep it exclusively until
+    /// they know that the root will not change.
+    std::shared_mutex root_latch;
+
+    /// The first page of the segment. It records everything that is needed
+    /// to open the tree again and is logged together with every change of
+    /// the structure.
+    struct Metadata {
+        /// The LSN of the page, see `WriteAheadLog`.
+        uint64_t lsn = 0;
+        /// Identifies an initialized metadata page of the kind of tree.
+        uint64_t magic;
+        uint64_t root;
+        uint64_t nextID;
+        uint64_t freeHead;
+        uint16_t levelTree;
+    };
+
+    /// A page in the list of freed pages.
+    struct FreePage {
+        /// The LSN of the page, see `WriteAheadLog`.
+        uint64_t lsn = 0;
+        /// The next freed page, `INVALID_PAGE_ID` at the end of the list.
+        uint64_t next;
+    };
+
+    /// The magic of the metadata page of the kind of tree.
+    uint64_t metadataMagic;
+
+    /// The page id of the metadata page.
+    uint64_t metadataID;
+
+    /// The next unused page id of the segment. Protected by `freePagesLatch`.
+    uint64_t nextID;
+
+    /// The first page of the list of freed pages, which are linked through
+    /// `FreePage::next`. Protected by `freePagesLatch`.
+    uint64_t freeHead = INVALID_PAGE_ID;
+    std::mutex freePagesLatch;
+
+    /// The log of all changes, nullptr when changes are not logged.
+    WriteAheadLog* log;
+
+    /// Constructor. Opens the tree of the segment when its metadata page is
+    /// initialized with `magic`, which only reads that page. Otherwise the
+    /// derived tree has to call `create_root()`.
+    /// @param[in] segment_id       The segment that holds the pages.
+    /// @param[in] buffer_manager   The buffer manager.
+    /// @param[in] log              Logs every change when given.
+    /// @param[in] magic            Identifies the metadata of the tree.
+    TreeSegment(uint16_t segment_id, BufferManager &buffer_manager, WriteAheadLog* log, uint64_t magic)
+        : Segment(segment_id, buffer_manager), metadataMagic(magic), log(log) {
+        this->metadataID = BufferManager::get_overall_page_id(segment_id, 0);
+        // latched shared, so trees in read-only buffer managers open too
+        auto& metadataPage = this->buffer_manager.fix_page(this->metadataID, false);
+        auto metadata = reinterpret_cast<Metadata*>(metadataPage.get_data());
+        if (metadata->magic == this->metadataMagic) {
+            this->root = metadata->root;
+            this->levelTree = metadata->levelTree;
+            this->nextID = metadata->nextID;
+            this->freeHead = metadata->freeHead;
+        } else {
+            this->root = INVALID_PAGE_ID;
+        }
+        this->buffer_manager.unfix_page(metadataPage, false);
+    }
+
+    /// Did the constructor find a tree in the segment?
+    bool is_open() const { return this->root.load() != INVALID_PAGE_ID; }
+
+    /// Starts a new tree with an empty root and logs it with the metadata.
+    /// @param[in] init     Initializes the data of the root page.
+    template<typename Init>
+    void create_root(Init init) {
+        auto& metadataPage = this->buffer_manager.fix_page(this->metadataID, true);
+        this->root = BufferManager::get_overall_page_id(this->segment_id, 1);
+        this->nextID = BufferManager::get_overall_page_id(this->segment_id, 2);
+        auto& rootPage = this->buffer_manager.fix_page(this->root.load(), true);
+        init(rootPage.get_data());
+        write_metadata(metadataPage);
+        auto lsn = log_pages({{this->metadataID, &metadataPage}, {this->root.load(), &rootPage}});
+        this->buffer_manager.unfix_page(rootPage, true);
+        this->buffer_manager.unfix_page(metadataPage, true);
+        commit(lsn);
+    }
+
+    /// Logs the new content of pages that are latched exclusively as one
+    /// change, which recovery replays completely or not at all.
+    /// @return             The LSN of the change, 0 when nothing is logged.
+    uint64_t log_pages(const vector<pair<uint64_t, BufferFrame*>> &pages) {
+        if (!this->log) return 0;
+        vector<pair<uint64_t, char*>> images;
+        images.reserve(pages.size());
+        for (auto& [pageID, page] : pages) {
+            images.emplace_back(pageID, page->get_data());
+        }
+        return this->log->log_pages(images, PageSize);
+    }
+
+    /// Logs a change of a single page that is latched exclusively. It is
+    /// replayed by the `redo()` of the tree.
+    /// @return             The LSN of the change, 0 when nothing is logged.
+    uint64_t log_change(uint64_t pageID, BufferFrame &page, uint8_t type, const void* payload, uint32_t size) {
+        if (!this->log) return 0;
+        return this->log->log_change(pageID, page.get_data(), type, payload, size);
+    }
+
+    /// Returns when the change with the given LSN is durable. Called after
+    /// all latches are released, so concurrent operations share one sync.
+    void commit(uint64_t lsn) {
+        if (lsn != 0) this->log->flush(lsn);
+    }
+
+    /// Returns an unused page of the segment, prefers freed pages. A page
+    /// that is allocated by a change that never becomes durable is lost
+    /// after a crash, but never used twice.
+    /// The first freed page is latched before `freePagesLatch`, never while
+    /// it is held: the change that freed the page keeps it latched until it
+    /// wrote the metadata. As a page is only freed while it is latched
+    /// exclusively, the link read from it is still valid when the page is
+    /// still the first one of the list.
+    /// @param[out] reused  Set when the page was taken from the free list.
+    ///                     Its new content must not be logged before the
+    ///                     metadata without it, see `log_metadata()`.
+    uint64_t allocate_page(bool *reused = nullptr) {
+        while (true) {
+            std::unique_lock free_guard(this->freePagesLatch);
+            if (this->freeHead == INVALID_PAGE_ID) {
+                if (reused) *reused = false;
+                return this->nextID++;
+            }
+            auto pageID = this->freeHead;
+            free_guard.unlock();
+
+            auto& page = this->buffer_manager.fix_page(pageID, false);
+            auto next = reinterpret_cast<FreePage*>(page.get_data())->next;
+            free_guard.lock();
+            bool taken = this->freeHead == pageID;
+            if (taken) this->freeHead = next;
+            free_guard.unlock();
+            this->buffer_manager.unfix_page(page, false);
+            if (taken) {
+                if (reused) *reused = true;
+                return pageID;
+            }
+            // another change took the page first
+        }
+    }
+
+    /// Logs the metadata page on its own. Changes that log their pages one
+    /// after another call it when they took a page from the free list,
+    /// before they log the page: recovery must never find a page in the
+    /// free list that holds a node.
+    /// @return             The LSN of the change, 0 when nothing is logged.
+    uint64_t log_metadata() {
+        auto& metadataPage = this->buffer_manager.fix_page(this->metadataID, true);
+        write_metadata(metadataPage);
+        auto lsn = log_pages({{this->metadataID, &metadataPage}});
+        this->buffer_manager.unfix_page(metadataPage, true);
+        return lsn;
+    }
+
+    /// Returns pages that were allocated but never became part of the tree
+    /// to the free list, e.g. when building a part of the tree failed. The
+    /// pages must not be fixed.
+    void free_pages(const vector<uint64_t> &pageIDs) {
+        // bounds the pages that are fixed at once
+        constexpr size_t kFreeBatch = 16;
+        for (size_t begin = 0; begin < pageIDs.size(); begin += kFreeBatch) {
+            vector<pair<uint64_t, BufferFrame*>> freed;
+            for (size_t i = begin; i < std::min(pageIDs.size(), begin + kFreeBatch); i++) {
+                freed.emplace_back(pageIDs[i], &this->buffer_manager.fix_page(pageIDs[i], true));
+            }
+            vector<pair<uint64_t, BufferFrame*>> modified;
+            auto lsn = log_structure(modified, freed);
+            for (auto& entry : modified) {
+                this->buffer_manager.unfix_page(*entry.second, true);
+            }
+            commit(lsn);
+        }
+    }
+
+    /// Writes the current state of the tree into the metadata page.
+    void write_metadata(BufferFrame &metadataPage) {
+        std::unique_lock free_guard(this->freePagesLatch);
+        write_metadata_latched(metadataPage);
+    }
+
+    /// Writes the current state of the tree into the metadata page while
+    /// `freePagesLatch` is held.
+    void write_metadata_latched(BufferFrame &metadataPage) {
+        auto metadata = new (metadataPage.get_data()) Metadata();
+        metadata->magic = this->metadataMagic;
+        metadata->root = this->root.load();
+        metadata->levelTree = this->levelTree;
+        metadata->nextID = this->nextID;
+        metadata->freeHead = this->freeHead;
+    }
+
+    /// Logs a change of the structure of the tree together with the metadata
+    /// page. Publishes a new root and adds pages to the free list before
+    /// the metadata is written, so no other change can log them first. The
+    /// pages are added and the metadata is written under one hold of
+    /// `freePagesLatch`.
+    /// @param[in,out] modified     The changed pages, which are latched
+    ///                             exclusively. The metadata page and the
+    ///                             freed pages are appended and have to be
+    ///                             unfixed by the caller as well.
+    /// @param[in] freed            Pages that left the tree, latched
+    ///                             exclusively.
+    /// @param[in] newRoot          The new root page and its level.
+    /// @return                     The LSN of the change.
+    uint64_t log_structure(vector<pair<uint64_t, BufferFrame*>> &modified,
+                           const vector<pair<uint64_t, BufferFrame*>> &freed,
+                           optional<pair<uint64_t, uint16_t>> newRoot = std::nullopt) {
+        auto& metadataPage = this->buffer_manager.fix_page(this->metadataID, true);
+        if (newRoot) {
+            this->root = newRoot->first;
+            this->levelTree = newRoot->second;
+        }
+        {
+            std::unique_lock free_guard(this->freePagesLatch);
+            for (auto& [pageID, page] : freed) {
+                auto freePage = new (page->get_data()) FreePage();
+                freePage->next = this->freeHead;
+                this->freeHead = pageID;
+                modified.emplace_back(pageID, page);
+            }
+            write_metadata_latched(metadataPage);
+        }
+        modified.emplace_back(this->metadataID, &metadataPage);
+        return log_pages(modified);
+    }
+
+    /// The position of a forward iterator in the chain of leaves. Iterators
+    /// copy the entries of one leaf at once and move on through its sibling
+    /// link, which is only followed when the leaf was not modified since it
+    /// was copied. Versions belong to frames, so the frame is remembered as
+    /// well: a leaf that was evicted and loaded again resides in another
+    /// frame, or in the same one with a newer version.
+    struct LeafCursor {
+        /// The current leaf.
+        uint64_t leafID = INVALID_PAGE_ID;
+
+        /// The frame the current leaf was copied from and its version then.
+        const BufferFrame *leafFrame = nullptr;
+        uint64_t leafVersion = 0;
+
+        /// Remembers the current leaf once its entries are copied and
+        /// unfixes it.
+        /// @param[in] leaf     The current leaf, latched shared.
+        void leave(BufferManager &buffer_manager, BufferFrame &leaf) {
+            leafFrame = &leaf;
+            leafVersion = leaf.get_version();
+            buffer_manager.unfix_page(leaf, false);
+        }
+
+        /// Moves to the right sibling of the current leaf.
+        /// @param[in] next     Reads the sibling link from the data of a leaf.
+        /// @return             The sibling, latched shared. Nullptr when the
+        ///                     link cannot be trusted, then the iterator
+        ///                     has to descend from the root again.
+        template<typename Next>
+        BufferFrame* fix_next(BufferManager &buffer_manager, Next next) {
+            auto& curr = buffer_manager.fix_page_optimistic(leafID);
+            uint64_t nextID = next(curr.get_data());
+            bool unchanged = &curr == leafFrame && curr.validate(leafVersion);
+            if (unchanged && nextID != INVALID_PAGE_ID) {
+                auto& sibling = buffer_manager.fix_page(nextID, false);
+                // The link is only trustworthy when the current leaf was not
+                // modified until the sibling was latched.
+                if (curr.validate(leafVersion)) {
+                    buffer_manager.unfix_page_optimistic(curr);
+                    leafID = nextID;
+                    return &sibling;
+                }
+                buffer_manager.unfix_page(sibling, false);
+            }
+            buffer_manager.unfix_page_optimistic(curr);
+            return nullptr;
+        }
+    };
+};
+
+}
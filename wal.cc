@@ -0,0 +1,345 @@
+#include "log/wal.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "buffer/buffer_manager.h"
+
+
+/*
+The log file starts with a header of the magic number and the LSN of its
+first byte. Records follow one after another:
+
+    uint32_t size       size of the record including this header
+    uint32_t checksum   CRC-32C of everything behind the checksum
+    uint64_t lsn        LSN behind the record
+    entries             until the end of the record, every entry is
+                        uint64_t page_id, uint8_t type, uint32_t size and the
+                        payload of `size` bytes
+
+The LSN of a record is the position behind it in the log, counted from the
+first record ever appended, so LSNs grow monotonically across checkpoints.
+A checkpoint never truncates the log in place: the new header is synced in
+a temporary file that atomically replaces the log, so the LSN of the first
+byte survives every crash. A log file without a header is never valid.
+Appending only copies the record into a buffer. `flush()` elects one of the
+waiting threads to write the buffer and sync the file, the others wait until
+the LSN they need is durable. Threads that append while a write is running
+are served together by the next write.
+*/
+
+
+namespace buzzdb {
+
+namespace {
+
+constexpr uint64_t kMagic = 0x31304c4157425a42ull;  // "BZBWAL01"
+constexpr uint64_t kFileHeaderSize = 2 * sizeof(uint64_t);
+constexpr uint32_t kRecordHeaderSize = 2 * sizeof(uint32_t) + sizeof(uint64_t);
+constexpr uint32_t kEntryHeaderSize = sizeof(uint64_t) + sizeof(uint8_t) + sizeof(uint32_t);
+
+/// CRC-32C (Castagnoli) of a byte range.
+uint32_t crc32c(const char* data, size_t size) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> table{};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+            }
+            table[i] = crc;
+        }
+        return table;
+    }();
+    uint32_t crc = ~0u;
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+void write_fully(int fd, const char* data, size_t size, uint64_t offset) {
+    size_t bytes_written = 0;
+    while (bytes_written < size) {
+        auto result = ::pwrite(fd, data + bytes_written, size - bytes_written,
+                               static_cast<off_t>(offset + bytes_written));
+        if (result < 0) {
+            if (errno == EINTR) continue;
+            throw std::system_error(errno, std::generic_category(), "cannot write log");
+        }
+        bytes_written += result;
+    }
+}
+
+void sync_file(int fd) {
+    if (::fdatasync(fd) != 0) {
+        throw std::system_error(errno, std::generic_category(), "cannot sync log");
+    }
+}
+
+/// Makes the creation or renaming of a file in its directory durable.
+void sync_directory(const std::string& path) {
+    auto slash = path.rfind('/');
+    std::string directory = slash == std::string::npos ? "." : path.substr(0, std::max<size_t>(slash, 1));
+    int dir_fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "cannot open directory of log");
+    }
+    if (::fsync(dir_fd) != 0) {
+        auto error = errno;
+        ::close(dir_fd);
+        throw std::system_error(error, std::generic_category(), "cannot sync directory of log");
+    }
+    ::close(dir_fd);
+}
+
+template <typename T>
+T load(const char* data) {
+    T value;
+    std::memcpy(&value, data, sizeof(T));
+    return value;
+}
+
+}  // namespace
+
+
+WriteAheadLog::WriteAheadLog(const std::string& path)
+: path(path) {
+    fd = ::open(path.c_str(), O_RDWR);
+    if (fd < 0 && errno == ENOENT) {
+        // a new log appears with its header or not at all
+        reset_file();
+        return;
+    }
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "cannot open log " + path);
+    }
+    struct stat status;
+    if (::fstat(fd, &status) != 0) {
+        auto error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), "cannot open log " + path);
+    }
+
+    // restarting at LSN 0 would make recovery skip the records of pages that
+    // carry newer LSNs, so a short file is corrupt rather than empty
+    char header[kFileHeaderSize];
+    if (static_cast<uint64_t>(status.st_size) < kFileHeaderSize ||
+        ::pread(fd, header, kFileHeaderSize, 0) != static_cast<ssize_t>(kFileHeaderSize) ||
+        load<uint64_t>(header) != kMagic) {
+        ::close(fd);
+        throw std::runtime_error("not a log file: " + path);
+    }
+    base_lsn = load<uint64_t>(header + sizeof(uint64_t));
+    file_end = read_records([](uint64_t, const char*, uint32_t) {});
+    if (::ftruncate(fd, static_cast<off_t>(file_end)) != 0) {
+        auto error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), "cannot truncate log " + path);
+    }
+    end_lsn = flushed_lsn = base_lsn + file_end - kFileHeaderSize;
+}
+
+
+WriteAheadLog::~WriteAheadLog() {
+    try {
+        flush();
+    } catch (...) {
+        // the records that could not be written are lost like in a crash
+    }
+    if (fd >= 0) ::close(fd);
+}
+
+
+uint64_t WriteAheadLog::read_records(const std::function<void(uint64_t lsn, const char* body, uint32_t size)>& visit) {
+    struct stat status;
+    if (::fstat(fd, &status) != 0) {
+        throw std::system_error(errno, std::generic_category(), "cannot read log");
+    }
+    std::vector<char> content(status.st_size);
+    size_t bytes_read = 0;
+    while (bytes_read < content.size()) {
+        auto result = ::pread(fd, content.data() + bytes_read, content.size() - bytes_read, bytes_read);
+        if (result < 0) {
+            if (errno == EINTR) continue;
+            throw std::system_error(errno, std::generic_category(), "cannot read log");
+        }
+        if (result == 0) break;
+        bytes_read += result;
+    }
+    content.resize(bytes_read);
+
+    // the first record that is incomplete or does not match its checksum
+    // was torn by a crash, everything behind it was never acknowledged
+    uint64_t offset = kFileHeaderSize;
+    while (offset + kRecordHeaderSize <= content.size()) {
+        const char* record = content.data() + offset;
+        auto size = load<uint32_t>(record);
+        if (size < kRecordHeaderSize || offset + size > content.size()) break;
+        auto checksum = load<uint32_t>(record + sizeof(uint32_t));
+        if (crc32c(record + 2 * sizeof(uint32_t), size - 2 * sizeof(uint32_t)) != checksum) break;
+        auto lsn = load<uint64_t>(record + 2 * sizeof(uint32_t));
+        if (lsn != base_lsn + offset + size - kFileHeaderSize) break;
+        visit(lsn, record + kRecordHeaderSize, size - kRecordHeaderSize);
+        offset += size;
+    }
+    return offset;
+}
+
+
+uint64_t WriteAheadLog::append(const std::vector<Entry>& entries) {
+    uint32_t size = kRecordHeaderSize;
+    for (auto& entry : entries) {
+        size += kEntryHeaderSize + entry.size;
+    }
+
+    std::unique_lock guard(latch);
+    uint64_t lsn = end_lsn + size;
+    size_t offset = buffer.size();
+    buffer.resize(offset + size);
+    char* record = buffer.data() + offset;
+    std::memcpy(record, &size, sizeof(uint32_t));
+    std::memcpy(record + 2 * sizeof(uint32_t), &lsn, sizeof(uint64_t));
+
+    char* out = record + kRecordHeaderSize;
+    for (auto& entry : entries) {
+        // the image of a page contains its new LSN already
+        std::memcpy(entry.page, &lsn, sizeof(uint64_t));
+        std::memcpy(out, &entry.page_id, sizeof(uint64_t));
+        std::memcpy(out + sizeof(uint64_t), &entry.type, sizeof(uint8_t));
+        std::memcpy(out + sizeof(uint64_t) + sizeof(uint8_t), &entry.size, sizeof(uint32_t));
+        std::memcpy(out + kEntryHeaderSize, entry.payload, entry.size);
+        out += kEntryHeaderSize + entry.size;
+    }
+    uint32_t checksum = crc32c(record + 2 * sizeof(uint32_t), size - 2 * sizeof(uint32_t));
+    std::memcpy(record + sizeof(uint32_t), &checksum, sizeof(uint32_t));
+    end_lsn = lsn;
+    return lsn;
+}
+
+
+uint64_t WriteAheadLog::log_pages(const std::vector<std::pair<uint64_t, char*>>& pages, uint32_t page_size) {
+    std::vector<Entry> entries;
+    entries.reserve(pages.size());
+    for (auto& [page_id, page] : pages) {
+        entries.push_back({page_id, page, kPageImage, page, page_size});
+    }
+    return append(entries);
+}
+
+
+uint64_t WriteAheadLog::log_change(uint64_t page_id, char* page, uint8_t type, const void* payload, uint32_t size) {
+    return append({{page_id, page, type, payload, size}});
+}
+
+
+void WriteAheadLog::flush(uint64_t lsn) {
+    std::unique_lock guard(latch);
+    lsn = std::min(lsn, end_lsn);
+    while (flushed_lsn < lsn) {
+        if (flushing) {
+            flushed_cv.wait(guard);
+            continue;
+        }
+
+        // this thread writes everything that was appended so far, also for
+        // all threads that wait meanwhile
+        flushing = true;
+        std::vector<char> batch;
+        batch.swap(buffer);
+        uint64_t batch_lsn = end_lsn;
+        uint64_t offset = file_end;
+        guard.unlock();
+        try {
+            write_fully(fd, batch.data(), batch.size(), offset);
+            sync_file(fd);
+        } catch (...) {
+            guard.lock();
+            buffer.insert(buffer.begin(), batch.begin(), batch.end());
+            flushing = false;
+            flushed_cv.notify_all();
+            throw;
+        }
+        guard.lock();
+        file_end = offset + batch.size();
+        flushed_lsn = batch_lsn;
+        flushing = false;
+        flushed_cv.notify_all();
+    }
+}
+
+
+void WriteAheadLog::recover(BufferManager& buffer_manager, const RedoFunction& redo) {
+    read_records([&](uint64_t lsn, const char* body, uint32_t size) {
+        const char* end = body + size;
+        while (body < end) {
+            auto page_id = load<uint64_t>(body);
+            auto type = load<uint8_t>(body + sizeof(uint64_t));
+            auto payload_size = load<uint32_t>(body + sizeof(uint64_t) + sizeof(uint8_t));
+            const char* payload = body + kEntryHeaderSize;
+            body += kEntryHeaderSize + payload_size;
+
+            auto& page = buffer_manager.fix_page(page_id, true);
+            bool replay = load<uint64_t>(page.get_data()) < lsn;
+            if (replay) {
+                if (type == kPageImage) {
+                    std::memcpy(page.get_data(), payload, payload_size);
+                } else {
+                    redo(page.get_data(), type, payload, payload_size);
+                    std::memcpy(page.get_data(), &lsn, sizeof(uint64_t));
+                }
+            }
+            buffer_manager.unfix_page(page, replay);
+        }
+    });
+}
+
+
+void WriteAheadLog::checkpoint(BufferManager& buffer_manager) {
+    flush();
+    buffer_manager.flush_all();
+    std::unique_lock guard(latch);
+    while (flushing) {
+        flushed_cv.wait(guard);
+    }
+    reset_file();
+}
+
+
+void WriteAheadLog::reset_file() {
+    char header[kFileHeaderSize];
+    std::memcpy(header, &kMagic, sizeof(uint64_t));
+    std::memcpy(header + sizeof(uint64_t), &end_lsn, sizeof(uint64_t));
+
+    // a temporary file that is left behind by a crash is overwritten
+    auto temp_path = path + ".tmp";
+    int temp_fd = ::open(temp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (temp_fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "cannot create log " + temp_path);
+    }
+    try {
+        write_fully(temp_fd, header, kFileHeaderSize, 0);
+        sync_file(temp_fd);
+        if (::rename(temp_path.c_str(), path.c_str()) != 0) {
+            throw std::system_error(errno, std::generic_category(), "cannot replace log " + path);
+        }
+    } catch (...) {
+        ::close(temp_fd);
+        throw;
+    }
+    if (fd >= 0) ::close(fd);
+    fd = temp_fd;
+    base_lsn = flushed_lsn = end_lsn;
+    file_end = kFileHeaderSize;
+    sync_directory(path);
+}
+
+}
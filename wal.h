@@ -0,0 +1,139 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+namespace buzzdb {
+
+class BufferManager;
+
+/// A redo log with group commit. Every record changes one or more pages and
+/// is applied atomically during recovery: a record is either replayed
+/// completely or, when it was torn by a crash, not at all.
+///
+/// Pages that are logged must start with a `uint64_t` that holds the log
+/// sequence number (LSN) of the last record that changed the page. The log
+/// stamps that LSN into the pages while it appends a record, so the caller
+/// has to hold the pages exclusively. Recovery only replays records that are
+/// newer than the LSN of the page, which makes replaying idempotent.
+class WriteAheadLog {
+public:
+    /// Type of a change that replaces a whole page.
+    static constexpr uint8_t kPageImage = 0;
+
+    /// Replays a change of another type on a page. The owners of pages
+    /// number their types in disjoint ranges and ignore all others, so a log
+    /// shared by several kinds of trees is recovered with a function that
+    /// passes every change to the `redo()` of each kind.
+    /// @param[in] page     The data of the page, latched exclusively.
+    /// @param[in] type     The type of the change, never `kPageImage`.
+    /// @param[in] payload  The payload that was logged with the change.
+    /// @param[in] size     The size of the payload.
+    using RedoFunction = std::function<void(char* page, uint8_t type, const char* payload, uint32_t size)>;
+
+private:
+    /// Path of the log file.
+    std::string path;
+
+    /// File descriptor of the log file.
+    int fd = -1;
+
+    /// Protects all members below.
+    std::mutex latch;
+
+    /// Signals that `flushed_lsn` changed.
+    std::condition_variable flushed_cv;
+
+    /// Records that were appended but not written yet.
+    std::vector<char> buffer;
+
+    /// LSN of the first byte of the log file, changes with checkpoints.
+    uint64_t base_lsn = 0;
+
+    /// LSN behind the last appended record.
+    uint64_t end_lsn = 0;
+
+    /// All records up to this LSN are on disk.
+    uint64_t flushed_lsn = 0;
+
+    /// Offset in the log file at which `buffer` is written.
+    uint64_t file_end = 0;
+
+    /// Is a thread writing the buffer right now?
+    bool flushing = false;
+
+    /// Reads the valid records of the log file.
+    /// @param[in] visit    Called with the LSN and the body of every record.
+    /// @return             The offset behind the last valid record.
+    uint64_t read_records(const std::function<void(uint64_t lsn, const char* body, uint32_t size)>& visit);
+
+    /// A change of one page in a record.
+    struct Entry {
+        uint64_t page_id;
+        char* page;
+        uint8_t type;
+        const void* payload;
+        uint32_t size;
+    };
+
+    /// Appends a record with the given changes, stamps its LSN into the
+    /// pages and returns the LSN.
+    uint64_t append(const std::vector<Entry>& entries);
+
+    /// Replaces the log file by an empty one whose first LSN is `end_lsn`.
+    /// The new file is written and synced under a temporary name and then
+    /// renamed over the log, so a crash leaves either the old or the new log.
+    void reset_file();
+
+public:
+    /// Constructor. Opens the log file or creates it when it does not exist,
+    /// a torn record at the end is cut off. An existing file without a
+    /// complete header is rejected as corrupt.
+    /// @param[in] path     The path of the log file.
+    explicit WriteAheadLog(const std::string& path);
+
+    /// Destructor. Writes all appended records.
+    ~WriteAheadLog();
+
+    /// Logs new images of pages in one record.
+    /// @param[in] pages        The page ids and data of the pages.
+    /// @param[in] page_size    The size of every page.
+    /// @return                 The LSN of the record.
+    uint64_t log_pages(const std::vector<std::pair<uint64_t, char*>>& pages, uint32_t page_size);
+
+    /// Logs a change of a single page that is replayed by the `RedoFunction`
+    /// of the owner of the page.
+    /// @param[in] page_id      The id of the page.
+    /// @param[in] page         The data of the page.
+    /// @param[in] type         The type of the change, not `kPageImage`.
+    /// @param[in] payload      The data that is needed to replay the change.
+    /// @param[in] size         The size of the payload.
+    /// @return                 The LSN of the record.
+    uint64_t log_change(uint64_t page_id, char* page, uint8_t type, const void* payload, uint32_t size);
+
+    /// Returns when all records up to `lsn` are on disk. Threads that wait
+    /// at the same time share a single write and sync of the log file.
+    /// @param[in] lsn      The LSN that has to be durable, all appended
+    ///                     records when omitted.
+    void flush(uint64_t lsn = UINT64_MAX);
+
+    /// Replays all records of the log on the pages of the buffer manager.
+    /// Has to be called before the pages are used.
+    /// @param[in] buffer_manager   The buffer manager that holds the pages.
+    /// @param[in] redo             Replays changes other than page images.
+    void recover(BufferManager& buffer_manager, const RedoFunction& redo);
+
+    /// Writes all dirty pages of the buffer manager to disk and empties the
+    /// log. Must not run concurrently with threads that change pages.
+    /// @param[in] buffer_manager   The buffer manager that holds the pages.
+    void checkpoint(BufferManager& buffer_manager);
+};
+
+}